@@ -0,0 +1,107 @@
+/**
+ * @file aesd-append.c
+ * @brief Offset reservation for concurrent appends to the data file
+ *
+ * A writer reserves the range for its whole line with one atomic add and writes it with
+ * pwrite() while other writers fill their own ranges, so lines never interleave. Ranges are
+ * published in file order: a writer whose predecessors are still writing waits for them,
+ * which takes no longer than their pwrite(). Readers load the published mark and may read
+ * everything below it without any lock.
+ */
+
+#include <string.h>
+#include <time.h>
+#include "aesd-append.h"
+
+/**
+ * Start with an empty file
+ */
+void aesd_append_init(struct aesd_append *append)
+{
+	memset(append, 0, sizeof(*append));
+	pthread_mutex_init(&append->lock, NULL);
+	pthread_cond_init(&append->turn, NULL);
+}
+
+void aesd_append_destroy(struct aesd_append *append)
+{
+	pthread_cond_destroy(&append->turn);
+	pthread_mutex_destroy(&append->lock);
+}
+
+/**
+ * Reserve @param len bytes at the end of the file
+ * @return file offset of the first reserved byte
+ */
+size_t aesd_append_reserve(struct aesd_append *append, size_t len)
+{
+	return __atomic_fetch_add(&append->reserved, len, __ATOMIC_RELAXED);
+}
+
+/**
+ * Wait until every range before @param start is published, the caller is then the only
+ * one allowed to publish and can do work that must happen in file order
+ */
+void aesd_append_wait(struct aesd_append *append, size_t start)
+{
+	if (__atomic_load_n(&append->published, __ATOMIC_ACQUIRE) == start)
+		return;
+	pthread_mutex_lock(&append->lock);
+// Seen by a publisher storing after our check below, see aesd_append_publish()
+	__atomic_add_fetch(&append->waiters, 1, __ATOMIC_SEQ_CST);
+	while (__atomic_load_n(&append->published, __ATOMIC_SEQ_CST) != start)
+		pthread_cond_wait(&append->turn, &append->lock);
+	__atomic_sub_fetch(&append->waiters, 1, __ATOMIC_SEQ_CST);
+	pthread_mutex_unlock(&append->lock);
+}
+
+/**
+ * Make the range [@param start, start + @param len) visible to readers, called after
+ * aesd_append_wait() once the range is written
+ */
+void aesd_append_publish(struct aesd_append *append, size_t start, size_t len)
+{
+	__atomic_store_n(&append->published, start + len, __ATOMIC_SEQ_CST);
+	if (__atomic_load_n(&append->waiters, __ATOMIC_SEQ_CST)) {
+		pthread_mutex_lock(&append->lock);
+		pthread_cond_broadcast(&append->turn);
+		pthread_mutex_unlock(&append->lock);
+	}
+}
+
+/**
+ * Wait until more than @param offset bytes are published or @param timeout_ms passed,
+ * for readers following the end of the file
+ * @return high water mark
+ */
+size_t aesd_append_wait_published(struct aesd_append *append, size_t offset, unsigned int timeout_ms)
+{
+	struct timespec deadline;
+	int result = 0;
+
+	if (__atomic_load_n(&append->published, __ATOMIC_ACQUIRE) > offset)
+		return aesd_append_published(append);
+	clock_gettime(CLOCK_REALTIME, &deadline);
+	deadline.tv_sec += timeout_ms / 1000;
+	deadline.tv_nsec += (timeout_ms % 1000) * 1000000L;
+	if (deadline.tv_nsec >= 1000000000L) {
+		deadline.tv_sec++;
+		deadline.tv_nsec -= 1000000000L;
+	}
+	pthread_mutex_lock(&append->lock);
+// Publishers broadcast turn while anyone waits, writers waiting for their turn recheck
+	__atomic_add_fetch(&append->waiters, 1, __ATOMIC_SEQ_CST);
+	while (__atomic_load_n(&append->published, __ATOMIC_SEQ_CST) <= offset && result == 0)
+		result = pthread_cond_timedwait(&append->turn, &append->lock, &deadline);
+	__atomic_sub_fetch(&append->waiters, 1, __ATOMIC_SEQ_CST);
+	pthread_mutex_unlock(&append->lock);
+	return aesd_append_published(append);
+}
+
+/**
+ * @return high water mark, bytes below it are written and never change
+ */
+size_t aesd_append_published(struct aesd_append *append)
+{
+	return __atomic_load_n(&append->published, __ATOMIC_ACQUIRE);
+}
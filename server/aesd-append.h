@@ -0,0 +1,40 @@
+/*
+ * aesd-append.h
+ *
+ *  @brief Offset reservation for concurrent appends to the data file, published in file order
+ */
+
+#ifndef AESD_APPEND_H
+#define AESD_APPEND_H
+
+#include <stddef.h>
+#include <pthread.h>
+
+struct aesd_append
+{
+    /**
+     * End of the last reserved range, writers take ranges with an atomic add
+     */
+    size_t reserved;
+    /**
+     * High water mark, every byte below it is written, read without locking
+     */
+    size_t published;
+    /**
+     * Writers waiting for the ranges before theirs to be published, and readers for new data
+     */
+    int waiters;
+    pthread_mutex_t lock;
+    pthread_cond_t turn;
+};
+
+extern void aesd_append_init(struct aesd_append *append);
+extern void aesd_append_destroy(struct aesd_append *append);
+
+extern size_t aesd_append_reserve(struct aesd_append *append, size_t len);
+extern void aesd_append_wait(struct aesd_append *append, size_t start);
+extern void aesd_append_publish(struct aesd_append *append, size_t start, size_t len);
+extern size_t aesd_append_wait_published(struct aesd_append *append, size_t offset, unsigned int timeout_ms);
+extern size_t aesd_append_published(struct aesd_append *append);
+
+#endif /* AESD_APPEND_H */
@@ -0,0 +1,314 @@
+/**
+ * @file aesd-buffer-pool.c
+ * @brief Size classed, thread cached pool of packet and response buffers
+ *
+ * Buffers are rounded up to a power of two class. Freed buffers go to a free list of the
+ * calling thread and are handed out again without locking; only when that list runs empty
+ * or full buffers move in batches to or from a shared free list. Classes smaller than a slab
+ * are carved from slabs which are kept until the pool is destroyed, larger classes are
+ * malloc()ed one by one and free()d once the shared list is full.
+ */
+
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include "aesd-buffer-pool.h"
+
+#define CLASS_SIZE(c) ((size_t)1 << (AESD_BUFFER_POOL_MIN_SHIFT + (c)))
+#define MAX_CLASS_SIZE CLASS_SIZE(AESD_BUFFER_POOL_CLASSES - 1)
+#define STATS_FOLD (64)		// thread counts added to the shared counters this often
+
+// Free buffers are linked through their first bytes
+struct free_buffer {
+	struct free_buffer *next;
+};
+
+struct free_list {
+	struct free_buffer *head;
+	size_t count;
+};
+
+struct thread_cache {
+	struct free_list lists[AESD_BUFFER_POOL_CLASSES];
+	struct aesd_buffer_pool_stats stats;	// not yet added to the shared counters
+	unsigned int ops;
+};
+
+// Slab header, keeps the buffers behind it aligned
+struct slab {
+	struct slab *next;
+} __attribute__((aligned(16)));
+
+static struct {
+	pthread_once_t once;
+	pthread_key_t key;			// per thread struct thread_cache
+	pthread_mutex_t lock;			// protects lists and slabs
+	struct free_list lists[AESD_BUFFER_POOL_CLASSES];
+	struct slab *slabs;
+	struct aesd_buffer_pool_stats stats;	// updated atomically
+} pool = {
+	.once = PTHREAD_ONCE_INIT,
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+};
+
+static void thread_cache_free(void *cache);
+
+static void pool_init(void)
+{
+	pthread_key_create(&pool.key, thread_cache_free);
+}
+
+static int size_class(size_t size)
+{
+	int c = 0;
+
+	while (CLASS_SIZE(c) < size)
+		c++;
+	return c;
+}
+
+static size_t class_limit(int c, size_t bytes)
+{
+	size_t limit = bytes / CLASS_SIZE(c);
+	return limit ? limit : 1;
+}
+
+static bool is_slab_class(int c)
+{
+	return CLASS_SIZE(c) < AESD_BUFFER_POOL_SLAB_SIZE;
+}
+
+static void list_push(struct free_list *list, void *buf)
+{
+	struct free_buffer *b = buf;
+	b->next = list->head;
+	list->head = b;
+	list->count++;
+}
+
+static void *list_pop(struct free_list *list)
+{
+	struct free_buffer *b = list->head;
+	if (b) {
+		list->head = b->next;
+		list->count--;
+	}
+	return b;
+}
+
+static void stats_fold(struct thread_cache *cache)
+{
+	__atomic_fetch_add(&pool.stats.hits, cache->stats.hits, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&pool.stats.misses, cache->stats.misses, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&pool.stats.oversize, cache->stats.oversize, __ATOMIC_RELAXED);
+	memset(&cache->stats, 0, sizeof(cache->stats));
+	cache->ops = 0;
+}
+
+static void stats_count(struct thread_cache *cache, unsigned long *count)
+{
+	(*count)++;
+	if (++cache->ops == STATS_FOLD)
+		stats_fold(cache);
+}
+
+// Threads without a cache count directly in the shared counters
+#define COUNT(cache, field) ((cache) ? stats_count((cache), &(cache)->stats.field) \
+		: (void)__atomic_fetch_add(&pool.stats.field, 1, __ATOMIC_RELAXED))
+
+// Give a buffer to the shared list, called with the lock held
+static void shared_push(int c, void *buf)
+{
+	if (!is_slab_class(c) && pool.lists[c].count >= class_limit(c, AESD_BUFFER_POOL_SHARED_BYTES))
+		free(buf);
+	else
+		list_push(&pool.lists[c], buf);
+}
+
+// Cache of the calling thread, created on first use and flushed on thread exit
+static struct thread_cache *thread_cache(void)
+{
+	struct thread_cache *cache;
+
+	pthread_once(&pool.once, pool_init);
+	if (!(cache = pthread_getspecific(pool.key)) && (cache = calloc(1, sizeof(struct thread_cache))))
+		pthread_setspecific(pool.key, cache);
+	return cache;
+}
+
+static void thread_cache_free(void *arg)
+{
+	struct thread_cache *cache = arg;
+	void *buf;
+
+	pthread_mutex_lock(&pool.lock);
+	for (int c = 0; c < AESD_BUFFER_POOL_CLASSES; c++)
+		while ((buf = list_pop(&cache->lists[c])))
+			shared_push(c, buf);
+	pthread_mutex_unlock(&pool.lock);
+	stats_fold(cache);
+	free(cache);
+}
+
+/**
+ * Get a buffer of at least @param size bytes, its contents are undefined
+ * @param allocated receives the usable size, pass it to aesd_buffer_grow() and aesd_buffer_free()
+ * @return buffer or NULL if memory could not be allocated
+ */
+void *aesd_buffer_alloc(size_t size, size_t *allocated)
+{
+	struct thread_cache *cache = thread_cache();
+	struct free_list *list;
+	void *buf;
+	int c;
+
+	if (size > MAX_CLASS_SIZE) {
+		COUNT(cache, oversize);
+		*allocated = size;
+		return malloc(size);
+	}
+	c = size_class(size);
+	*allocated = CLASS_SIZE(c);
+	if (cache && (buf = list_pop(&cache->lists[c]))) {
+		COUNT(cache, hits);
+		return buf;
+	}
+
+// Take a batch from the shared list
+	pthread_mutex_lock(&pool.lock);
+	buf = list_pop(&pool.lists[c]);
+	if (buf && cache) {
+		size_t refill = class_limit(c, AESD_BUFFER_POOL_THREAD_BYTES) / 2;
+		void *extra;
+		while (refill-- && (extra = list_pop(&pool.lists[c])))
+			list_push(&cache->lists[c], extra);
+	}
+	pthread_mutex_unlock(&pool.lock);
+	if (buf) {
+		COUNT(cache, hits);
+		return buf;
+	}
+
+	COUNT(cache, misses);
+	if (!is_slab_class(c))
+		return malloc(CLASS_SIZE(c));
+
+// Carve a new slab, the first buffer is returned and the rest cached
+	struct slab *slab = malloc(sizeof(struct slab) + AESD_BUFFER_POOL_SLAB_SIZE);
+	if (!slab)
+		return NULL;
+	buf = slab + 1;
+	list = cache ? &cache->lists[c] : &pool.lists[c];
+	pthread_mutex_lock(&pool.lock);
+	slab->next = pool.slabs;
+	pool.slabs = slab;
+	for (size_t i = 1; i < AESD_BUFFER_POOL_SLAB_SIZE / CLASS_SIZE(c); i++)
+		list_push(list, (char *)buf + i * CLASS_SIZE(c));
+	pthread_mutex_unlock(&pool.lock);
+	return buf;
+}
+
+/**
+ * Make room for at least @param size bytes, growing geometrically, the first @param used
+ * bytes are kept
+ * @param allocated current usable size, updated
+ * @return buffer, possibly moved, or NULL if memory could not be allocated, then @param buf
+ * is left untouched
+ */
+void *aesd_buffer_grow(void *buf, size_t used, size_t size, size_t *allocated)
+{
+	size_t new_size = *allocated ? *allocated : size;
+	size_t new_allocated;
+	void *new_buf;
+
+	if (size <= *allocated)
+		return buf;
+	while (new_size < size)
+		new_size *= 2;
+
+// Buffers above the largest class are plain malloc() memory
+	if (*allocated > MAX_CLASS_SIZE) {
+		if ((new_buf = realloc(buf, new_size)))
+			*allocated = new_size;
+		return new_buf;
+	}
+	if (!(new_buf = aesd_buffer_alloc(new_size, &new_allocated)))
+		return NULL;
+	if (used)
+		memcpy(new_buf, buf, used);
+	aesd_buffer_free(buf, *allocated);
+	*allocated = new_allocated;
+	return new_buf;
+}
+
+/**
+ * Return a buffer to the pool, @param allocated is the size aesd_buffer_alloc() or
+ * aesd_buffer_grow() reported for it
+ */
+void aesd_buffer_free(void *buf, size_t allocated)
+{
+	struct thread_cache *cache;
+	int c;
+
+	if (!buf)
+		return;
+	if (allocated > MAX_CLASS_SIZE) {
+		free(buf);
+		return;
+	}
+	c = size_class(allocated);
+	cache = thread_cache();
+	if (cache && cache->lists[c].count < class_limit(c, AESD_BUFFER_POOL_THREAD_BYTES)) {
+		list_push(&cache->lists[c], buf);
+		return;
+	}
+
+// Thread cache full, move half of it with this buffer to the shared list
+	pthread_mutex_lock(&pool.lock);
+	shared_push(c, buf);
+	if (cache) {
+		size_t flush = cache->lists[c].count / 2;
+		while (flush--)
+			shared_push(c, list_pop(&cache->lists[c]));
+	}
+	pthread_mutex_unlock(&pool.lock);
+}
+
+/**
+ * Read the counters, counts of threads still running are included in batches of STATS_FOLD
+ */
+void aesd_buffer_pool_stats(struct aesd_buffer_pool_stats *stats)
+{
+	stats->hits = __atomic_load_n(&pool.stats.hits, __ATOMIC_RELAXED);
+	stats->misses = __atomic_load_n(&pool.stats.misses, __ATOMIC_RELAXED);
+	stats->oversize = __atomic_load_n(&pool.stats.oversize, __ATOMIC_RELAXED);
+}
+
+/**
+ * Release all pooled memory, every other thread using the pool must have exited and
+ * every buffer must have been freed
+ */
+void aesd_buffer_pool_destroy(void)
+{
+	struct thread_cache *cache;
+	void *buf;
+
+	pthread_once(&pool.once, pool_init);
+	if ((cache = pthread_getspecific(pool.key))) {
+		pthread_setspecific(pool.key, NULL);
+		thread_cache_free(cache);
+	}
+	pthread_mutex_lock(&pool.lock);
+	for (int c = 0; c < AESD_BUFFER_POOL_CLASSES; c++) {
+		while ((buf = list_pop(&pool.lists[c])))
+			if (!is_slab_class(c))
+				free(buf);
+	}
+	while (pool.slabs) {
+		struct slab *slab = pool.slabs;
+		pool.slabs = slab->next;
+		free(slab);
+	}
+	pthread_mutex_unlock(&pool.lock);
+}
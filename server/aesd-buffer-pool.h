@@ -0,0 +1,41 @@
+/*
+ * aesd-buffer-pool.h
+ *
+ *  @brief Size classed, thread cached pool of packet and response buffers
+ */
+
+#ifndef AESD_BUFFER_POOL_H
+#define AESD_BUFFER_POOL_H
+
+#include <stddef.h>
+
+#define AESD_BUFFER_POOL_MIN_SHIFT 10			// smallest class, 1 KB
+#define AESD_BUFFER_POOL_CLASSES 11			// power of two classes up to 1 MB
+#define AESD_BUFFER_POOL_SLAB_SIZE (64*1024)		// classes below this are carved from slabs
+#define AESD_BUFFER_POOL_THREAD_BYTES (256*1024)	// per class cap of a thread cache
+#define AESD_BUFFER_POOL_SHARED_BYTES (4*1024*1024)	// per class cap of the shared free list
+
+struct aesd_buffer_pool_stats
+{
+    /**
+     * Allocations served from a thread cache or the shared free list
+     */
+    unsigned long hits;
+    /**
+     * Allocations which had to call malloc()
+     */
+    unsigned long misses;
+    /**
+     * Allocations above the largest class, always malloc()ed and free()d
+     */
+    unsigned long oversize;
+};
+
+extern void aesd_buffer_pool_destroy(void);
+extern void aesd_buffer_pool_stats(struct aesd_buffer_pool_stats *stats);
+
+extern void *aesd_buffer_alloc(size_t size, size_t *allocated);
+extern void *aesd_buffer_grow(void *buf, size_t used, size_t size, size_t *allocated);
+extern void aesd_buffer_free(void *buf, size_t allocated);
+
+#endif /* AESD_BUFFER_POOL_H */
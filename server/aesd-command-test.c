@@ -0,0 +1,110 @@
+/**
+ * @file aesd-command-test.c
+ * @brief Tests of the in band command syntax: the prefix check and parsing of arguments, which
+ * must end with the newline of the line and fit in a size_t
+ */
+
+#include <stdint.h>
+#include <string.h>
+#include "aesd-command.h"
+#include "aesd-test.h"
+
+#define ARGS_MAX (3)
+
+// Parse the arguments in the string @param args, which holds no NUL bytes
+static int parse(const char *args, size_t *values, int values_max)
+{
+	return aesd_command_arguments(args, strlen(args), values, values_max);
+}
+
+static void test_line(void)
+{
+	AESD_CHECK(aesd_command_line("AESDSOCKET_STATS\n", 17));
+	AESD_CHECK(aesd_command_line("AESDX", 5));
+	AESD_CHECK(!aesd_command_line("AESD", 4));
+	AESD_CHECK(!aesd_command_line("AESDSOCKET_STATS\n", 3));
+	AESD_CHECK(!aesd_command_line("aesdsocket_stats\n", 17));
+	AESD_CHECK(!aesd_command_line("data\n", 5));
+	AESD_CHECK(!aesd_command_line("\0AESD\n", 6));
+}
+
+static void test_arguments(void)
+{
+	size_t values[ARGS_MAX] = { 0 };
+
+	AESD_CHECK(parse("0\n", values, 1) == 1 && values[0] == 0);
+	AESD_CHECK(parse("42\n", values, 2) == 1 && values[0] == 42);
+	AESD_CHECK(parse("1,22,333\n", values, ARGS_MAX) == 3);
+	AESD_CHECK(values[0] == 1 && values[1] == 22 && values[2] == 333);
+	AESD_CHECK(parse("007,8\n", values, ARGS_MAX) == 2 && values[0] == 7 && values[1] == 8);
+}
+
+// Anything but digits, commas between values and the newline makes the line data
+static void test_malformed(void)
+{
+	size_t values[ARGS_MAX];
+
+	AESD_CHECK(parse("\n", values, ARGS_MAX) == -1);
+	AESD_CHECK(parse("", values, ARGS_MAX) == -1);
+	AESD_CHECK(parse(",1\n", values, ARGS_MAX) == -1);
+	AESD_CHECK(parse("1,\n", values, ARGS_MAX) == -1);
+	AESD_CHECK(parse("1,,2\n", values, ARGS_MAX) == -1);
+	AESD_CHECK(parse("1 ,2\n", values, ARGS_MAX) == -1);
+	AESD_CHECK(parse("-1\n", values, ARGS_MAX) == -1);
+	AESD_CHECK(parse("+1\n", values, ARGS_MAX) == -1);
+	AESD_CHECK(parse("0x10\n", values, ARGS_MAX) == -1);
+	AESD_CHECK(parse("1\r\n", values, ARGS_MAX) == -1);
+	AESD_CHECK(aesd_command_arguments("1\0\n", 3, values, ARGS_MAX) == -1);
+}
+
+// The newline ends the arguments and the line, nothing may follow it
+static void test_newline(void)
+{
+	size_t values[ARGS_MAX];
+
+	AESD_CHECK(parse("1", values, ARGS_MAX) == -1);
+	AESD_CHECK(parse("1,2", values, ARGS_MAX) == -1);
+	AESD_CHECK(parse("1\n2\n", values, ARGS_MAX) == -1);
+	AESD_CHECK(parse("1\n\n", values, ARGS_MAX) == -1);
+	AESD_CHECK(aesd_command_arguments("12\n", 2, values, ARGS_MAX) == -1);
+}
+
+static void test_too_many(void)
+{
+	size_t values[ARGS_MAX + 1] = { 0 };
+
+	AESD_CHECK(parse("1,2\n", values, 1) == -1);
+	AESD_CHECK(parse("1,2,3,4\n", values, ARGS_MAX) == -1);
+	AESD_CHECK(values[ARGS_MAX] == 0);
+	AESD_CHECK(parse("1\n", values, 0) == -1);
+}
+
+static void test_overflow(void)
+{
+	size_t values[ARGS_MAX];
+	char args[64];
+
+	snprintf(args, sizeof(args), "%zu\n", (size_t)SIZE_MAX);
+	AESD_CHECK(parse(args, values, ARGS_MAX) == 1 && values[0] == SIZE_MAX);
+	snprintf(args, sizeof(args), "%zu,%zu\n", (size_t)SIZE_MAX - 1, (size_t)SIZE_MAX);
+	AESD_CHECK(parse(args, values, ARGS_MAX) == 2 && values[0] == SIZE_MAX - 1 && values[1] == SIZE_MAX);
+
+// One more, and ten times as much, do not wrap around
+	snprintf(args, sizeof(args), "%zu\n", (size_t)SIZE_MAX);
+	args[strlen(args) - 2]++;
+	AESD_CHECK(parse(args, values, ARGS_MAX) == -1);
+	snprintf(args, sizeof(args), "1,%zu0\n", (size_t)SIZE_MAX);
+	AESD_CHECK(parse(args, values, ARGS_MAX) == -1);
+	AESD_CHECK(parse("99999999999999999999999999999999,1\n", values, ARGS_MAX) == -1);
+}
+
+int main(void)
+{
+	test_line();
+	test_arguments();
+	test_malformed();
+	test_newline();
+	test_too_many();
+	test_overflow();
+	return aesd_test_result("aesd-command-test");
+}
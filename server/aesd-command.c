@@ -0,0 +1,48 @@
+/**
+ * @file aesd-command.c
+ * @brief Syntax of the in band commands of aesdsocket
+ *
+ * Commands are lines of the data stream, so every received line is checked for the command
+ * prefix and only the few which have it are looked up. Arguments are parsed without strtoul()
+ * because the line is not NUL terminated and may hold NUL bytes, and a value which overflows
+ * makes the line data instead of a command with a clipped argument.
+ */
+
+#include <stdint.h>
+#include <string.h>
+#include "aesd-command.h"
+
+// Only lines starting with the prefix may be commands, data lines take this one check
+bool aesd_command_line(const char *line, size_t len)
+{
+	return len > AESD_COMMAND_PREFIX_LEN && !memcmp(line, AESD_COMMAND_PREFIX, AESD_COMMAND_PREFIX_LEN);
+}
+
+/***
+ * Parse up to @param values_max comma separated decimal numbers ending with the newline of the line
+ * @return number of values parsed, -1 malformed, out of range or too many
+ */
+int aesd_command_arguments(const char *args, size_t len, size_t *values, int values_max)
+{
+	const char *end = args + len;
+
+	for (int n = 0; n < values_max; ) {
+		if (args == end || *args < '0' || *args > '9')
+			return -1;
+		values[n] = 0;
+		while (args < end && *args >= '0' && *args <= '9') {
+			size_t digit = *args++ - '0';
+			if (values[n] > (SIZE_MAX - digit) / 10)
+				return -1;
+			values[n] = values[n] * 10 + digit;
+		}
+		n++;
+		if (args == end)
+			return -1;
+		if (*args == '\n')
+			return (args + 1 == end) ? n : -1;
+		if (*args++ != ',')
+			return -1;
+	}
+	return -1;
+}
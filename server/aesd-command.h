@@ -0,0 +1,20 @@
+/*
+ * aesd-command.h
+ *
+ *  @brief Syntax of the in band commands of aesdsocket: lines starting with a prefix, with
+ *  comma separated decimal arguments
+ */
+
+#ifndef AESD_COMMAND_H
+#define AESD_COMMAND_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#define AESD_COMMAND_PREFIX "AESD"		// in band commands start with it
+#define AESD_COMMAND_PREFIX_LEN (sizeof(AESD_COMMAND_PREFIX) - 1)
+
+extern bool aesd_command_line(const char *line, size_t len);
+extern int aesd_command_arguments(const char *args, size_t len, size_t *values, int values_max);
+
+#endif /* AESD_COMMAND_H */
@@ -0,0 +1,107 @@
+/**
+ * @file aesd-framer-bench.c
+ * @brief Microbenchmark of aesd_framer against the strncat()/strchr() packet buffer it replaced
+ *
+ * Feeds newline terminated lines of 1 KB, 64 KB and 16 MB to both framers in RECV_BUF_SIZE
+ * pieces, as recv() hands them to connection_receive(), and prints the throughput.
+ * Usage: aesd-framer-bench [total_mbytes]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "aesd-framer.h"
+
+#define RECV_BUF_SIZE (1024)
+#define PACKET_BUF_SIZE    (1024+10)
+#define PACKET_BUF_EXPAND  (1024)
+
+static double now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Packet buffer handling as it was in connection_thread()
+static size_t legacy_frame(const char *stream, size_t stream_len)
+{
+	size_t allocated = PACKET_BUF_SIZE, used = 0, lines = 0;
+	char *packet_buf = calloc(1, allocated);
+	char recv_buf[RECV_BUF_SIZE];
+
+	for (size_t pos = 0; pos < stream_len; pos += RECV_BUF_SIZE) {
+		size_t n = (stream_len - pos < RECV_BUF_SIZE) ? stream_len - pos : RECV_BUF_SIZE;
+		memset(recv_buf, 0, sizeof(recv_buf));
+		memcpy(recv_buf, stream + pos, n);
+		if (used + n + 1 >= allocated) {
+			allocated += PACKET_BUF_EXPAND;
+			packet_buf = realloc(packet_buf, allocated);
+		}
+		strncat(packet_buf, recv_buf, n);
+		used += n;
+		if (strchr(packet_buf, '\n')) {
+			lines++;
+			if (allocated > PACKET_BUF_SIZE) {
+				allocated = PACKET_BUF_SIZE;
+				packet_buf = realloc(packet_buf, allocated);
+			}
+			memset(packet_buf, 0, allocated);
+			used = 0;
+		}
+	}
+	free(packet_buf);
+	return lines;
+}
+
+static size_t framer_frame(const char *stream, size_t stream_len)
+{
+	struct aesd_framer framer;
+	size_t lines = 0, len;
+
+	aesd_framer_init(&framer, PACKET_BUF_SIZE);
+	for (size_t pos = 0; pos < stream_len; pos += RECV_BUF_SIZE) {
+		size_t n = (stream_len - pos < RECV_BUF_SIZE) ? stream_len - pos : RECV_BUF_SIZE;
+		aesd_framer_append(&framer, stream + pos, n);
+		while (aesd_framer_next(&framer, &len))
+			lines++;
+		aesd_framer_shrink(&framer);
+	}
+	aesd_framer_free(&framer);
+	return lines;
+}
+
+int main(int argc, char *argv[])
+{
+	const size_t line_sizes[] = { 1024, 64 * 1024, 16 * 1024 * 1024 };
+	size_t total = (argc > 1 ? strtoul(argv[1], NULL, 10) : 32) * 1024 * 1024;
+
+	printf("line_bytes,lines,legacy_mb_s,framer_mb_s,speedup\n");
+	for (size_t i = 0; i < sizeof(line_sizes) / sizeof(line_sizes[0]); i++) {
+		size_t line = line_sizes[i];
+		size_t lines_n = (total / line) ? total / line : 1;
+		size_t stream_len = lines_n * line;
+		char *stream = malloc(stream_len);
+
+		if (!stream) {
+			perror("malloc");
+			return 1;
+		}
+		for (size_t j = 0; j < stream_len; j++)
+			stream[j] = ((j + 1) % line) ? 'a' + j % 26 : '\n';
+
+		double t0 = now();
+		size_t legacy_lines = legacy_frame(stream, stream_len);
+		double t1 = now();
+		size_t framer_lines = framer_frame(stream, stream_len);
+		double t2 = now();
+		if (legacy_lines != lines_n || framer_lines != lines_n)
+			fprintf(stderr, "line count mismatch: %zu %zu %zu\n", lines_n, legacy_lines, framer_lines);
+
+		double mb = stream_len / (1024.0 * 1024.0);
+		printf("%zu,%zu,%.1f,%.1f,%.1f\n", line, lines_n, mb / (t1 - t0), mb / (t2 - t1), (t1 - t0) / (t2 - t1));
+		free(stream);
+	}
+	return 0;
+}
@@ -0,0 +1,140 @@
+/**
+ * @file aesd-framer-test.c
+ * @brief Tests of aesd_framer: lines split across appends, binary lines, lines larger than the
+ * buffer, length prefixed pieces and giving back a grown buffer
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include "aesd-framer.h"
+#include "aesd-buffer-pool.h"
+#include "aesd-test.h"
+
+#define PACKET_BUF_SIZE (1024+10)
+
+// A line arriving in pieces is handed out whole once its newline arrives
+static void test_split(void)
+{
+	struct aesd_framer framer;
+	size_t len;
+	char *line;
+
+	AESD_CHECK(aesd_framer_init(&framer, PACKET_BUF_SIZE) == 0);
+	AESD_CHECK(aesd_framer_append(&framer, "hel", 3) == 0);
+	AESD_CHECK(aesd_framer_next(&framer, &len) == NULL);
+	AESD_CHECK(aesd_framer_append(&framer, "lo\nwor", 6) == 0);
+	line = aesd_framer_next(&framer, &len);
+	AESD_CHECK_BYTES(line, len, "hello\n");
+	AESD_CHECK(aesd_framer_next(&framer, &len) == NULL);
+	AESD_CHECK(aesd_framer_append(&framer, "ld\n\n", 4) == 0);
+	line = aesd_framer_next(&framer, &len);
+	AESD_CHECK_BYTES(line, len, "world\n");
+	line = aesd_framer_next(&framer, &len);
+	AESD_CHECK_BYTES(line, len, "\n");
+	AESD_CHECK(aesd_framer_next(&framer, &len) == NULL);
+	aesd_framer_free(&framer);
+}
+
+// NUL bytes are data, only the newline ends a line
+static void test_binary(void)
+{
+	static const char data[] = "a\0b\0\n\0\n";
+	struct aesd_framer framer;
+	size_t len;
+	char *line;
+
+	AESD_CHECK(aesd_framer_init(&framer, PACKET_BUF_SIZE) == 0);
+	AESD_CHECK(aesd_framer_append(&framer, data, sizeof(data) - 1) == 0);
+	line = aesd_framer_next(&framer, &len);
+	AESD_CHECK(line && len == 5 && !memcmp(line, "a\0b\0\n", 5));
+	line = aesd_framer_next(&framer, &len);
+	AESD_CHECK(line && len == 2 && !memcmp(line, "\0\n", 2));
+	AESD_CHECK(aesd_framer_next(&framer, &len) == NULL);
+	aesd_framer_free(&framer);
+}
+
+/*
+ * A line many times the initial buffer, appended in recv() sized pieces, grows the buffer and
+ * comes out whole, the buffer is given back for an initial size one only once it is empty
+ */
+static void test_oversize(void)
+{
+	size_t size = 4 * AESD_FRAMER_RETAIN_SIZE;
+	char *data = malloc(size);
+	struct aesd_framer framer;
+	size_t len;
+	char *line;
+
+	AESD_CHECK(data != NULL);
+	if (!data)
+		return;
+	for (size_t i = 0; i < size; i++)
+		data[i] = 'a' + i % 26;
+	data[size - 1] = '\n';
+	AESD_CHECK(aesd_framer_init(&framer, PACKET_BUF_SIZE) == 0);
+	for (size_t pos = 0; pos < size - 1; pos += 1024) {
+		size_t n = (size - 1 - pos < 1024) ? size - 1 - pos : 1024;
+		AESD_CHECK(aesd_framer_append(&framer, data + pos, n) == 0);
+		AESD_CHECK(aesd_framer_next(&framer, &len) == NULL);
+	}
+	AESD_CHECK(framer.allocated > AESD_FRAMER_RETAIN_SIZE);
+
+// An incomplete line keeps the grown buffer
+	AESD_CHECK(aesd_framer_shrink(&framer) == 0);
+	AESD_CHECK(framer.allocated > AESD_FRAMER_RETAIN_SIZE);
+
+	AESD_CHECK(aesd_framer_append(&framer, "\nnext", 5) == 0);
+	line = aesd_framer_next(&framer, &len);
+	AESD_CHECK(line && len == size && !memcmp(line, data, size));
+	AESD_CHECK(aesd_framer_next(&framer, &len) == NULL);
+
+// So does the start of the next line
+	AESD_CHECK(aesd_framer_shrink(&framer) == 0);
+	AESD_CHECK(framer.allocated > AESD_FRAMER_RETAIN_SIZE);
+
+	AESD_CHECK(aesd_framer_append(&framer, "\n", 1) == 0);
+	line = aesd_framer_next(&framer, &len);
+	AESD_CHECK_BYTES(line, len, "next\n");
+	AESD_CHECK(aesd_framer_shrink(&framer) == 0);
+	AESD_CHECK(framer.allocated <= AESD_FRAMER_RETAIN_SIZE);
+	AESD_CHECK(framer.used == 0 && framer.start == 0 && framer.scanned == 0);
+
+// The small buffer still frames
+	AESD_CHECK(aesd_framer_append(&framer, "again\n", 6) == 0);
+	line = aesd_framer_next(&framer, &len);
+	AESD_CHECK_BYTES(line, len, "again\n");
+	aesd_framer_free(&framer);
+	free(data);
+}
+
+// Length prefixed pieces are taken without a search, newlines in them do not end lines
+static void test_take(void)
+{
+	struct aesd_framer framer;
+	size_t len;
+	char *data;
+
+	AESD_CHECK(aesd_framer_init(&framer, PACKET_BUF_SIZE) == 0);
+	AESD_CHECK(aesd_framer_append(&framer, "ab\ncd", 5) == 0);
+	AESD_CHECK(aesd_framer_peek(&framer, 6) == NULL);
+	AESD_CHECK(aesd_framer_take(&framer, 6) == NULL);
+	data = aesd_framer_peek(&framer, 4);
+	AESD_CHECK(data && !memcmp(data, "ab\nc", 4));
+	data = aesd_framer_take(&framer, 4);
+	AESD_CHECK(data && !memcmp(data, "ab\nc", 4));
+	AESD_CHECK(aesd_framer_next(&framer, &len) == NULL);
+	AESD_CHECK(aesd_framer_append(&framer, "\n", 1) == 0);
+	data = aesd_framer_next(&framer, &len);
+	AESD_CHECK_BYTES(data, len, "d\n");
+	aesd_framer_free(&framer);
+}
+
+int main(void)
+{
+	test_split();
+	test_binary();
+	test_oversize();
+	test_take();
+	aesd_buffer_pool_destroy();
+	return aesd_test_result("aesd-framer-test");
+}
@@ -0,0 +1,124 @@
+/**
+ * @file aesd-framer.c
+ * @brief Binary safe streaming splitter of received data into newline terminated lines
+ *
+ * Each received byte is searched for a newline once, with memchr() which glibc implements
+ * with vector instructions. Complete lines are handed out in place, the incomplete rest is
+ * moved to the front of the buffer once per append instead of once per line. The buffer comes
+ * from the buffer pool and is kept, only a buffer grown beyond the retain size goes back to
+ * the pool once it is empty. Length prefixed frames are taken out of the same buffer without
+ * a search.
+ */
+
+#include <string.h>
+#include "aesd-framer.h"
+#include "aesd-buffer-pool.h"
+
+/**
+ * Allocate an empty framer with a @param size bytes buffer
+ * @return 0 on success, -1 if memory could not be allocated
+ */
+int aesd_framer_init(struct aesd_framer *framer, size_t size)
+{
+	memset(framer, 0, sizeof(*framer));
+	if (!(framer->buf = aesd_buffer_alloc(size, &framer->allocated)))
+		return -1;
+	framer->initial_size = size;
+	return 0;
+}
+
+void aesd_framer_free(struct aesd_framer *framer)
+{
+	aesd_buffer_free(framer->buf, framer->allocated);
+	framer->buf = NULL;
+	framer->allocated = framer->used = framer->start = framer->scanned = 0;
+}
+
+/**
+ * Add @param len received bytes, the buffer doubles when it is too small
+ * @return 0 on success, -1 if memory could not be allocated
+ */
+int aesd_framer_append(struct aesd_framer *framer, const char *data, size_t len)
+{
+// Drop lines already handed out
+	if (framer->start) {
+		memmove(framer->buf, framer->buf + framer->start, framer->used - framer->start);
+		framer->used -= framer->start;
+		framer->scanned -= framer->start;
+		framer->start = 0;
+	}
+	if (framer->used + len > framer->allocated) {
+		char *buf = aesd_buffer_grow(framer->buf, framer->used, framer->used + len, &framer->allocated);
+		if (!buf)
+			return -1;
+		framer->buf = buf;
+	}
+	memcpy(framer->buf + framer->used, data, len);
+	framer->used += len;
+	return 0;
+}
+
+/**
+ * Get the next complete line, valid until the next aesd_framer_append()
+ * @param len receives the line length including the newline
+ * @return line or NULL if no complete line is buffered
+ */
+char *aesd_framer_next(struct aesd_framer *framer, size_t *len)
+{
+	char *line = framer->buf + framer->start;
+	char *newline = memchr(framer->buf + framer->scanned, '\n', framer->used - framer->scanned);
+
+	if (!newline) {
+		framer->scanned = framer->used;
+		return NULL;
+	}
+	*len = newline - line + 1;
+	framer->start = framer->scanned = newline - framer->buf + 1;
+	return line;
+}
+
+/**
+ * @return the next @param len buffered bytes, valid until the next aesd_framer_append(), or
+ * NULL if fewer are buffered
+ */
+char *aesd_framer_peek(struct aesd_framer *framer, size_t len)
+{
+	return (framer->used - framer->start < len) ? NULL : framer->buf + framer->start;
+}
+
+/**
+ * Take the next @param len buffered bytes like a line of that length
+ * @return the bytes, valid until the next aesd_framer_append(), or NULL if fewer are buffered
+ */
+char *aesd_framer_take(struct aesd_framer *framer, size_t len)
+{
+	char *data = aesd_framer_peek(framer, len);
+
+	if (!data)
+		return NULL;
+	framer->start += len;
+	if (framer->scanned < framer->start)
+		framer->scanned = framer->start;
+	return data;
+}
+
+/**
+ * Swap a buffer grown beyond AESD_FRAMER_RETAIN_SIZE for an initial size one when no
+ * incomplete line is held, smaller buffers are kept as they are
+ * @return 0 on success, -1 if memory could not be allocated
+ */
+int aesd_framer_shrink(struct aesd_framer *framer)
+{
+	size_t allocated;
+
+	if (framer->start != framer->used || framer->allocated <= AESD_FRAMER_RETAIN_SIZE)
+		return 0;
+	char *buf = aesd_buffer_alloc(framer->initial_size, &allocated);
+	if (!buf)
+		return -1;
+	aesd_buffer_free(framer->buf, framer->allocated);
+	framer->buf = buf;
+	framer->allocated = allocated;
+	framer->used = framer->start = framer->scanned = 0;
+	return 0;
+}
@@ -0,0 +1,46 @@
+/*
+ * aesd-framer.h
+ *
+ *  @brief Binary safe streaming splitter of received data into newline terminated lines, or
+ *  into pieces of known length
+ */
+
+#ifndef AESD_FRAMER_H
+#define AESD_FRAMER_H
+
+#include <stddef.h>
+
+#define AESD_FRAMER_RETAIN_SIZE (64*1024)	// larger buffers are given back once emptied
+
+struct aesd_framer
+{
+    /**
+     * Received data, not NUL terminated, may contain NUL bytes
+     */
+    char *buf;
+    size_t allocated;
+    size_t used;
+    /**
+     * Offset of the first byte of the current incomplete line
+     */
+    size_t start;
+    /**
+     * Bytes from start up to here are known not to contain a newline
+     */
+    size_t scanned;
+    /**
+     * Size requested for a new buffer, see aesd_framer_shrink()
+     */
+    size_t initial_size;
+};
+
+extern int aesd_framer_init(struct aesd_framer *framer, size_t size);
+extern void aesd_framer_free(struct aesd_framer *framer);
+
+extern int aesd_framer_append(struct aesd_framer *framer, const char *data, size_t len);
+extern char *aesd_framer_next(struct aesd_framer *framer, size_t *len);
+extern char *aesd_framer_peek(struct aesd_framer *framer, size_t len);
+extern char *aesd_framer_take(struct aesd_framer *framer, size_t len);
+extern int aesd_framer_shrink(struct aesd_framer *framer);
+
+#endif /* AESD_FRAMER_H */
@@ -0,0 +1,226 @@
+/**
+ * @file aesd-group-commit.c
+ * @brief Group commit of data file appends
+ *
+ * Writers queue their line and sleep. The committer thread takes everything queued since
+ * its last round, writes it with one vectored call of the write callback, syncs the file
+ * as the policy asks and wakes the writers of the batch. The more writers wait, the larger
+ * the batches and the fewer the syscalls and syncs per line.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include "aesd-group-commit.h"
+
+static unsigned long long elapsed_ns(const struct timespec *since)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (now.tv_sec - since->tv_sec) * 1000000000ULL + now.tv_nsec - since->tv_nsec;
+}
+
+// Sleep until a line is queued, the queue is stopped or an interval sync is due
+static void committer_wait(struct aesd_commit_queue *queue, bool dirty, const struct timespec *last_sync)
+{
+	struct timespec deadline = *last_sync;
+
+	if (!dirty || queue->sync != AESD_COMMIT_SYNC_INTERVAL) {
+		pthread_cond_wait(&queue->queued, &queue->lock);
+		return;
+	}
+	deadline.tv_sec += queue->interval_ms / 1000;
+	deadline.tv_nsec += (queue->interval_ms % 1000) * 1000000L;
+	if (deadline.tv_nsec >= 1000000000L) {
+		deadline.tv_sec++;
+		deadline.tv_nsec -= 1000000000L;
+	}
+	pthread_cond_timedwait(&queue->queued, &queue->lock, &deadline);
+}
+
+static void *committer_thread(void *arg)
+{
+	struct aesd_commit_queue *queue = arg;
+	struct iovec *iov = NULL;
+	int iov_allocated = 0;
+	bool dirty = false;
+	struct timespec last_sync;
+
+	clock_gettime(CLOCK_MONOTONIC, &last_sync);
+	pthread_mutex_lock(&queue->lock);
+	while (1) {
+		bool sync_due = dirty && queue->sync == AESD_COMMIT_SYNC_INTERVAL
+				&& elapsed_ns(&last_sync) >= queue->interval_ms * 1000000ULL;
+		if (!queue->head && !queue->stopping && !sync_due) {
+			committer_wait(queue, dirty, &last_sync);
+			continue;
+		}
+		struct aesd_commit_entry *batch = queue->head;
+		bool stopping = queue->stopping;
+		queue->head = queue->tail = NULL;
+		pthread_mutex_unlock(&queue->lock);
+
+		struct timespec start;
+		size_t offset = 0;
+		int error = 0, iov_n = 0;
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		for (struct aesd_commit_entry *entry = batch; entry; entry = entry->next)
+			iov_n++;
+		if (iov_n > iov_allocated) {
+			int allocated = iov_allocated ? iov_allocated : 64;
+			while (allocated < iov_n)
+				allocated *= 2;
+			struct iovec *new_iov = realloc(iov, allocated * sizeof(struct iovec));
+			if (new_iov) {
+				iov = new_iov;
+				iov_allocated = allocated;
+			}
+		}
+		if (iov_n && iov_n > iov_allocated) {
+			error = ENOMEM;
+		} else if (iov_n) {
+			int i = 0;
+			for (struct aesd_commit_entry *entry = batch; entry; entry = entry->next, i++) {
+				iov[i].iov_base = (void *)entry->buf;
+				iov[i].iov_len = entry->len;
+			}
+			if (queue->write(queue->ctx, iov, iov_n, &offset) == -1)
+				error = errno;
+			else
+				dirty = (queue->sync != AESD_COMMIT_SYNC_NONE);
+		}
+
+// Batch policy syncs before waking, interval policy when due and when stopping
+		bool synced = false;
+		if (dirty && (queue->sync == AESD_COMMIT_SYNC_BATCH || stopping
+				|| elapsed_ns(&last_sync) >= queue->interval_ms * 1000000ULL)) {
+			if (queue->sync_file(queue->ctx) == -1 && queue->sync == AESD_COMMIT_SYNC_BATCH && !error)
+				error = errno;
+			clock_gettime(CLOCK_MONOTONIC, &last_sync);
+			dirty = false;
+			synced = true;
+		}
+
+		pthread_mutex_lock(&queue->lock);
+		if (synced)
+			queue->stats.syncs++;
+		if (iov_n) {
+			unsigned long long commit_ns = elapsed_ns(&start);
+			queue->stats.batches++;
+			queue->stats.lines += iov_n;
+			if (iov_n > queue->stats.max_batch)
+				queue->stats.max_batch = iov_n;
+			queue->stats.commit_ns += commit_ns;
+			if (commit_ns > queue->stats.max_commit_ns)
+				queue->stats.max_commit_ns = commit_ns;
+		}
+// The entry is gone as soon as its writer sees done
+		for (struct aesd_commit_entry *entry = batch, *next; entry; entry = next) {
+			next = entry->next;
+			entry->offset = offset;
+			entry->error = error;
+			entry->done = true;
+			offset += entry->len;
+		}
+		pthread_cond_broadcast(&queue->committed);
+		if (stopping && !queue->head)
+			break;
+	}
+	pthread_mutex_unlock(&queue->lock);
+	free(iov);
+	return NULL;
+}
+
+/**
+ * Start the committer thread, @param write appends batches and @param sync_file syncs them
+ * @param interval_ms sync interval of AESD_COMMIT_SYNC_INTERVAL
+ * @return 0 on success, -1 if the thread could not be started
+ */
+int aesd_commit_init(struct aesd_commit_queue *queue, enum aesd_commit_sync sync, unsigned int interval_ms,
+		aesd_commit_write_fn write, aesd_commit_sync_fn sync_file, void *ctx)
+{
+	pthread_condattr_t attr;
+
+	memset(queue, 0, sizeof(*queue));
+	queue->sync = sync;
+	queue->interval_ms = interval_ms;
+	queue->write = write;
+	queue->sync_file = sync_file;
+	queue->ctx = ctx;
+	pthread_mutex_init(&queue->lock, NULL);
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	pthread_cond_init(&queue->queued, &attr);
+	pthread_condattr_destroy(&attr);
+	pthread_cond_init(&queue->committed, NULL);
+	if ((errno = pthread_create(&queue->thread, NULL, committer_thread, queue))) {
+		pthread_cond_destroy(&queue->committed);
+		pthread_cond_destroy(&queue->queued);
+		pthread_mutex_destroy(&queue->lock);
+		return -1;
+	}
+	return 0;
+}
+
+/**
+ * Commit what is still queued, sync unless the policy is none and stop the committer
+ * @param stats receives the final counters, may be NULL
+ */
+void aesd_commit_destroy(struct aesd_commit_queue *queue, struct aesd_commit_stats *stats)
+{
+	pthread_mutex_lock(&queue->lock);
+	queue->stopping = true;
+	pthread_cond_signal(&queue->queued);
+	pthread_mutex_unlock(&queue->lock);
+	pthread_join(queue->thread, NULL);
+	if (stats)
+		*stats = queue->stats;
+	pthread_cond_destroy(&queue->committed);
+	pthread_cond_destroy(&queue->queued);
+	pthread_mutex_destroy(&queue->lock);
+}
+
+/**
+ * Queue @param len bytes and wait until the committer has written (and synced) them,
+ * @param buf must stay valid until then
+ * @param offset receives the data file offset of the first byte, may be NULL
+ * @return 0 on success, -1 with errno set
+ */
+int aesd_commit_append(struct aesd_commit_queue *queue, const void *buf, size_t len, size_t *offset)
+{
+	struct aesd_commit_entry entry = { .buf = buf, .len = len };
+
+	pthread_mutex_lock(&queue->lock);
+	if (queue->stopping) {
+		pthread_mutex_unlock(&queue->lock);
+		errno = ESHUTDOWN;
+		return -1;
+	}
+	if (queue->tail) {
+		queue->tail->next = &entry;
+	} else {
+		queue->head = &entry;
+		pthread_cond_signal(&queue->queued);
+	}
+	queue->tail = &entry;
+	while (!entry.done)
+		pthread_cond_wait(&queue->committed, &queue->lock);
+	pthread_mutex_unlock(&queue->lock);
+
+	if (entry.error) {
+		errno = entry.error;
+		return -1;
+	}
+	if (offset)
+		*offset = entry.offset;
+	return 0;
+}
+
+void aesd_commit_stats(struct aesd_commit_queue *queue, struct aesd_commit_stats *stats)
+{
+	pthread_mutex_lock(&queue->lock);
+	*stats = queue->stats;
+	pthread_mutex_unlock(&queue->lock);
+}
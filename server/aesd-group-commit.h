@@ -0,0 +1,94 @@
+/*
+ * aesd-group-commit.h
+ *
+ *  @brief Group commit of data file appends, one committer thread writes queued lines together,
+ *  their writers sleep until it is done
+ */
+
+#ifndef AESD_GROUP_COMMIT_H
+#define AESD_GROUP_COMMIT_H
+
+#include <stddef.h>
+#include <stdbool.h>
+#include <pthread.h>
+#include <sys/uio.h>
+
+enum aesd_commit_sync
+{
+    AESD_COMMIT_SYNC_NONE,		// written, left to the page cache
+    AESD_COMMIT_SYNC_INTERVAL,		// fdatasync() at most every interval_ms
+    AESD_COMMIT_SYNC_BATCH,		// fdatasync() before writers of a batch are woken
+};
+
+/**
+ * Line waiting for the committer, lives on the stack of the writer
+ */
+struct aesd_commit_entry
+{
+    const void *buf;
+    size_t len;
+    /**
+     * Data file offset of the first byte, set when committed
+     */
+    size_t offset;
+    int error;
+    bool done;
+    struct aesd_commit_entry *next;
+};
+
+/**
+ * Writes one batch to the data file in order and returns the offset of its first byte
+ * @return 0 on success, -1 with errno set
+ */
+typedef int (*aesd_commit_write_fn)(void *ctx, struct iovec *iov, int iov_n, size_t *offset);
+
+/**
+ * Makes what the write callback wrote durable
+ * @return 0 on success, -1 with errno set
+ */
+typedef int (*aesd_commit_sync_fn)(void *ctx);
+
+struct aesd_commit_stats
+{
+    unsigned long batches;
+    unsigned long lines;
+    unsigned long max_batch;
+    unsigned long syncs;
+    /**
+     * Time from taking a batch until its writers are woken, write and sync included
+     */
+    unsigned long long commit_ns;
+    unsigned long long max_commit_ns;
+};
+
+struct aesd_commit_queue
+{
+    /**
+     * Protects the queue, the stats and the done flags
+     */
+    pthread_mutex_t lock;
+    pthread_cond_t queued;		// signalled when the first line is queued
+    pthread_cond_t committed;		// broadcast when a batch is committed
+    struct aesd_commit_entry *head;
+    struct aesd_commit_entry *tail;
+    bool stopping;
+    pthread_t thread;
+    /**
+     * Durability policy, sync_file is called by the committer
+     */
+    enum aesd_commit_sync sync;
+    unsigned int interval_ms;
+    aesd_commit_write_fn write;
+    aesd_commit_sync_fn sync_file;
+    void *ctx;
+    struct aesd_commit_stats stats;
+};
+
+extern int aesd_commit_init(struct aesd_commit_queue *queue, enum aesd_commit_sync sync, unsigned int interval_ms,
+		aesd_commit_write_fn write, aesd_commit_sync_fn sync_file, void *ctx);
+extern void aesd_commit_destroy(struct aesd_commit_queue *queue, struct aesd_commit_stats *stats);
+
+extern int aesd_commit_append(struct aesd_commit_queue *queue, const void *buf, size_t len, size_t *offset);
+extern void aesd_commit_stats(struct aesd_commit_queue *queue, struct aesd_commit_stats *stats);
+
+#endif /* AESD_GROUP_COMMIT_H */
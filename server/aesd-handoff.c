@@ -0,0 +1,257 @@
+/**
+ * @file aesd-handoff.c
+ * @brief Hot restart by passing the listening sockets on
+ *
+ * A server started with a handoff path first connects to it. If an older server listens there,
+ * it sends its listening sockets as SCM_RIGHTS with their count as a 32 bit payload and stops
+ * accepting on them. Connections queued on them are accepted by the new server, none is
+ * refused meanwhile. The older server serves the connections it has until they close. It lets
+ * go of its data files before it closes the handoff connection, the new server waits for that
+ * to recreate them. The new server then listens on the path for the next restart. Only processes of the same user, or
+ * root, are handed the sockets.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/time.h>
+#include "aesd-handoff.h"
+#include "aesd-log.h"
+
+#define RECEIVE_TIMEOUT_S (5)		// the older server answers right away, or it is stuck
+#define RETRY_MS (100)
+
+static int handoff_address(const char *path, struct sockaddr_un *addr)
+{
+	memset(addr, 0, sizeof(*addr));
+	addr->sun_family = AF_UNIX;
+	if (strlen(path) >= sizeof(addr->sun_path)) {
+		errno = ENAMETOOLONG;
+		return -1;
+	}
+	strcpy(addr->sun_path, path);
+	return 0;
+}
+
+// Listen on path, a socket file left there by an earlier server is replaced
+static int handoff_listen(const char *path)
+{
+	struct sockaddr_un addr;
+	int s;
+
+	if (handoff_address(path, &addr) == -1)
+		return -1;
+	if ((s = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0)) == -1)
+		return -1;
+	unlink(path);
+	if (bind(s, (struct sockaddr *)&addr, sizeof(addr)) == -1 || chmod(path, S_IRUSR | S_IWUSR) == -1
+			|| listen(s, 1) == -1) {
+		int saved_errno = errno;
+		close(s);
+		errno = saved_errno;
+		return -1;
+	}
+	return s;
+}
+
+// The sockets are as good as the server itself, only its own user and root get them
+static bool peer_allowed(int s)
+{
+	struct ucred cred;
+	socklen_t len = sizeof(cred);
+
+	if (getsockopt(s, SOL_SOCKET, SO_PEERCRED, &cred, &len) == -1)
+		return false;
+	return cred.uid == geteuid() || cred.uid == 0;
+}
+
+static int send_fds(int s, const int *fds, int fds_n)
+{
+	char control[CMSG_SPACE(sizeof(int) * AESD_HANDOFF_MAX_FDS)];
+	uint32_t count = fds_n;
+	struct iovec iov = { .iov_base = &count, .iov_len = sizeof(count) };
+	struct msghdr msg = {
+		.msg_iov = &iov,
+		.msg_iovlen = 1,
+		.msg_control = control,
+		.msg_controllen = CMSG_SPACE(sizeof(int) * fds_n),
+	};
+	struct cmsghdr *cmsg;
+	ssize_t n;
+
+	memset(control, 0, sizeof(control));
+	cmsg = CMSG_FIRSTHDR(&msg);
+	cmsg->cmsg_level = SOL_SOCKET;
+	cmsg->cmsg_type = SCM_RIGHTS;
+	cmsg->cmsg_len = CMSG_LEN(sizeof(int) * fds_n);
+	memcpy(CMSG_DATA(cmsg), fds, sizeof(int) * fds_n);
+	while ((n = sendmsg(s, &msg, MSG_NOSIGNAL)) == -1 && errno == EINTR)
+		;
+	if (n == -1)
+		return -1;
+	if (n != sizeof(count)) {
+		errno = EPIPE;
+		return -1;
+	}
+	return 0;
+}
+
+static void *handoff_thread(void *arg)
+{
+	struct aesd_handoff *handoff = arg;
+
+	while (1) {
+		int s = accept4(handoff->listen_socket, NULL, NULL, SOCK_CLOEXEC);
+
+		if (__atomic_load_n(&handoff->stopping, __ATOMIC_RELAXED)) {
+			if (s != -1)
+				close(s);
+			break;
+		}
+		if (s == -1) {
+			if (errno != EINTR && errno != ECONNABORTED) {
+				AESD_LOG(LOG_ERR, "Handoff: failed to accept: %s", strerror(errno));
+				poll(NULL, 0, RETRY_MS);
+			}
+			continue;
+		}
+		if (!peer_allowed(s)) {
+			AESD_LOG(LOG_WARNING, "Handoff: refused a process of another user");
+			close(s);
+			continue;
+		}
+		AESD_LOG(LOG_INFO, "Handoff: passing %d listening sockets on", handoff->fds_n);
+		if (send_fds(s, handoff->fds, handoff->fds_n) == -1) {
+			AESD_LOG(LOG_ERR, "Handoff: failed to pass the listening sockets: %s", strerror(errno));
+			close(s);
+			continue;
+		}
+// The next server waits for the close to recreate the files, a failed send keeps them
+		handoff->release(handoff->ctx);
+		close(s);
+// The next server replaces the path, later connects are refused until it does
+		__atomic_store_n(&handoff->done, true, __ATOMIC_RELEASE);
+		shutdown(handoff->listen_socket, SHUT_RDWR);
+		handoff->handed_off(handoff->ctx);
+		break;
+	}
+	return NULL;
+}
+
+/**
+ * Take the listening sockets over from the server listening on @param path
+ * @param fds receives up to @param fds_max sockets, more are closed
+ * @return number of sockets received, 0 if no server listens on path, -1 with errno set
+ */
+int aesd_handoff_receive(const char *path, int *fds, int fds_max)
+{
+	char control[CMSG_SPACE(sizeof(int) * AESD_HANDOFF_MAX_FDS)];
+	struct timeval timeout = { .tv_sec = RECEIVE_TIMEOUT_S };
+	struct sockaddr_un addr;
+	uint32_t count = 0;
+	struct iovec iov = { .iov_base = &count, .iov_len = sizeof(count) };
+	struct msghdr msg = {
+		.msg_iov = &iov,
+		.msg_iovlen = 1,
+		.msg_control = control,
+		.msg_controllen = sizeof(control),
+	};
+	struct cmsghdr *cmsg;
+	int received[AESD_HANDOFF_MAX_FDS];
+	int received_n = 0;
+	ssize_t n;
+	int s;
+
+	if (handoff_address(path, &addr) == -1)
+		return -1;
+	if ((s = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0)) == -1)
+		return -1;
+	if (connect(s, (struct sockaddr *)&addr, sizeof(addr)) == -1) {
+		int saved_errno = errno;
+		close(s);
+		errno = saved_errno;
+		return (errno == ENOENT || errno == ECONNREFUSED) ? 0 : -1;
+	}
+	setsockopt(s, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+	while ((n = recvmsg(s, &msg, MSG_CMSG_CLOEXEC)) == -1 && errno == EINTR)
+		;
+// The older server lets go of its data files before it closes, they are recreated after that
+	if (n != -1) {
+		char byte;
+		while (recv(s, &byte, sizeof(byte), 0) == -1 && errno == EINTR)
+			;
+	}
+	close(s);
+	if (n == -1)
+		return -1;
+
+	if ((cmsg = CMSG_FIRSTHDR(&msg)) && cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS) {
+		received_n = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+		memcpy(received, CMSG_DATA(cmsg), sizeof(int) * received_n);
+	}
+	if (n != sizeof(count) || count != received_n || !received_n || (msg.msg_flags & MSG_CTRUNC)) {
+		for (int i = 0; i < received_n; i++)
+			close(received[i]);
+		errno = EPROTO;
+		return -1;
+	}
+	for (int i = 0; i < received_n; i++) {
+		if (i < fds_max)
+			fds[i] = received[i];
+		else
+			close(received[i]);
+	}
+	return (received_n < fds_max) ? received_n : fds_max;
+}
+
+/**
+ * Listen on @param path and pass @param fds, listening sockets owned by the caller, to the
+ * next server connecting, @param release and @param handed_off are called around it
+ * @return 0 on success, -1 with errno set
+ */
+int aesd_handoff_start(struct aesd_handoff *handoff, const char *path, const int *fds, int fds_n,
+		aesd_handoff_fn release, aesd_handoff_fn handed_off, void *ctx)
+{
+	memset(handoff, 0, sizeof(*handoff));
+	if (fds_n < 1 || fds_n > AESD_HANDOFF_MAX_FDS) {
+		errno = EINVAL;
+		return -1;
+	}
+	handoff->path = path;
+	memcpy(handoff->fds, fds, sizeof(int) * fds_n);
+	handoff->fds_n = fds_n;
+	handoff->release = release;
+	handoff->handed_off = handed_off;
+	handoff->ctx = ctx;
+	if ((handoff->listen_socket = handoff_listen(path)) == -1)
+		return -1;
+	if ((errno = pthread_create(&handoff->thread, NULL, handoff_thread, handoff))) {
+		close(handoff->listen_socket);
+		unlink(path);
+		return -1;
+	}
+	return 0;
+}
+
+/**
+ * Stop waiting for the next server, the path is removed unless it was handed off
+ */
+void aesd_handoff_stop(struct aesd_handoff *handoff)
+{
+	__atomic_store_n(&handoff->stopping, true, __ATOMIC_RELAXED);
+// Wakes accept() up
+	shutdown(handoff->listen_socket, SHUT_RDWR);
+	pthread_join(handoff->thread, NULL);
+	close(handoff->listen_socket);
+	if (!__atomic_load_n(&handoff->done, __ATOMIC_ACQUIRE))
+		unlink(handoff->path);
+}
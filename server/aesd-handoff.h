@@ -0,0 +1,47 @@
+/*
+ * aesd-handoff.h
+ *
+ *  @brief Hot restart: a server passes its listening sockets to the next one over a UNIX socket
+ *  with SCM_RIGHTS, stops accepting and drains its connections while the next one accepts
+ */
+
+#ifndef AESD_HANDOFF_H
+#define AESD_HANDOFF_H
+
+#include <stdbool.h>
+#include <pthread.h>
+
+#define AESD_HANDOFF_MAX_FDS (64)	// listening sockets passed at most
+
+/**
+ * Called on the handoff thread
+ */
+typedef void (*aesd_handoff_fn)(void *ctx);
+
+struct aesd_handoff
+{
+    const char *path;
+    int listen_socket;			// UNIX socket the next server connects to
+    int fds[AESD_HANDOFF_MAX_FDS];	// listening sockets passed on, owned by the caller
+    int fds_n;
+    /**
+     * Once the sockets are passed, let go of the files the next server recreates, it waits for it
+     */
+    aesd_handoff_fn release;
+    /**
+     * After the sockets are passed, stop accepting on them
+     */
+    aesd_handoff_fn handed_off;
+    void *ctx;
+    pthread_t thread;			// accepts the next server
+    bool stopping;
+    bool done;				// sockets passed, the path belongs to the next server
+};
+
+extern int aesd_handoff_receive(const char *path, int *fds, int fds_max);
+
+extern int aesd_handoff_start(struct aesd_handoff *handoff, const char *path, const int *fds, int fds_n,
+		aesd_handoff_fn release, aesd_handoff_fn handed_off, void *ctx);
+extern void aesd_handoff_stop(struct aesd_handoff *handoff);
+
+#endif /* AESD_HANDOFF_H */
@@ -0,0 +1,321 @@
+/**
+ * @file aesd-log.c
+ * @brief Asynchronous, rate limited logging
+ *
+ * Every thread formats its messages into its own ring of fixed size slots, registered in a
+ * list on first use. The owner only moves the head and the log thread only the tail, so
+ * logging takes no lock and makes no syscall; the log thread wakes up periodically, or when
+ * a ring gets half full, and passes the messages on. A full ring drops messages and the drop
+ * count is logged instead. Messages of different threads may be logged out of order.
+ *
+ * Each AESD_LOG() call site passes AESD_LOG_BURST messages per second, the ones over it are
+ * counted and reported with the next message of the site that passes. Before aesd_log_init()
+ * and after aesd_log_destroy() messages are logged synchronously.
+ */
+
+#include <stdbool.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/queue.h>
+#include "aesd-log.h"
+
+#define RING_SLOTS (64)
+#define MESSAGE_SIZE (248)		// longer messages are truncated
+#define DRAIN_INTERVAL_MS (100)
+
+struct log_slot {
+	int priority;
+	char message[MESSAGE_SIZE];
+};
+
+struct log_ring {
+	struct log_slot slots[RING_SLOTS];
+	unsigned long head;			// next slot to fill, written by the owner
+	unsigned long tail;			// next slot to log, written by the log thread
+	unsigned long dropped;			// written by the owner
+	unsigned long dropped_reported;		// log thread
+	bool exited;				// owner is gone, free once drained
+	LIST_ENTRY(log_ring) entries;
+};
+
+int aesd_log_level = LOG_INFO;
+
+static struct {
+	pthread_once_t once;
+	pthread_key_t key;			// per thread struct log_ring
+	pthread_mutex_t lock;			// protects rings, running and stopping
+	LIST_HEAD(, log_ring) rings;
+	bool running;				// log thread drains the rings, read without lock by loggers
+	bool stopping;
+	pthread_cond_t wake;
+	pthread_t thread;
+} registry = {
+	.once = PTHREAD_ONCE_INIT,
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+};
+
+static void log_ring_exit(void *arg);
+
+static void registry_init(void)
+{
+	pthread_key_create(&registry.key, log_ring_exit);
+}
+
+// Debug and packet messages go to stderr as PDEBUG did, the others to syslog
+static void log_emit(int priority, const char *message)
+{
+	if (priority >= LOG_DEBUG)
+		fprintf(stderr, "%s\n", message);
+	else
+		syslog(priority, "%s", message);
+}
+
+static void log_format(char *message, const char *fmt, va_list args)
+{
+	size_t len;
+
+	vsnprintf(message, MESSAGE_SIZE, fmt, args);
+	len = strlen(message);
+	while (len && message[len - 1] == '\n')
+		message[--len] = '\0';
+}
+
+// Log what the owner has put into the ring, called with the registry locked
+static void log_ring_drain(struct log_ring *ring)
+{
+	unsigned long head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+	unsigned long dropped;
+
+	for (unsigned long tail = ring->tail; tail != head; tail++) {
+		struct log_slot *slot = &ring->slots[tail % RING_SLOTS];
+		log_emit(slot->priority, slot->message);
+		__atomic_store_n(&ring->tail, tail + 1, __ATOMIC_RELEASE);
+	}
+	dropped = __atomic_load_n(&ring->dropped, __ATOMIC_RELAXED);
+	if (dropped != ring->dropped_reported) {
+		char message[MESSAGE_SIZE];
+		snprintf(message, sizeof(message), "%lu log messages dropped", dropped - ring->dropped_reported);
+		log_emit(LOG_WARNING, message);
+		ring->dropped_reported = dropped;
+	}
+}
+
+// Drain every ring once, rings of exited threads are freed, called with the registry locked
+static void log_drain(void)
+{
+	struct log_ring *ring, *next;
+
+	for (ring = LIST_FIRST(&registry.rings); ring; ring = next) {
+		bool exited = __atomic_load_n(&ring->exited, __ATOMIC_ACQUIRE);
+		next = LIST_NEXT(ring, entries);
+		log_ring_drain(ring);
+		if (exited) {
+			LIST_REMOVE(ring, entries);
+			free(ring);
+		}
+	}
+}
+
+static void *log_thread(void *arg)
+{
+	pthread_mutex_lock(&registry.lock);
+	while (!registry.stopping) {
+		struct timespec deadline;
+
+		log_drain();
+		clock_gettime(CLOCK_MONOTONIC, &deadline);
+		deadline.tv_nsec += DRAIN_INTERVAL_MS * 1000000L;
+		if (deadline.tv_nsec >= 1000000000L) {
+			deadline.tv_sec++;
+			deadline.tv_nsec -= 1000000000L;
+		}
+		pthread_cond_timedwait(&registry.wake, &registry.lock, &deadline);
+	}
+	pthread_mutex_unlock(&registry.lock);
+	return NULL;
+}
+
+// Ring of the calling thread, registered on first use, NULL to log synchronously
+static struct log_ring *thread_ring(void)
+{
+	struct log_ring *ring;
+
+	if (!__atomic_load_n(&registry.running, __ATOMIC_ACQUIRE))
+		return NULL;
+	if ((ring = pthread_getspecific(registry.key)))
+		return ring;
+	if (!(ring = calloc(1, sizeof(struct log_ring))))
+		return NULL;
+	pthread_setspecific(registry.key, ring);
+	pthread_mutex_lock(&registry.lock);
+	LIST_INSERT_HEAD(&registry.rings, ring, entries);
+	pthread_mutex_unlock(&registry.lock);
+	return ring;
+}
+
+// The log thread frees the ring once drained, without it the ring is freed right away
+static void log_ring_exit(void *arg)
+{
+	struct log_ring *ring = arg;
+
+	pthread_mutex_lock(&registry.lock);
+	if (registry.running) {
+		__atomic_store_n(&ring->exited, true, __ATOMIC_RELEASE);
+	} else {
+		log_ring_drain(ring);
+		LIST_REMOVE(ring, entries);
+		free(ring);
+	}
+	pthread_mutex_unlock(&registry.lock);
+}
+
+static void log_vmessage(int priority, const char *fmt, va_list args)
+{
+	struct log_ring *ring = thread_ring();
+	unsigned long head, used;
+
+	if (!ring) {
+		char message[MESSAGE_SIZE];
+		log_format(message, fmt, args);
+		log_emit(priority, message);
+		return;
+	}
+	head = ring->head;
+	used = head - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+	if (used == RING_SLOTS) {
+		__atomic_store_n(&ring->dropped, ring->dropped + 1, __ATOMIC_RELAXED);
+		return;
+	}
+	ring->slots[head % RING_SLOTS].priority = priority;
+	log_format(ring->slots[head % RING_SLOTS].message, fmt, args);
+	__atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+// Lost wake ups only delay the drain until the next interval
+	if (used + 1 == RING_SLOTS / 2)
+		pthread_cond_signal(&registry.wake);
+}
+
+static void log_message(int priority, const char *fmt, ...)
+{
+	va_list args;
+
+	va_start(args, fmt);
+	log_vmessage(priority, fmt, args);
+	va_end(args);
+}
+
+/**
+ * Count a message of @param site in the current second
+ * @param suppressed receives the messages suppressed in the previous second of the site
+ * @return true if the message is to be logged
+ */
+static bool log_site_admit(struct aesd_log_site *site, unsigned long *suppressed)
+{
+	struct timespec now;
+	unsigned long second;
+
+	clock_gettime(CLOCK_MONOTONIC_COARSE, &now);
+	second = __atomic_load_n(&site->second, __ATOMIC_RELAXED);
+	*suppressed = 0;
+	if (second != now.tv_sec && __atomic_compare_exchange_n(&site->second, &second, now.tv_sec, false,
+			__ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+		__atomic_store_n(&site->count, 0, __ATOMIC_RELAXED);
+		*suppressed = __atomic_exchange_n(&site->suppressed, 0, __ATOMIC_RELAXED);
+	}
+	if (__atomic_fetch_add(&site->count, 1, __ATOMIC_RELAXED) < AESD_LOG_BURST)
+		return true;
+	__atomic_add_fetch(&site->suppressed, 1, __ATOMIC_RELAXED);
+	return false;
+}
+
+/**
+ * Log a message of @param site, use AESD_LOG() which checks the level first
+ */
+void aesd_log(struct aesd_log_site *site, int priority, const char *fmt, ...)
+{
+	unsigned long suppressed;
+	va_list args;
+
+	if (!log_site_admit(site, &suppressed))
+		return;
+	if (suppressed) {
+		int fmt_len = strlen(site->fmt);
+		while (fmt_len && site->fmt[fmt_len - 1] == '\n')
+			fmt_len--;
+		log_message(priority, "%lu messages like \"%.*s\" suppressed", suppressed, fmt_len, site->fmt);
+	}
+	va_start(args, fmt);
+	log_vmessage(priority, fmt, args);
+	va_end(args);
+}
+
+/**
+ * Set the highest priority logged, from LOG_EMERG up to AESD_LOG_PACKET, async signal safe
+ */
+void aesd_log_set_level(int level)
+{
+	if (level < LOG_EMERG)
+		level = LOG_EMERG;
+	if (level > AESD_LOG_PACKET)
+		level = AESD_LOG_PACKET;
+	__atomic_store_n(&aesd_log_level, level, __ATOMIC_RELAXED);
+}
+
+/**
+ * Start the log thread, call it after fork()
+ * @return 0 on success, -1 if the thread could not be started, messages stay synchronous then
+ */
+int aesd_log_init(void)
+{
+	pthread_condattr_t attr;
+
+	pthread_once(&registry.once, registry_init);
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	pthread_cond_init(&registry.wake, &attr);
+	pthread_condattr_destroy(&attr);
+	registry.stopping = false;
+	if ((errno = pthread_create(&registry.thread, NULL, log_thread, NULL))) {
+		pthread_cond_destroy(&registry.wake);
+		return -1;
+	}
+	pthread_mutex_lock(&registry.lock);
+	__atomic_store_n(&registry.running, true, __ATOMIC_RELEASE);
+	pthread_mutex_unlock(&registry.lock);
+	return 0;
+}
+
+/**
+ * Log what is queued and stop the log thread, later messages are logged synchronously.
+ * Rings of threads still running are freed when they exit
+ */
+void aesd_log_destroy(void)
+{
+	struct log_ring *ring;
+
+	pthread_mutex_lock(&registry.lock);
+	if (!registry.running) {
+		pthread_mutex_unlock(&registry.lock);
+		return;
+	}
+	__atomic_store_n(&registry.running, false, __ATOMIC_RELEASE);
+	registry.stopping = true;
+	pthread_cond_signal(&registry.wake);
+	pthread_mutex_unlock(&registry.lock);
+	pthread_join(registry.thread, NULL);
+	pthread_cond_destroy(&registry.wake);
+
+	pthread_mutex_lock(&registry.lock);
+	log_drain();
+	if ((ring = pthread_getspecific(registry.key))) {
+		pthread_setspecific(registry.key, NULL);
+		log_ring_drain(ring);
+		LIST_REMOVE(ring, entries);
+		free(ring);
+	}
+	pthread_mutex_unlock(&registry.lock);
+}
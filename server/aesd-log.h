@@ -0,0 +1,49 @@
+/*
+ * aesd-log.h
+ *
+ *  @brief Asynchronous, rate limited logging: threads format into their own rings, a log thread
+ *  passes the messages on to syslog, debug and packet messages to stderr
+ */
+
+#ifndef AESD_LOG_H
+#define AESD_LOG_H
+
+#include <syslog.h>
+
+#define AESD_LOG_PACKET (LOG_DEBUG + 1)	// level of per packet messages, above LOG_DEBUG
+#define AESD_LOG_BURST 10		// messages per second of one AESD_LOG() call site, the rest is suppressed
+
+/**
+ * Call site of AESD_LOG(), counts its messages in the current second
+ */
+struct aesd_log_site
+{
+    const char *fmt;
+    unsigned long second;
+    unsigned int count;
+    unsigned long suppressed;
+};
+
+/**
+ * Messages with a priority above it are dropped before they are formatted
+ */
+extern int aesd_log_level;
+
+/**
+ * Log a message of syslog @param priority, or AESD_LOG_PACKET, without a syscall while the log
+ * thread runs. Trailing newlines of format are dropped
+ */
+#define AESD_LOG(priority, format, args...) do { \
+	static struct aesd_log_site aesd_log_site_ = { .fmt = format }; \
+	if ((priority) <= __atomic_load_n(&aesd_log_level, __ATOMIC_RELAXED)) \
+		aesd_log(&aesd_log_site_, priority, format, ## args); \
+} while (0)
+
+extern void aesd_log(struct aesd_log_site *site, int priority, const char *fmt, ...)
+		__attribute__((format(printf, 3, 4)));
+
+extern void aesd_log_set_level(int level);
+extern int aesd_log_init(void);
+extern void aesd_log_destroy(void);
+
+#endif /* AESD_LOG_H */
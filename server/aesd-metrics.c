@@ -0,0 +1,203 @@
+/**
+ * @file aesd-metrics.c
+ * @brief Per thread stage latency histograms and counters
+ *
+ * Every thread counts into its own struct aesd_metrics, registered in a list on first use, so
+ * recording takes no lock and no atomic read-modify-write: the owner stores with relaxed
+ * atomics, readers load the same way and may see a sum a few events old. A thread folds its
+ * counts into the retired totals when it exits.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/queue.h>
+#include "aesd-metrics.h"
+
+struct thread_metrics {
+	struct aesd_metrics metrics;
+	LIST_ENTRY(thread_metrics) entries;
+};
+
+static const char *stage_names[AESD_STAGES] = {
+	[AESD_STAGE_ACCEPT] = "accept",
+	[AESD_STAGE_RECV] = "recv",
+	[AESD_STAGE_WRITE] = "write",
+	[AESD_STAGE_SEND] = "send",
+	[AESD_STAGE_IOCTL] = "ioctl",
+	[AESD_STAGE_LOCK_WAIT] = "lock_wait",
+	[AESD_STAGE_LOCK_HOLD] = "lock_hold",
+};
+
+static const char *counter_names[AESD_COUNTERS] = {
+	[AESD_COUNTER_CONNECTIONS] = "connections_total",
+	[AESD_COUNTER_BYTES_IN] = "received_bytes_total",
+	[AESD_COUNTER_BYTES_OUT] = "sent_bytes_total",
+	[AESD_COUNTER_LINES] = "lines_total",
+};
+
+static struct {
+	pthread_once_t once;
+	pthread_key_t key;			// per thread struct thread_metrics
+	pthread_mutex_t lock;			// protects threads and retired
+	LIST_HEAD(, thread_metrics) threads;
+	struct aesd_metrics retired;		// counts of exited threads
+} registry = {
+	.once = PTHREAD_ONCE_INIT,
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+};
+
+// Only the owning thread writes, the store is atomic for concurrent readers
+#define BUMP(field, n) __atomic_store_n(&(field), (field) + (n), __ATOMIC_RELAXED)
+#define LOAD(field) __atomic_load_n(&(field), __ATOMIC_RELAXED)
+
+static void thread_metrics_free(void *arg);
+
+static void registry_init(void)
+{
+	pthread_key_create(&registry.key, thread_metrics_free);
+}
+
+static void metrics_add(struct aesd_metrics *sum, struct aesd_metrics *m)
+{
+	for (int c = 0; c < AESD_COUNTERS; c++)
+		sum->counters[c] += LOAD(m->counters[c]);
+	for (int s = 0; s < AESD_STAGES; s++) {
+		struct aesd_histogram *h = &m->stages[s];
+		unsigned long long max_ns = LOAD(h->max_ns);
+		sum->stages[s].count += LOAD(h->count);
+		sum->stages[s].sum_ns += LOAD(h->sum_ns);
+		if (max_ns > sum->stages[s].max_ns)
+			sum->stages[s].max_ns = max_ns;
+		for (int b = 0; b < AESD_METRICS_BUCKETS; b++)
+			sum->stages[s].buckets[b] += LOAD(h->buckets[b]);
+	}
+}
+
+// Metrics of the calling thread, registered on first use, NULL if they cannot be allocated
+static struct aesd_metrics *thread_metrics(void)
+{
+	struct thread_metrics *t;
+
+	pthread_once(&registry.once, registry_init);
+	if ((t = pthread_getspecific(registry.key)))
+		return &t->metrics;
+	if (!(t = calloc(1, sizeof(struct thread_metrics))))
+		return NULL;
+	pthread_setspecific(registry.key, t);
+	pthread_mutex_lock(&registry.lock);
+	LIST_INSERT_HEAD(&registry.threads, t, entries);
+	pthread_mutex_unlock(&registry.lock);
+	return &t->metrics;
+}
+
+static void thread_metrics_free(void *arg)
+{
+	struct thread_metrics *t = arg;
+
+	pthread_mutex_lock(&registry.lock);
+	LIST_REMOVE(t, entries);
+	metrics_add(&registry.retired, &t->metrics);
+	pthread_mutex_unlock(&registry.lock);
+	free(t);
+}
+
+/**
+ * @return monotonic time in nanoseconds, pass differences to aesd_metrics_record()
+ */
+unsigned long long aesd_metrics_now(void)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+/**
+ * Count a duration of @param ns nanoseconds in the histogram of @param stage
+ */
+void aesd_metrics_record(enum aesd_metrics_stage stage, unsigned long long ns)
+{
+	struct aesd_metrics *m = thread_metrics();
+	struct aesd_histogram *h;
+	int b = (ns < 2) ? 0 : 63 - __builtin_clzll(ns);
+
+	if (!m)
+		return;
+	h = &m->stages[stage];
+	if (b >= AESD_METRICS_BUCKETS)
+		b = AESD_METRICS_BUCKETS - 1;
+	BUMP(h->buckets[b], 1);
+	BUMP(h->count, 1);
+	BUMP(h->sum_ns, ns);
+	if (ns > h->max_ns)
+		__atomic_store_n(&h->max_ns, ns, __ATOMIC_RELAXED);
+}
+
+void aesd_metrics_add(enum aesd_metrics_counter counter, unsigned long n)
+{
+	struct aesd_metrics *m = thread_metrics();
+
+	if (m)
+		BUMP(m->counters[counter], n);
+}
+
+/**
+ * Sum the counts of all threads, running and exited
+ */
+void aesd_metrics_sum(struct aesd_metrics *sum)
+{
+	struct thread_metrics *t;
+
+	memset(sum, 0, sizeof(*sum));
+	pthread_mutex_lock(&registry.lock);
+	metrics_add(sum, &registry.retired);
+	LIST_FOREACH(t, &registry.threads, entries)
+		metrics_add(sum, &t->metrics);
+	pthread_mutex_unlock(&registry.lock);
+}
+
+/**
+ * Print the sums as "name{labels} value" lines, each name starting with @param prefix.
+ * Buckets are cumulative, le is the largest duration in ns a bucket takes
+ */
+void aesd_metrics_print(FILE *out, const char *prefix)
+{
+	struct aesd_metrics sum;
+
+	aesd_metrics_sum(&sum);
+	for (int c = 0; c < AESD_COUNTERS; c++)
+		fprintf(out, "%s_%s %lu\n", prefix, counter_names[c], sum.counters[c]);
+	for (int s = 0; s < AESD_STAGES; s++) {
+		struct aesd_histogram *h = &sum.stages[s];
+		unsigned long cumulative = 0;
+		int last = AESD_METRICS_BUCKETS - 2;
+
+		while (last >= 0 && !h->buckets[last])
+			last--;
+		for (int b = 0; b <= last; b++) {
+			cumulative += h->buckets[b];
+			fprintf(out, "%s_stage_ns_bucket{stage=\"%s\",le=\"%llu\"} %lu\n", prefix, stage_names[s],
+					(2ULL << b) - 1, cumulative);
+		}
+		fprintf(out, "%s_stage_ns_bucket{stage=\"%s\",le=\"+Inf\"} %lu\n", prefix, stage_names[s], h->count);
+		fprintf(out, "%s_stage_ns_sum{stage=\"%s\"} %llu\n", prefix, stage_names[s], h->sum_ns);
+		fprintf(out, "%s_stage_ns_count{stage=\"%s\"} %lu\n", prefix, stage_names[s], h->count);
+		fprintf(out, "%s_stage_ns_max{stage=\"%s\"} %llu\n", prefix, stage_names[s], h->max_ns);
+	}
+}
+
+/**
+ * Release the metrics of the calling thread, every other thread recording must have exited
+ */
+void aesd_metrics_destroy(void)
+{
+	struct thread_metrics *t;
+
+	pthread_once(&registry.once, registry_init);
+	if ((t = pthread_getspecific(registry.key))) {
+		pthread_setspecific(registry.key, NULL);
+		thread_metrics_free(t);
+	}
+}
@@ -0,0 +1,60 @@
+/*
+ * aesd-metrics.h
+ *
+ *  @brief Per thread stage latency histograms and counters, summed on demand
+ */
+
+#ifndef AESD_METRICS_H
+#define AESD_METRICS_H
+
+#include <stdio.h>
+
+#define AESD_METRICS_BUCKETS 40		// log2 buckets of nanoseconds, the last one takes everything above
+
+enum aesd_metrics_stage
+{
+    AESD_STAGE_ACCEPT,		// accept() returned until the connection is set up
+    AESD_STAGE_RECV,		// framing of received data into lines
+    AESD_STAGE_WRITE,		// storage append of a line or batch
+    AESD_STAGE_SEND,		// sending a response
+    AESD_STAGE_IOCTL,		// AESDCHAR_IOCSEEKTO
+    AESD_STAGE_LOCK_WAIT,	// waiting for the append lock or for earlier appends to be published
+    AESD_STAGE_LOCK_HOLD,	// appending in file order, other appends wait meanwhile
+    AESD_STAGES,
+};
+
+enum aesd_metrics_counter
+{
+    AESD_COUNTER_CONNECTIONS,	// admitted connections
+    AESD_COUNTER_BYTES_IN,	// received bytes
+    AESD_COUNTER_BYTES_OUT,	// sent bytes
+    AESD_COUNTER_LINES,		// handled lines, commands included
+    AESD_COUNTERS,
+};
+
+struct aesd_histogram
+{
+    unsigned long count;
+    unsigned long long sum_ns;
+    unsigned long long max_ns;
+    /**
+     * Bucket i counts durations below 2^(i+1) ns and not below 2^i ns, bucket 0 those below 2 ns
+     */
+    unsigned long buckets[AESD_METRICS_BUCKETS];
+};
+
+struct aesd_metrics
+{
+    unsigned long counters[AESD_COUNTERS];
+    struct aesd_histogram stages[AESD_STAGES];
+};
+
+extern unsigned long long aesd_metrics_now(void);
+extern void aesd_metrics_record(enum aesd_metrics_stage stage, unsigned long long ns);
+extern void aesd_metrics_add(enum aesd_metrics_counter counter, unsigned long n);
+
+extern void aesd_metrics_sum(struct aesd_metrics *sum);
+extern void aesd_metrics_print(FILE *out, const char *prefix);
+extern void aesd_metrics_destroy(void);
+
+#endif /* AESD_METRICS_H */
@@ -0,0 +1,471 @@
+/**
+ * @file aesd-replication.c
+ * @brief Primary/follower replication of a log backend
+ *
+ * A follower connects to the replication port of the primary and sends
+ * "AESDSOCKET_FOLLOW:<offset>\n" with the size of its replica. The primary answers with its own
+ * size as "<size>\n" and streams the data file from offset on, then whatever is published after
+ * it, as long as the connection lasts. The follower appends complete lines only, so after a
+ * lost connection it asks again from the end of its last line and catches up. Offsets of a
+ * replica are those of the primary, it is only ever appended to by the replication thread.
+ * A replica larger than the primary is of another log, the follower stops then. A follower
+ * which needs data that retention of the primary dropped is refused, it keeps retrying.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <poll.h>
+#include <netdb.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/sendfile.h>
+#include "aesd-replication.h"
+#include "aesd-log.h"
+
+#define FOLLOW_COMMAND "AESDSOCKET_FOLLOW:"
+#define HANDSHAKE_SIZE (64)
+#define HANDSHAKE_TIMEOUT_S (5)
+#define WAIT_MS (100)			// a link checks for stop and a gone follower this often
+#define RECONNECT_MS (1000)
+#define STREAM_CHUNK_SIZE (1024 * 1024)
+#define RECEIVE_BUF_SIZE (64 * 1024)
+
+static int send_all(int s, const char *buf, size_t len)
+{
+	while (len) {
+		ssize_t n = send(s, buf, len, MSG_NOSIGNAL);
+		if (n == -1) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		buf += n;
+		len -= n;
+	}
+	return 0;
+}
+
+// Receive a handshake line up to its newline, which is replaced by a NUL
+static int recv_line(int s, char *line, size_t size)
+{
+	size_t used = 0;
+
+	while (used < size - 1) {
+		ssize_t n = recv(s, line + used, 1, 0);
+		if (n == -1 && errno == EINTR)
+			continue;
+		if (n <= 0) {
+			if (n == 0)
+				errno = ECONNRESET;
+			return -1;
+		}
+		if (line[used] == '\n') {
+			line[used] = '\0';
+			return 0;
+		}
+		used++;
+	}
+	errno = EPROTO;
+	return -1;
+}
+
+static int parse_offset(const char *s, size_t *offset)
+{
+	char *end;
+
+	if (*s < '0' || *s > '9')
+		return -1;
+	errno = 0;
+	*offset = strtoull(s, &end, 10);
+	return (*end || errno) ? -1 : 0;
+}
+
+// Data file bytes [offset, end) to the follower, with sendfile() unless the file refuses it or is split in segments
+static int stream_range(int s, struct aesd_storage_handle *data, size_t offset, size_t end)
+{
+	char buf[RECEIVE_BUF_SIZE];
+	bool zero_copy = (data->fd != -1);
+
+	while (offset < end) {
+		size_t len = (end - offset < STREAM_CHUNK_SIZE) ? end - offset : STREAM_CHUNK_SIZE;
+		ssize_t n;
+		if (zero_copy) {
+			off_t pos = offset;
+			n = sendfile(s, data->fd, &pos, len);
+			if (n == -1 && (errno == EINVAL || errno == ENOSYS)) {
+				zero_copy = false;
+				continue;
+			}
+		} else {
+			n = aesd_storage_read(data, buf, (len < sizeof(buf)) ? len : sizeof(buf), offset);
+			if (n > 0 && send_all(s, buf, n) == -1)
+				return -1;
+		}
+		if (n == -1 && errno == EINTR)
+			continue;
+		if (n <= 0) {
+			if (n == 0)
+				errno = EIO;
+			return -1;
+		}
+		offset += n;
+	}
+	return 0;
+}
+
+// Followers only send their handshake, a readable end of stream means they are gone
+static bool peer_closed(int s)
+{
+	char c;
+	ssize_t n = recv(s, &c, 1, MSG_DONTWAIT | MSG_PEEK);
+
+	return n == 0 || (n == -1 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR);
+}
+
+static void *link_thread(void *arg)
+{
+	struct aesd_replica_link *link = arg;
+	struct aesd_primary *primary = link->primary;
+	struct aesd_storage_handle data;
+	struct timeval timeout = { .tv_sec = HANDSHAKE_TIMEOUT_S };
+	char line[HANDSHAKE_SIZE];
+	size_t size;
+
+	if (aesd_storage_attach(primary->storage, &data) == -1) {
+		AESD_LOG(LOG_ERR, "Replication: no data file for follower: %s", strerror(errno));
+		goto error_attach;
+	}
+	setsockopt(link->socket, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+	if (recv_line(link->socket, line, sizeof(line)) == -1) {
+		AESD_LOG(LOG_ERR, "Replication: no handshake from follower: %s", strerror(errno));
+		goto error_handshake;
+	}
+	if (strncmp(line, FOLLOW_COMMAND, strlen(FOLLOW_COMMAND))
+			|| parse_offset(line + strlen(FOLLOW_COMMAND), &link->offset) == -1) {
+		AESD_LOG(LOG_ERR, "Replication: invalid handshake from follower");
+		goto error_handshake;
+	}
+	size = aesd_storage_size(&data);
+	snprintf(line, sizeof(line), "%zu\n", size);
+	if (send_all(link->socket, line, strlen(line)) == -1)
+		goto error_handshake;
+	if (link->offset > size) {
+		AESD_LOG(LOG_ERR, "Replication: follower has %zu bytes, more than the %zu of the primary", link->offset, size);
+		goto error_handshake;
+	}
+	if (link->offset < aesd_storage_start(&data)) {
+		AESD_LOG(LOG_ERR, "Replication: follower needs offset %zu, retention dropped everything before %zu",
+				link->offset, aesd_storage_start(&data));
+		goto error_handshake;
+	}
+	AESD_LOG(LOG_INFO, "Replication: follower catching up from %zu of %zu bytes", link->offset, size);
+
+	while (!__atomic_load_n(&primary->stopping, __ATOMIC_RELAXED)) {
+		size_t end = aesd_storage_wait(&data, link->offset, WAIT_MS);
+		if (end > link->offset) {
+			if (stream_range(link->socket, &data, link->offset, end) == -1) {
+				AESD_LOG(LOG_INFO, "Replication: follower gone at %zu bytes: %s", link->offset, strerror(errno));
+				break;
+			}
+			link->offset = end;
+		} else if (peer_closed(link->socket)) {
+			AESD_LOG(LOG_INFO, "Replication: follower gone at %zu bytes", link->offset);
+			break;
+		}
+	}
+
+error_handshake:
+	aesd_storage_detach(&data);
+error_attach:
+// The socket is closed once the thread is joined, stop may still shut it down
+	__atomic_store_n(&link->finished, true, __ATOMIC_RELEASE);
+	return NULL;
+}
+
+static void link_free(struct aesd_replica_link *link)
+{
+	pthread_join(link->thread, NULL);
+	close(link->socket);
+	free(link);
+}
+
+// Join the links whose followers are gone, called with the lock held
+static void primary_reap(struct aesd_primary *primary)
+{
+	struct aesd_replica_link *link, *next;
+
+	for (link = LIST_FIRST(&primary->links); link; link = next) {
+		next = LIST_NEXT(link, entries);
+		if (__atomic_load_n(&link->finished, __ATOMIC_ACQUIRE)) {
+			LIST_REMOVE(link, entries);
+			link_free(link);
+		}
+	}
+}
+
+static void *primary_thread(void *arg)
+{
+	struct aesd_primary *primary = arg;
+
+	while (1) {
+		int s = accept(primary->listen_socket, NULL, NULL);
+		struct aesd_replica_link *link;
+
+		pthread_mutex_lock(&primary->lock);
+		primary_reap(primary);
+		if (primary->stopping) {
+			pthread_mutex_unlock(&primary->lock);
+			if (s != -1)
+				close(s);
+			break;
+		}
+		if (s == -1) {
+			pthread_mutex_unlock(&primary->lock);
+			if (errno != EINTR && errno != ECONNABORTED) {
+				AESD_LOG(LOG_ERR, "Replication: failed to accept: %s", strerror(errno));
+				poll(NULL, 0, WAIT_MS);
+			}
+			continue;
+		}
+		if (!(link = calloc(1, sizeof(struct aesd_replica_link)))) {
+			pthread_mutex_unlock(&primary->lock);
+			close(s);
+			continue;
+		}
+		link->primary = primary;
+		link->socket = s;
+		if ((errno = pthread_create(&link->thread, NULL, link_thread, link))) {
+			pthread_mutex_unlock(&primary->lock);
+			AESD_LOG(LOG_ERR, "Replication: pthread_create %s", strerror(errno));
+			close(s);
+			free(link);
+			continue;
+		}
+		LIST_INSERT_HEAD(&primary->links, link, entries);
+		primary->followers++;
+		pthread_mutex_unlock(&primary->lock);
+	}
+	return NULL;
+}
+
+/**
+ * Stream @param storage, a log backend, to the followers connecting to @param listen_socket,
+ * which is listening and stays owned by the caller
+ * @return 0 on success, -1 if the thread could not be started
+ */
+int aesd_primary_start(struct aesd_primary *primary, struct aesd_storage *storage, int listen_socket)
+{
+	memset(primary, 0, sizeof(*primary));
+	primary->storage = storage;
+	primary->listen_socket = listen_socket;
+	LIST_INIT(&primary->links);
+	pthread_mutex_init(&primary->lock, NULL);
+	if ((errno = pthread_create(&primary->thread, NULL, primary_thread, primary))) {
+		pthread_mutex_destroy(&primary->lock);
+		return -1;
+	}
+	return 0;
+}
+
+/**
+ * Disconnect the followers and stop accepting new ones
+ */
+void aesd_primary_stop(struct aesd_primary *primary)
+{
+	struct aesd_replica_link *link;
+
+	pthread_mutex_lock(&primary->lock);
+	__atomic_store_n(&primary->stopping, true, __ATOMIC_RELAXED);
+	LIST_FOREACH(link, &primary->links, entries)
+		shutdown(link->socket, SHUT_RDWR);
+	pthread_mutex_unlock(&primary->lock);
+// Wakes accept() up
+	shutdown(primary->listen_socket, SHUT_RDWR);
+	pthread_join(primary->thread, NULL);
+
+	while (!LIST_EMPTY(&primary->links)) {
+		link = LIST_FIRST(&primary->links);
+		LIST_REMOVE(link, entries);
+		link_free(link);
+	}
+	pthread_mutex_destroy(&primary->lock);
+}
+
+static int follower_connect(struct aesd_follower *follower)
+{
+	struct addrinfo hints = { .ai_family = AF_UNSPEC, .ai_socktype = SOCK_STREAM }, *servinfo, *p;
+	int rv, s = -1;
+
+	if ((rv = getaddrinfo(follower->host, follower->port, &hints, &servinfo)) != 0) {
+		AESD_LOG(LOG_ERR, "Replication: getaddrinfo: %s", gai_strerror(rv));
+		return -1;
+	}
+	for (p = servinfo; p; p = p->ai_next) {
+		if ((s = socket(p->ai_family, p->ai_socktype, p->ai_protocol)) == -1)
+			continue;
+		if (connect(s, p->ai_addr, p->ai_addrlen) == 0)
+			break;
+		close(s);
+		s = -1;
+	}
+	freeaddrinfo(servinfo);
+	if (s == -1)
+		AESD_LOG(LOG_ERR, "Replication: cannot connect to primary %s:%s: %s", follower->host, follower->port, strerror(errno));
+	return s;
+}
+
+/**
+ * Handshake and append the stream of the primary until the connection ends
+ * @return 0 to reconnect, -1 if the replica is of another log
+ */
+static int follower_stream(struct aesd_follower *follower, struct aesd_storage_handle *data, int s)
+{
+	struct timeval timeout = { .tv_sec = HANDSHAKE_TIMEOUT_S }, no_timeout = { 0 };
+	size_t offset = aesd_storage_size(data), primary_size, used = 0, allocated = RECEIVE_BUF_SIZE;
+	char line[HANDSHAKE_SIZE], *buf;
+	ssize_t n;
+
+	snprintf(line, sizeof(line), FOLLOW_COMMAND "%zu\n", offset);
+	setsockopt(s, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+	if (send_all(s, line, strlen(line)) == -1 || recv_line(s, line, sizeof(line)) == -1
+			|| parse_offset(line, &primary_size) == -1) {
+		AESD_LOG(LOG_ERR, "Replication: no handshake from primary: %s", strerror(errno));
+		return 0;
+	}
+	if (primary_size < offset) {
+		AESD_LOG(LOG_ERR, "Replication: replica has %zu bytes, primary only %zu, not following another log",
+				offset, primary_size);
+		return -1;
+	}
+	setsockopt(s, SOL_SOCKET, SO_RCVTIMEO, &no_timeout, sizeof(no_timeout));
+	__atomic_add_fetch(&follower->connects, 1, __ATOMIC_RELAXED);
+	AESD_LOG(LOG_INFO, "Replication: following %s:%s from %zu of %zu bytes", follower->host, follower->port,
+			offset, primary_size);
+
+	if (!(buf = malloc(allocated)))
+		return 0;
+	while ((n = recv(s, buf + used, allocated - used, 0)) != 0) {
+		char *newline;
+		if (n == -1) {
+			if (errno == EINTR)
+				continue;
+			break;
+		}
+		used += n;
+// Lines are appended whole, a partial one waits for its newline
+		if ((newline = memrchr(buf, '\n', used))) {
+			struct iovec iov = { buf, newline + 1 - buf };
+			if (aesd_storage_append(data, &iov, 1, NULL) == -1) {
+				AESD_LOG(LOG_ERR, "Replication: failed to write data: %s", strerror(errno));
+				break;
+			}
+			used -= iov.iov_len;
+			memmove(buf, newline + 1, used);
+		} else if (used == allocated) {
+			char *new_buf = realloc(buf, allocated * 2);
+			if (!new_buf)
+				break;
+			buf = new_buf;
+			allocated *= 2;
+		}
+	}
+	if (!__atomic_load_n(&follower->stopping, __ATOMIC_RELAXED))
+		AESD_LOG(LOG_INFO, "Replication: lost primary at %zu bytes, reconnecting", aesd_storage_size(data));
+	free(buf);
+	return 0;
+}
+
+static void *follower_thread(void *arg)
+{
+	struct aesd_follower *follower = arg;
+	struct aesd_storage_handle data;
+
+	if (aesd_storage_attach(follower->storage, &data) == -1) {
+		AESD_LOG(LOG_ERR, "Replication: no data file for replica: %s", strerror(errno));
+		return NULL;
+	}
+	pthread_mutex_lock(&follower->lock);
+	while (!follower->stopping) {
+		int s, result = 0;
+
+		pthread_mutex_unlock(&follower->lock);
+		if ((s = follower_connect(follower)) != -1) {
+			bool stopping;
+// Published for stop to shut it down
+			pthread_mutex_lock(&follower->lock);
+			if (!(stopping = follower->stopping))
+				follower->socket = s;
+			pthread_mutex_unlock(&follower->lock);
+			if (!stopping)
+				result = follower_stream(follower, &data, s);
+			pthread_mutex_lock(&follower->lock);
+			follower->socket = -1;
+			pthread_mutex_unlock(&follower->lock);
+			close(s);
+		}
+		pthread_mutex_lock(&follower->lock);
+		if (result == -1)
+			break;
+// Wait before reconnecting, stop wakes it up
+		if (!follower->stopping) {
+			struct timespec deadline;
+			clock_gettime(CLOCK_MONOTONIC, &deadline);
+			deadline.tv_sec += RECONNECT_MS / 1000;
+			deadline.tv_nsec += (RECONNECT_MS % 1000) * 1000000L;
+			if (deadline.tv_nsec >= 1000000000L) {
+				deadline.tv_sec++;
+				deadline.tv_nsec -= 1000000000L;
+			}
+			pthread_cond_timedwait(&follower->wake, &follower->lock, &deadline);
+		}
+	}
+	pthread_mutex_unlock(&follower->lock);
+	aesd_storage_detach(&data);
+	return NULL;
+}
+
+/**
+ * Replicate the log of the primary at @param host : @param port into @param storage, a log
+ * backend nothing else appends to, reconnecting whenever the connection is lost
+ * @return 0 on success, -1 if the thread could not be started
+ */
+int aesd_follower_start(struct aesd_follower *follower, struct aesd_storage *storage,
+		const char *host, const char *port)
+{
+	pthread_condattr_t attr;
+
+	memset(follower, 0, sizeof(*follower));
+	follower->storage = storage;
+	follower->host = host;
+	follower->port = port;
+	follower->socket = -1;
+	pthread_mutex_init(&follower->lock, NULL);
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	pthread_cond_init(&follower->wake, &attr);
+	pthread_condattr_destroy(&attr);
+	if ((errno = pthread_create(&follower->thread, NULL, follower_thread, follower))) {
+		pthread_cond_destroy(&follower->wake);
+		pthread_mutex_destroy(&follower->lock);
+		return -1;
+	}
+	return 0;
+}
+
+void aesd_follower_stop(struct aesd_follower *follower)
+{
+	pthread_mutex_lock(&follower->lock);
+	__atomic_store_n(&follower->stopping, true, __ATOMIC_RELAXED);
+	if (follower->socket != -1)
+		shutdown(follower->socket, SHUT_RDWR);
+	pthread_cond_signal(&follower->wake);
+	pthread_mutex_unlock(&follower->lock);
+	pthread_join(follower->thread, NULL);
+	pthread_cond_destroy(&follower->wake);
+	pthread_mutex_destroy(&follower->lock);
+}
@@ -0,0 +1,67 @@
+/*
+ * aesd-replication.h
+ *
+ *  @brief Primary/follower replication of a log backend: the primary streams the data file to
+ *  followers from the offset they ask for, followers append it to their replica
+ */
+
+#ifndef AESD_REPLICATION_H
+#define AESD_REPLICATION_H
+
+#include <stddef.h>
+#include <stdbool.h>
+#include <pthread.h>
+#include <sys/queue.h>
+#include "aesd-storage.h"
+
+/**
+ * Stream of one follower, served by its own thread
+ */
+struct aesd_replica_link
+{
+    struct aesd_primary *primary;
+    int socket;
+    size_t offset;			// next data file offset to stream
+    bool finished;			// thread is done and can be joined
+    pthread_t thread;
+    LIST_ENTRY(aesd_replica_link) entries;
+};
+
+struct aesd_primary
+{
+    struct aesd_storage *storage;
+    int listen_socket;
+    pthread_t thread;			// accepts followers
+    /**
+     * Protects links and stopping
+     */
+    pthread_mutex_t lock;
+    LIST_HEAD(, aesd_replica_link) links;
+    bool stopping;
+    unsigned long followers;		// accepted so far
+};
+
+struct aesd_follower
+{
+    struct aesd_storage *storage;
+    const char *host;
+    const char *port;
+    pthread_t thread;
+    /**
+     * Protects socket and stopping, wake interrupts the reconnect delay
+     */
+    pthread_mutex_t lock;
+    pthread_cond_t wake;
+    int socket;
+    bool stopping;
+    unsigned long connects;		// successful handshakes so far
+};
+
+extern int aesd_primary_start(struct aesd_primary *primary, struct aesd_storage *storage, int listen_socket);
+extern void aesd_primary_stop(struct aesd_primary *primary);
+
+extern int aesd_follower_start(struct aesd_follower *follower, struct aesd_storage *storage,
+		const char *host, const char *port);
+extern void aesd_follower_stop(struct aesd_follower *follower);
+
+#endif /* AESD_REPLICATION_H */
@@ -0,0 +1,180 @@
+/**
+ * @file aesd-snapshot.c
+ * @brief Shared, reference counted snapshots of the append only data file contents
+ *
+ * Writers append to the newest chunk and publish a new snapshot per write. Readers take
+ * a reference to the current snapshot and send from it without any further locking,
+ * chunk bytes below the snapshot size are never written again. The oldest chunks are
+ * evicted once the cache reaches its cap, readers get older bytes from the file.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include "aesd-snapshot.h"
+
+static void chunk_put(struct aesd_chunk *chunk)
+{
+	if (__atomic_sub_fetch(&chunk->refcount, 1, __ATOMIC_ACQ_REL) == 0)
+		free(chunk);
+}
+
+/**
+ * Drop a snapshot reference, frees the snapshot with its last reference
+ */
+void aesd_snapshot_put(struct aesd_snapshot *snapshot)
+{
+	if (!snapshot || __atomic_sub_fetch(&snapshot->refcount, 1, __ATOMIC_ACQ_REL) != 0)
+		return;
+	for (size_t i = 0; i < snapshot->chunks_n; i++)
+		chunk_put(snapshot->chunks[i]);
+	free(snapshot);
+}
+
+/**
+ * Set up an empty cache holding at most @param max_size bytes
+ * @return 0 on success, -1 if memory could not be allocated
+ */
+int aesd_snapshot_cache_init(struct aesd_snapshot_cache *cache, size_t max_size)
+{
+	memset(cache, 0, sizeof(*cache));
+	cache->max_size = max_size;
+	if (!(cache->current = calloc(1, sizeof(struct aesd_snapshot))))
+		return -1;
+	cache->current->refcount = 1;
+	pthread_mutex_init(&cache->lock, NULL);
+	return 0;
+}
+
+/**
+ * Release the cache, snapshots still referenced by readers stay valid until put
+ */
+void aesd_snapshot_cache_destroy(struct aesd_snapshot_cache *cache)
+{
+	aesd_snapshot_put(cache->current);
+	cache->current = NULL;
+	for (size_t i = 0; i < cache->chunks_n; i++)
+		chunk_put(cache->chunks[i]);
+	free(cache->chunks);
+	cache->chunks = NULL;
+	cache->chunks_n = cache->chunks_allocated = 0;
+	pthread_mutex_destroy(&cache->lock);
+}
+
+// Stop caching, readers get NULL and go to the file, chunks live on only in their snapshots
+static int cache_overflow(struct aesd_snapshot_cache *cache)
+{
+	struct aesd_snapshot *old;
+
+	pthread_mutex_lock(&cache->lock);
+	cache->overflow = true;
+	old = cache->current;
+	cache->current = NULL;
+	pthread_mutex_unlock(&cache->lock);
+	aesd_snapshot_put(old);
+	for (size_t i = 0; i < cache->chunks_n; i++)
+		chunk_put(cache->chunks[i]);
+	free(cache->chunks);
+	cache->chunks = NULL;
+	cache->chunks_n = cache->chunks_allocated = 0;
+	return -1;
+}
+
+// Drop the oldest chunks until @param len more bytes fit, snapshots referencing them keep them
+static void cache_evict(struct aesd_snapshot_cache *cache, size_t len)
+{
+	size_t n = 0;
+
+	while (n < cache->chunks_n && cache->size - cache->start + len > cache->max_size) {
+		cache->start += cache->chunks[n]->used;
+		chunk_put(cache->chunks[n]);
+		n++;
+	}
+	if (n) {
+		cache->chunks_n -= n;
+		memmove(cache->chunks, cache->chunks + n, cache->chunks_n * sizeof(struct aesd_chunk *));
+	}
+}
+
+/**
+ * Append @param len bytes written to the data file and publish a new snapshot,
+ * callers serialize appends in file order
+ * @return 0 on success or once disabled, -1 if the cache disabled itself
+ */
+int aesd_snapshot_cache_append(struct aesd_snapshot_cache *cache, const char *buf, size_t len)
+{
+	struct aesd_snapshot *snapshot, *old;
+
+	if (cache->overflow)
+		return 0;
+	if (cache->size - cache->start + len > cache->max_size)
+		cache_evict(cache, len);
+// A write larger than the cap is not cached at all, the next one starts after it
+	if (len > cache->max_size) {
+		cache->size += len;
+		cache->start = cache->size;
+		len = 0;
+	}
+
+// Fill the newest chunk, open new ones as needed
+	while (len) {
+		struct aesd_chunk *chunk = cache->chunks_n ? cache->chunks[cache->chunks_n - 1] : NULL;
+		if (!chunk || chunk->used == AESD_SNAPSHOT_CHUNK_SIZE) {
+			if (cache->chunks_n == cache->chunks_allocated) {
+				size_t allocated = cache->chunks_allocated ? cache->chunks_allocated * 2 : 16;
+				struct aesd_chunk **chunks = realloc(cache->chunks, allocated * sizeof(struct aesd_chunk *));
+				if (!chunks)
+					return cache_overflow(cache);
+				cache->chunks = chunks;
+				cache->chunks_allocated = allocated;
+			}
+			if (!(chunk = malloc(sizeof(struct aesd_chunk))))
+				return cache_overflow(cache);
+			chunk->refcount = 1;
+			chunk->used = 0;
+			cache->chunks[cache->chunks_n++] = chunk;
+		}
+		size_t n = AESD_SNAPSHOT_CHUNK_SIZE - chunk->used;
+		if (n > len)
+			n = len;
+		memcpy(chunk->data + chunk->used, buf, n);
+		chunk->used += n;
+		cache->size += n;
+		buf += n;
+		len -= n;
+	}
+
+// Publish a snapshot covering everything still cached
+	snapshot = malloc(sizeof(struct aesd_snapshot) + cache->chunks_n * sizeof(struct aesd_chunk *));
+	if (!snapshot)
+		return cache_overflow(cache);
+	snapshot->refcount = 1;
+	snapshot->generation = ++cache->generation;
+	snapshot->start = cache->start;
+	snapshot->size = cache->size;
+	snapshot->chunks_n = cache->chunks_n;
+	for (size_t i = 0; i < cache->chunks_n; i++) {
+		__atomic_add_fetch(&cache->chunks[i]->refcount, 1, __ATOMIC_RELAXED);
+		snapshot->chunks[i] = cache->chunks[i];
+	}
+	pthread_mutex_lock(&cache->lock);
+	old = cache->current;
+	cache->current = snapshot;
+	pthread_mutex_unlock(&cache->lock);
+	aesd_snapshot_put(old);
+	return 0;
+}
+
+/**
+ * Reference the current snapshot, release it with aesd_snapshot_put()
+ * @return snapshot or NULL if the cache is disabled
+ */
+struct aesd_snapshot *aesd_snapshot_get(struct aesd_snapshot_cache *cache)
+{
+	struct aesd_snapshot *snapshot;
+
+	pthread_mutex_lock(&cache->lock);
+	if ((snapshot = cache->current))
+		__atomic_add_fetch(&snapshot->refcount, 1, __ATOMIC_RELAXED);
+	pthread_mutex_unlock(&cache->lock);
+	return snapshot;
+}
@@ -0,0 +1,79 @@
+/*
+ * aesd-snapshot.h
+ *
+ *  @brief Shared, reference counted snapshots of the append only data file contents
+ */
+
+#ifndef AESD_SNAPSHOT_H
+#define AESD_SNAPSHOT_H
+
+#include <stddef.h>
+#include <stdbool.h>
+#include <pthread.h>
+
+#define AESD_SNAPSHOT_CHUNK_SIZE (64*1024)
+
+/**
+ * Piece of the log, bytes below a published size are never modified again
+ */
+struct aesd_chunk
+{
+    int refcount;
+    size_t used;
+    char data[AESD_SNAPSHOT_CHUNK_SIZE];
+};
+
+/**
+ * Immutable view of the log after a given write
+ */
+struct aesd_snapshot
+{
+    int refcount;
+    /**
+     * Number of writes appended when the snapshot was taken
+     */
+    unsigned long generation;
+    /**
+     * Data file offset of the first chunk byte, older bytes were evicted
+     */
+    size_t start;
+    /**
+     * Bytes visible through this snapshot
+     */
+    size_t size;
+    size_t chunks_n;
+    struct aesd_chunk *chunks[];
+};
+
+struct aesd_snapshot_cache
+{
+    /**
+     * Protects current, held only to swap or reference it
+     */
+    pthread_mutex_t lock;
+    struct aesd_snapshot *current;
+    /**
+     * Memory cap, the oldest chunks are evicted to stay below it. The cache disables
+     * itself only when memory cannot be allocated
+     */
+    size_t max_size;
+    bool overflow;
+    /**
+     * Writer side, appends are serialized by the caller
+     */
+    struct aesd_chunk **chunks;
+    size_t chunks_n;
+    size_t chunks_allocated;
+    size_t start;
+    size_t size;
+    unsigned long generation;
+};
+
+extern int aesd_snapshot_cache_init(struct aesd_snapshot_cache *cache, size_t max_size);
+extern void aesd_snapshot_cache_destroy(struct aesd_snapshot_cache *cache);
+
+extern int aesd_snapshot_cache_append(struct aesd_snapshot_cache *cache, const char *buf, size_t len);
+extern struct aesd_snapshot *aesd_snapshot_get(struct aesd_snapshot_cache *cache);
+extern void aesd_snapshot_put(struct aesd_snapshot *snapshot);
+
+#endif /* AESD_SNAPSHOT_H */
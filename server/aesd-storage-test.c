@@ -0,0 +1,297 @@
+/**
+ * @file aesd-storage-test.c
+ * @brief Tests of the storage backends on files in a temporary directory: appends and reads,
+ * aesd_storage_find_lines() with newlines around the edges of its read window, and segment
+ * retention by size and by age
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <limits.h>
+#include "aesd-storage.h"
+#include "aesd-test.h"
+
+#define FIND_LINES_WINDOW (4096)	// bytes aesd_storage_find_lines() reads at a time
+#define SEGMENT_BYTES (100)
+
+static char dir[] = "/tmp/aesd-storage-test.XXXXXX";
+static char path[PATH_MAX];
+
+// Whether the file of the segment starting at @param offset exists
+static bool segment_exists(size_t offset)
+{
+	char segment[PATH_MAX + 32];
+
+	snprintf(segment, sizeof(segment), "%s.%020zu", path, offset);
+	return access(segment, F_OK) == 0;
+}
+
+static int append(struct aesd_storage_handle *handle, const char *data, size_t len, size_t *start)
+{
+	struct iovec iov = { .iov_base = (void *)data, .iov_len = len };
+
+	return aesd_storage_append(handle, &iov, 1, start);
+}
+
+/**
+ * Where the last @param lines lines before @param end start, by a byte by byte scan of @param data
+ * which holds the offsets from @param start
+ */
+static size_t last_lines(const char *data, size_t start, size_t end, size_t lines)
+{
+	if (!lines)
+		return end;
+	for (size_t i = end ? end - 1 : 0; i-- > start; ) {
+		if (data[i - start] == '\n' && !--lines)
+			return i + 1;
+	}
+	return (start < end) ? start : end;
+}
+
+// Look the last lines up from the ends which put the newline at @param newline around a window edge
+static void check_find_lines_around(struct aesd_storage_handle *handle, const char *data, size_t start,
+		size_t size, size_t newline)
+{
+	for (size_t k = 0; k < 4; k++) {
+		for (int d = -1; d <= 1; d++) {
+			size_t end = newline + 1 + k * FIND_LINES_WINDOW + d;
+			if (end < start || end > size)
+				continue;
+			for (size_t lines = 0; lines < 6; lines++) {
+				size_t offset = AESD_STORAGE_EOF;
+				AESD_CHECK(aesd_storage_find_lines(handle, lines, end, &offset) == 0);
+				if (offset != last_lines(data, start, end, lines)) {
+					fprintf(stderr, "end %zu lines %zu: offset %zu, expected %zu\n", end, lines, offset,
+							last_lines(data, start, end, lines));
+					AESD_CHECK(offset == last_lines(data, start, end, lines));
+				}
+			}
+		}
+	}
+}
+
+/**
+ * Check aesd_storage_find_lines() against a scan of @param data, the bytes from @param start up
+ * to @param size, from every line end and from ends which move each newline around the edges of
+ * the windows before them
+ */
+static void check_find_lines(struct aesd_storage_handle *handle, const char *data, size_t start, size_t size)
+{
+	for (size_t i = start; i < size; i++) {
+		if (data[i - start] == '\n')
+			check_find_lines_around(handle, data, start, size, i);
+	}
+	check_find_lines_around(handle, data, start, size, size - 1);
+	check_find_lines_around(handle, data, start, size, start);
+}
+
+/**
+ * Lines of @param n lengths, the last one without a newline if @param unterminated
+ * @return data in @param len bytes, to be freed
+ */
+static char *make_lines(const size_t *lengths, int n, bool unterminated, size_t *len)
+{
+	char *data;
+
+	*len = 0;
+	for (int i = 0; i < n; i++)
+		*len += lengths[i];
+	if (!(data = malloc(*len)))
+		return NULL;
+	for (size_t i = 0, pos = 0; i < n; pos += lengths[i++]) {
+		for (size_t j = 0; j < lengths[i]; j++)
+			data[pos + j] = 'a' + (pos + j) % 26;
+		if (i < n - 1 || !unterminated)
+			data[pos + lengths[i] - 1] = '\n';
+	}
+	return data;
+}
+
+// Appends get consecutive offsets and read back as written
+static void test_append_read(const char *backend)
+{
+	struct aesd_storage storage;
+	struct aesd_storage_handle handle;
+	char buf[64];
+	size_t start = AESD_STORAGE_EOF;
+
+	AESD_CHECK(aesd_storage_open(&storage, aesd_storage_find(backend), path, NULL, NULL, NULL) == 0);
+	AESD_CHECK(aesd_storage_attach(&storage, &handle) == 0);
+	AESD_CHECK(aesd_storage_size(&handle) == 0);
+	AESD_CHECK(append(&handle, "first\n", 6, &start) == 0);
+	AESD_CHECK(start == 0);
+	AESD_CHECK(append(&handle, "second\n", 7, &start) == 0);
+	AESD_CHECK(start == 6);
+	AESD_CHECK(aesd_storage_size(&handle) == 13);
+	AESD_CHECK(aesd_storage_start(&handle) == 0);
+	AESD_CHECK(aesd_storage_read(&handle, buf, sizeof(buf), 0) == 13);
+	AESD_CHECK(!memcmp(buf, "first\nsecond\n", 13));
+	AESD_CHECK(aesd_storage_read(&handle, buf, 4, 8) == 4);
+	AESD_CHECK(!memcmp(buf, "cond", 4));
+	AESD_CHECK(aesd_storage_read(&handle, buf, sizeof(buf), 13) == 0);
+	aesd_storage_detach(&handle);
+	AESD_CHECK(aesd_storage_remove(&storage) == 0);
+	aesd_storage_close(&storage);
+}
+
+/*
+ * Lines shorter, as long as and longer than the window, put newlines on and next to its edges,
+ * the unterminated last line counts as a line
+ */
+static void test_find_lines(bool unterminated)
+{
+	static const size_t lengths[] = {
+		1, 1, FIND_LINES_WINDOW - 3, 1, FIND_LINES_WINDOW, FIND_LINES_WINDOW + 1, 10,
+		2 * FIND_LINES_WINDOW - 1, 2, FIND_LINES_WINDOW - 1, 3 * FIND_LINES_WINDOW + 5, 7,
+	};
+	int n = sizeof(lengths) / sizeof(lengths[0]);
+	struct aesd_storage storage;
+	struct aesd_storage_handle handle;
+	size_t size, offset;
+	char *data = make_lines(lengths, n, unterminated, &size);
+
+	AESD_CHECK(data != NULL);
+	if (!data)
+		return;
+	AESD_CHECK(aesd_storage_open(&storage, aesd_storage_find("fd"), path, NULL, NULL, NULL) == 0);
+	AESD_CHECK(aesd_storage_attach(&storage, &handle) == 0);
+
+// Empty data
+	AESD_CHECK(aesd_storage_find_lines(&handle, 1, 0, &offset) == 0 && offset == 0);
+
+	AESD_CHECK(append(&handle, data, size, NULL) == 0);
+	AESD_CHECK(aesd_storage_size(&handle) == size);
+	check_find_lines(&handle, data, 0, size);
+
+// More lines than there are start at the start of the data
+	AESD_CHECK(aesd_storage_find_lines(&handle, n + 1, size, &offset) == 0 && offset == 0);
+	AESD_CHECK(aesd_storage_find_lines(&handle, n, size, &offset) == 0 && offset == 0);
+	AESD_CHECK(aesd_storage_find_lines(&handle, 1, size, &offset) == 0 && offset == size - lengths[n - 1]);
+
+	aesd_storage_detach(&handle);
+	AESD_CHECK(aesd_storage_remove(&storage) == 0);
+	aesd_storage_close(&storage);
+	free(data);
+}
+
+/*
+ * Segments entirely before the last max_bytes are dropped with their files, reads of their
+ * offsets fail instead of returning later data, and lines are found back to the new start
+ */
+static void test_segment_size(void)
+{
+	static const size_t lengths[] = { 30, 30, 30, 30, 30, 30, 30, 30, 30, 30, 30, 30, 30, 30, 30, 30, 30, 30, 30, 30 };
+	int n = sizeof(lengths) / sizeof(lengths[0]);
+	struct aesd_storage_retention retention = { .segment_bytes = SEGMENT_BYTES, .max_bytes = 3 * SEGMENT_BYTES };
+	struct aesd_storage storage;
+	struct aesd_storage_handle handle;
+	size_t size, start, offset;
+	char buf[2 * SEGMENT_BYTES];
+	char *data = make_lines(lengths, n, false, &size);
+
+	AESD_CHECK(data != NULL);
+	if (!data)
+		return;
+	AESD_CHECK(aesd_storage_open(&storage, aesd_storage_find("segment"), path, &retention, NULL, NULL) == 0);
+	AESD_CHECK(aesd_storage_attach(&storage, &handle) == 0);
+
+// Up to max_bytes nothing is dropped
+	AESD_CHECK(append(&handle, data, 3 * SEGMENT_BYTES, NULL) == 0);
+	AESD_CHECK(aesd_storage_start(&handle) == 0);
+	AESD_CHECK(segment_exists(0));
+
+// Line by line, past it the segments before the last max_bytes go
+	for (size_t pos = 3 * SEGMENT_BYTES; pos < size; pos += lengths[0])
+		AESD_CHECK(append(&handle, data + pos, lengths[0], NULL) == 0);
+	AESD_CHECK(aesd_storage_size(&handle) == size);
+	start = aesd_storage_start(&handle);
+	AESD_CHECK(start == (size - 3 * SEGMENT_BYTES) / SEGMENT_BYTES * SEGMENT_BYTES);
+	AESD_CHECK(start + 3 * SEGMENT_BYTES <= size && start + 4 * SEGMENT_BYTES > size);
+	for (size_t segment = 0; segment < size; segment += SEGMENT_BYTES)
+		AESD_CHECK(segment_exists(segment) == (segment >= start));
+
+// A dropped offset fails, even where the read would go on into retained segments
+	errno = 0;
+	AESD_CHECK(aesd_storage_read(&handle, buf, sizeof(buf), start - 1) == -1 && errno == ENODATA);
+	errno = 0;
+	AESD_CHECK(aesd_storage_read(&handle, buf, 1, 0) == -1 && errno == ENODATA);
+
+// Retained reads go across segment ends up to the end of the data
+	AESD_CHECK(aesd_storage_read(&handle, buf, sizeof(buf), start + SEGMENT_BYTES / 2) == sizeof(buf));
+	AESD_CHECK(!memcmp(buf, data + start + SEGMENT_BYTES / 2, sizeof(buf)));
+	AESD_CHECK(aesd_storage_read(&handle, buf, sizeof(buf), size - 10) == 10);
+	AESD_CHECK(!memcmp(buf, data + size - 10, 10));
+
+// The scan for lines ends at the start, which need not begin a line
+	AESD_CHECK(aesd_storage_find_lines(&handle, n, size, &offset) == 0 && offset == start);
+	check_find_lines(&handle, data + start, start, size);
+
+	aesd_storage_detach(&handle);
+	AESD_CHECK(aesd_storage_remove(&storage) == 0);
+	aesd_storage_close(&storage);
+	for (size_t segment = 0; segment < size; segment += SEGMENT_BYTES)
+		AESD_CHECK(!segment_exists(segment));
+	free(data);
+}
+
+/*
+ * Segments sealed for max_age_s are dropped on the next append or lookup of the start, the one
+ * being written is kept however old it is
+ */
+static void test_segment_age(void)
+{
+	struct aesd_storage_retention retention = { .segment_bytes = SEGMENT_BYTES, .max_age_s = 1 };
+	struct aesd_storage storage;
+	struct aesd_storage_handle handle;
+	char line[SEGMENT_BYTES / 2];
+	char buf[sizeof(line)];
+
+	memset(line, 'x', sizeof(line) - 1);
+	line[sizeof(line) - 1] = '\n';
+	AESD_CHECK(aesd_storage_open(&storage, aesd_storage_find("segment"), path, &retention, NULL, NULL) == 0);
+	AESD_CHECK(aesd_storage_attach(&storage, &handle) == 0);
+	for (int i = 0; i < 5; i++)
+		AESD_CHECK(append(&handle, line, sizeof(line), NULL) == 0);
+	AESD_CHECK(aesd_storage_start(&handle) == 0);
+
+// Ages are counted in whole seconds of the coarse clock
+	sleep(2);
+	AESD_CHECK(aesd_storage_start(&handle) == 2 * SEGMENT_BYTES);
+	AESD_CHECK(!segment_exists(0) && !segment_exists(SEGMENT_BYTES) && segment_exists(2 * SEGMENT_BYTES));
+	errno = 0;
+	AESD_CHECK(aesd_storage_read(&handle, buf, sizeof(buf), 0) == -1 && errno == ENODATA);
+	AESD_CHECK(aesd_storage_read(&handle, buf, sizeof(buf), 2 * SEGMENT_BYTES) == sizeof(buf));
+	AESD_CHECK(!memcmp(buf, line, sizeof(buf)));
+
+// Writing into the next one seals it and starts its age
+	AESD_CHECK(append(&handle, line, sizeof(line), NULL) == 0);
+	AESD_CHECK(append(&handle, line, sizeof(line), NULL) == 0);
+	AESD_CHECK(aesd_storage_start(&handle) == 2 * SEGMENT_BYTES);
+	sleep(2);
+	AESD_CHECK(aesd_storage_start(&handle) == 3 * SEGMENT_BYTES);
+
+	aesd_storage_detach(&handle);
+	AESD_CHECK(aesd_storage_remove(&storage) == 0);
+	aesd_storage_close(&storage);
+}
+
+int main(void)
+{
+	if (!mkdtemp(dir)) {
+		perror("mkdtemp");
+		return 1;
+	}
+	snprintf(path, sizeof(path), "%s/aesdsocketdata", dir);
+
+	test_append_read("stdio");
+	test_append_read("fd");
+	test_find_lines(false);
+	test_find_lines(true);
+	test_segment_size();
+	test_segment_age();
+
+	rmdir(dir);
+	return aesd_test_result("aesd-storage-test");
+}
@@ -0,0 +1,948 @@
+/**
+ * @file aesd-storage.c
+ * @brief Storage backends of the data file
+ *
+ * The stdio and fd backends keep a regular file which is only appended to. A line is given its
+ * offset once and keeps it, readers see it once it is published, see aesd-append.c, and may
+ * read anything published at any offset through the one descriptor all handles share. The
+ * aesdchar backend passes lines to the driver, which drops the oldest writes and shifts
+ * offsets, and opens the device for each handle, so that AESDCHAR_IOCSEEKTO moves the file
+ * position of that connection only.
+ *
+ * The segment backend is a log as well, split into files of segment_bytes offsets each, which
+ * are named after their first offset. Lines may straddle two segments. Once the data is past a
+ * segment, retention drops it by size or age from the front: offsets of the rest stay the same
+ * and reads start at the first retained segment, so memory, disk and responses are bounded by
+ * the retained data. Appends and lookups of the start apply retention, so ages run out while
+ * the server is idle too. Segments are reference counted, a read or write keeps a dropped segment
+ * open until it is done, but a read of a dropped offset fails with ENODATA.
+ */
+
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <limits.h>
+#include <stdbool.h>
+#include <time.h>
+#include <dirent.h>
+#include <poll.h>
+#include <sys/stat.h>
+#include <sys/ioctl.h>
+#include "../aesd-char-driver/aesd_ioctl.h"
+#include "aesd-metrics.h"
+#include "aesd-storage.h"
+
+static size_t iov_length(const struct iovec *iov, int iov_n)
+{
+	size_t len = 0;
+
+	for (int i = 0; i < iov_n; i++)
+		len += iov[i].iov_len;
+	return len;
+}
+
+// pwritev() all of iov at offset, a partly written iovec is finished with pwrite()
+static int pwritev_all(int fd, const struct iovec *iov, int iov_n, off_t offset)
+{
+	int i = 0;
+
+	while (i < iov_n) {
+		ssize_t n = pwritev(fd, iov + i, (iov_n - i < IOV_MAX) ? iov_n - i : IOV_MAX, offset);
+		if (n == -1) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		offset += n;
+		while (i < iov_n && n >= iov[i].iov_len)
+			n -= iov[i++].iov_len;
+		if (n) {
+			const char *base = (const char *)iov[i].iov_base + n;
+			size_t len = iov[i].iov_len - n;
+			while (len) {
+				ssize_t w = pwrite(fd, base, len, offset);
+				if (w == -1) {
+					if (errno == EINTR)
+						continue;
+					return -1;
+				}
+				base += w;
+				len -= w;
+				offset += w;
+			}
+			i++;
+		}
+	}
+	return 0;
+}
+
+/**
+ * Publish a range, every range before it must be published, the ordered callback runs first.
+ * A range that was not @param written stops the log at its offset, neither the callback nor
+ * readers see it or anything after it, and it is published only to not block later appends
+ * @return 0 if readers see the range, -1 if the log stopped at or before it
+ */
+static int log_publish(struct aesd_storage *storage, const struct iovec *iov, int iov_n, size_t offset, size_t len,
+		bool written)
+{
+	bool visible = written && storage->failed == AESD_STORAGE_EOF;
+
+	if (!visible && storage->failed == AESD_STORAGE_EOF)
+		__atomic_store_n(&storage->failed, offset, __ATOMIC_RELEASE);
+	if (visible && storage->ordered)
+		storage->ordered(storage->ctx, iov, iov_n, offset);
+	aesd_append_publish(&storage->log, offset, len);
+	return visible ? 0 : -1;
+}
+
+// Appends after a failed one are refused, a hole must not be followed by data
+static int log_failed(struct aesd_storage *storage)
+{
+	if (__atomic_load_n(&storage->failed, __ATOMIC_ACQUIRE) == AESD_STORAGE_EOF)
+		return 0;
+	errno = EIO;
+	return -1;
+}
+
+// Start from an empty file, appends pwrite() to reserved offsets so it must not be O_APPEND
+static int log_open(struct aesd_storage *storage)
+{
+	remove(storage->path);
+	if ((storage->fd = open(storage->path, O_CREAT | O_RDWR | O_CLOEXEC, S_IRUSR | S_IWUSR)) == -1)
+		return -1;
+	aesd_append_init(&storage->log);
+	return 0;
+}
+
+static void log_close(struct aesd_storage *storage)
+{
+	close(storage->fd);
+	aesd_append_destroy(&storage->log);
+}
+
+static int log_attach(struct aesd_storage *storage, struct aesd_storage_handle *handle)
+{
+	handle->fd = storage->fd;
+	return 0;
+}
+
+static void log_detach(struct aesd_storage_handle *handle)
+{
+}
+
+// Reads at an offset work on the regular file and on the device alike
+static ssize_t handle_pread(struct aesd_storage_handle *handle, void *buf, size_t len, size_t offset)
+{
+	ssize_t n;
+
+	while ((n = pread(handle->fd, buf, len, offset)) == -1 && errno == EINTR)
+		;
+	return n;
+}
+
+static size_t log_size(struct aesd_storage_handle *handle)
+{
+	size_t published = aesd_append_published(&handle->storage->log);
+	size_t failed = __atomic_load_n(&handle->storage->failed, __ATOMIC_ACQUIRE);
+
+	return (published < failed) ? published : failed;
+}
+
+static int log_sync(struct aesd_storage *storage)
+{
+	return fdatasync(storage->fd);
+}
+
+static int log_remove(struct aesd_storage *storage)
+{
+	return remove(storage->path);
+}
+
+// Writes an append to its reserved range
+typedef int (*log_write_fn)(struct aesd_storage *storage, const struct iovec *iov, int iov_n, size_t offset);
+
+/**
+ * Reserve the range, write into it while other appends fill theirs, publish it in turn
+ * @return 0 written and published, -1 write failed with errno set, or with EIO if an earlier
+ * append failed, readers see neither
+ */
+static int log_append(struct aesd_storage_handle *handle, const struct iovec *iov, int iov_n, size_t *start,
+		log_write_fn write_range)
+{
+	struct aesd_storage *storage = handle->storage;
+	size_t len = iov_length(iov, iov_n);
+	size_t offset;
+	unsigned long long wait_start, hold_start;
+	int result, saved_errno;
+
+	if (log_failed(storage) == -1)
+		return -1;
+	offset = aesd_append_reserve(&storage->log, len);
+	if (start)
+		*start = offset;
+	result = write_range(storage, iov, iov_n, offset);
+	saved_errno = errno;
+	wait_start = aesd_metrics_now();
+	aesd_append_wait(&storage->log, offset);
+	hold_start = aesd_metrics_now();
+	aesd_metrics_record(AESD_STAGE_LOCK_WAIT, hold_start - wait_start);
+	if (log_publish(storage, iov, iov_n, offset, len, result == 0) == -1 && result == 0) {
+		result = -1;
+		saved_errno = EIO;
+	}
+	aesd_metrics_record(AESD_STAGE_LOCK_HOLD, aesd_metrics_now() - hold_start);
+	errno = saved_errno;
+	return result;
+}
+
+static int fd_write(struct aesd_storage *storage, const struct iovec *iov, int iov_n, size_t offset)
+{
+	return pwritev_all(storage->fd, iov, iov_n, offset);
+}
+
+// Raw descriptor: pwrite() to the reserved range
+static int fd_append(struct aesd_storage_handle *handle, const struct iovec *iov, int iov_n, size_t *start)
+{
+	return log_append(handle, iov, iov_n, start, fd_write);
+}
+
+static int stdio_open(struct aesd_storage *storage)
+{
+	if (log_open(storage) == -1)
+		return -1;
+	if (!(storage->file = fdopen(storage->fd, "r+"))) {
+		log_close(storage);
+		return -1;
+	}
+	return 0;
+}
+
+static void stdio_close(struct aesd_storage *storage)
+{
+	fclose(storage->file);
+	aesd_append_destroy(&storage->log);
+}
+
+/**
+ * stdio: the FILE lock serializes appends, each one is written and flushed at the end of the
+ * file, which is its reserved range, before the next one starts
+ */
+static int stdio_append(struct aesd_storage_handle *handle, const struct iovec *iov, int iov_n, size_t *start)
+{
+	struct aesd_storage *storage = handle->storage;
+	size_t len = iov_length(iov, iov_n);
+	size_t offset;
+	unsigned long long wait_start = aesd_metrics_now(), hold_start;
+	int result = 0, saved_errno = 0;
+
+	flockfile(storage->file);
+	hold_start = aesd_metrics_now();
+	aesd_metrics_record(AESD_STAGE_LOCK_WAIT, hold_start - wait_start);
+	if (log_failed(storage) == -1) {
+		funlockfile(storage->file);
+		return -1;
+	}
+	offset = aesd_append_reserve(&storage->log, len);
+	if (start)
+		*start = offset;
+	for (int i = 0; i < iov_n && result == 0; i++) {
+		if (fwrite_unlocked(iov[i].iov_base, 1, iov[i].iov_len, storage->file) != iov[i].iov_len)
+			result = -1;
+	}
+	if (fflush_unlocked(storage->file) == EOF)
+		result = -1;
+// Stop the log at the failed append like a failed pwrite()
+	if (result == -1) {
+		saved_errno = errno;
+		clearerr_unlocked(storage->file);
+	}
+	log_publish(storage, iov, iov_n, offset, len, result == 0);
+	funlockfile(storage->file);
+	aesd_metrics_record(AESD_STAGE_LOCK_HOLD, aesd_metrics_now() - hold_start);
+	errno = saved_errno;
+	return result;
+}
+
+struct aesd_segment {
+	size_t index;
+	int fd;
+	int refs;				// one of the table, one per read or write using it
+	bool dirty;				// written since the last sync
+	bool sealed;				// the next segment exists
+	unsigned long sealed_s;
+};
+
+static unsigned long coarse_seconds(void)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC_COARSE, &now);
+	return now.tv_sec;
+}
+
+static void segment_path(struct aesd_storage *storage, size_t index, char *path, size_t path_size)
+{
+	snprintf(path, path_size, "%s.%020zu", storage->path, index * storage->retention.segment_bytes);
+}
+
+static void segment_put(struct aesd_segment *segment)
+{
+	if (__atomic_sub_fetch(&segment->refs, 1, __ATOMIC_ACQ_REL) == 0) {
+		close(segment->fd);
+		free(segment);
+	}
+}
+
+/**
+ * Directory of the data file into @param dir
+ * @return name of the data file in it
+ */
+static const char *data_dir(struct aesd_storage *storage, char *dir, size_t dir_size)
+{
+	const char *name = strrchr(storage->path, '/');
+
+	if (!name) {
+		snprintf(dir, dir_size, ".");
+		return storage->path;
+	}
+	snprintf(dir, dir_size, "%.*s", (int)(name - storage->path), storage->path);
+	if (!*dir)
+		snprintf(dir, dir_size, "/");
+	return name + 1;
+}
+
+// Create segments up to @param index, the ones before it are sealed, called with the table locked
+static int segment_create(struct aesd_storage *storage, size_t index)
+{
+	struct aesd_segment_table *table = &storage->segments;
+	char path[PATH_MAX];
+
+	while (table->first + table->n <= index) {
+		struct aesd_segment *segment;
+		if (table->n == table->allocated) {
+			size_t allocated = table->allocated ? table->allocated * 2 : 16;
+			struct aesd_segment **segments = realloc(table->segments, allocated * sizeof(*segments));
+			if (!segments)
+				return -1;
+			table->segments = segments;
+			table->allocated = allocated;
+		}
+		if (!(segment = calloc(1, sizeof(*segment))))
+			return -1;
+		segment->index = table->first + table->n;
+		segment->refs = 1;
+// After a hot restart the names belong to the next server
+		if (__atomic_load_n(&storage->removed, __ATOMIC_RELAXED)) {
+			data_dir(storage, path, sizeof(path));
+			segment->fd = open(path, O_TMPFILE | O_RDWR | O_CLOEXEC, S_IRUSR | S_IWUSR);
+		} else {
+			segment_path(storage, segment->index, path, sizeof(path));
+			segment->fd = open(path, O_CREAT | O_TRUNC | O_RDWR | O_CLOEXEC, S_IRUSR | S_IWUSR);
+		}
+		if (segment->fd == -1) {
+			free(segment);
+			return -1;
+		}
+		if (table->n) {
+			struct aesd_segment *last = table->segments[table->n - 1];
+			last->sealed_s = coarse_seconds();
+			last->sealed = true;
+		}
+		table->segments[table->n++] = segment;
+	}
+	return 0;
+}
+
+/**
+ * @return segment @param index with a reference taken, created if @param create, or NULL with
+ * errno ENODATA if retention dropped it, ENOENT if it does not exist yet
+ */
+static struct aesd_segment *segment_get(struct aesd_storage *storage, size_t index, bool create)
+{
+	struct aesd_segment_table *table = &storage->segments;
+	struct aesd_segment *segment = NULL;
+
+	pthread_mutex_lock(&table->lock);
+	if (index < table->first) {
+		errno = ENODATA;
+	} else if (index >= table->first + table->n && (!create || segment_create(storage, index) == -1)) {
+		if (!create)
+			errno = ENOENT;
+	} else {
+		segment = table->segments[index - table->first];
+		__atomic_add_fetch(&segment->refs, 1, __ATOMIC_RELAXED);
+	}
+	pthread_mutex_unlock(&table->lock);
+	return segment;
+}
+
+/**
+ * Drop segments from the front which are complete below @param published and either entirely
+ * before the last max_bytes or sealed for max_age_s, the last complete one stays for age
+ */
+static void segment_retain(struct aesd_storage *storage, size_t published)
+{
+	struct aesd_segment_table *table = &storage->segments;
+	struct aesd_storage_retention *retention = &storage->retention;
+	size_t complete = published / retention->segment_bytes;
+	size_t size_limit = 0;
+	unsigned long now = 0, checked;
+	char path[PATH_MAX];
+
+	if (retention->max_bytes && published > retention->max_bytes)
+		size_limit = (published - retention->max_bytes) / retention->segment_bytes;
+// Ages are checked once a second, sizes without a lock until there is something to drop
+	if (retention->max_age_s) {
+		now = coarse_seconds();
+		checked = __atomic_load_n(&table->checked_s, __ATOMIC_RELAXED);
+		if (checked == now || !__atomic_compare_exchange_n(&table->checked_s, &checked, now, false,
+				__ATOMIC_RELAXED, __ATOMIC_RELAXED))
+			now = 0;
+	}
+	if (!now && __atomic_load_n(&table->start, __ATOMIC_RELAXED) / retention->segment_bytes >= size_limit)
+		return;
+
+	pthread_mutex_lock(&table->lock);
+	while (table->n && table->first < complete) {
+		struct aesd_segment *segment = table->segments[0];
+		if (table->first >= size_limit && !(now && segment->sealed && now - segment->sealed_s >= retention->max_age_s))
+			break;
+		segment_path(storage, segment->index, path, sizeof(path));
+		if (!__atomic_load_n(&storage->removed, __ATOMIC_RELAXED))
+			unlink(path);
+		memmove(table->segments, table->segments + 1, --table->n * sizeof(*table->segments));
+		table->first++;
+		__atomic_store_n(&table->start, table->first * retention->segment_bytes, __ATOMIC_RELAXED);
+		segment_put(segment);
+	}
+	pthread_mutex_unlock(&table->lock);
+}
+
+// Remove segment files of an earlier run, their names are the data file name and an offset
+static void segment_remove_stale(struct aesd_storage *storage)
+{
+	char dir[PATH_MAX];
+	const char *name = data_dir(storage, dir, sizeof(dir));
+	size_t name_len = strlen(name);
+	struct dirent *entry;
+	DIR *d;
+
+	if (!(d = opendir(dir)))
+		return;
+	while ((entry = readdir(d))) {
+		const char *suffix = entry->d_name + name_len;
+		if (strncmp(entry->d_name, name, name_len) || *suffix != '.' || strspn(suffix + 1, "0123456789") != 20
+				|| suffix[21])
+			continue;
+		unlinkat(dirfd(d), entry->d_name, 0);
+	}
+	closedir(d);
+}
+
+static int segment_open(struct aesd_storage *storage)
+{
+	if (!storage->retention.segment_bytes) {
+		errno = EINVAL;
+		return -1;
+	}
+	segment_remove_stale(storage);
+	pthread_mutex_init(&storage->segments.lock, NULL);
+	aesd_append_init(&storage->log);
+	return 0;
+}
+
+static void segment_close(struct aesd_storage *storage)
+{
+	struct aesd_segment_table *table = &storage->segments;
+
+	for (size_t i = 0; i < table->n; i++)
+		segment_put(table->segments[i]);
+	free(table->segments);
+	pthread_mutex_destroy(&table->lock);
+	aesd_append_destroy(&storage->log);
+}
+
+// Write the reserved range segment by segment, iovecs are split at segment boundaries
+static int segment_write(struct aesd_storage *storage, const struct iovec *iov, int iov_n, size_t offset)
+{
+	size_t segment_bytes = storage->retention.segment_bytes;
+	size_t done = 0;			// of iov[i]
+	int i = 0;
+
+	while (i < iov_n) {
+		struct iovec part[IOV_MAX];
+		size_t room = segment_bytes - offset % segment_bytes, len = 0;
+		struct aesd_segment *segment;
+		int part_n = 0, result;
+		while (i < iov_n && part_n < IOV_MAX && len < room) {
+			size_t take = iov[i].iov_len - done;
+			if (take > room - len)
+				take = room - len;
+			part[part_n].iov_base = (char *)iov[i].iov_base + done;
+			part[part_n++].iov_len = take;
+			len += take;
+			done += take;
+			if (done == iov[i].iov_len) {
+				i++;
+				done = 0;
+			}
+		}
+		if (!len)
+			continue;
+		if (!(segment = segment_get(storage, offset / segment_bytes, true)))
+			return -1;
+		result = pwritev_all(segment->fd, part, part_n, offset % segment_bytes);
+		__atomic_store_n(&segment->dirty, true, __ATOMIC_RELEASE);
+		segment_put(segment);
+		if (result == -1)
+			return -1;
+		offset += len;
+	}
+	return 0;
+}
+
+static int segment_append(struct aesd_storage_handle *handle, const struct iovec *iov, int iov_n, size_t *start)
+{
+	size_t offset;
+	int result = log_append(handle, iov, iov_n, &offset, segment_write);
+	int saved_errno = errno;
+
+	if (result == 0) {
+		if (start)
+			*start = offset;
+		segment_retain(handle->storage, offset + iov_length(iov, iov_n));
+	}
+	errno = saved_errno;
+	return result;
+}
+
+/**
+ * Read across segments, stops at the end of what is written
+ * @return bytes read, -1 with errno ENODATA if @param offset was dropped
+ */
+static ssize_t segment_read(struct aesd_storage_handle *handle, void *buf, size_t len, size_t offset)
+{
+	struct aesd_storage *storage = handle->storage;
+	size_t segment_bytes = storage->retention.segment_bytes;
+	size_t done = 0;
+
+	while (done < len) {
+		size_t pos = offset % segment_bytes;
+		size_t part = (len - done < segment_bytes - pos) ? len - done : segment_bytes - pos;
+		struct aesd_segment *segment = segment_get(storage, offset / segment_bytes, false);
+		ssize_t n;
+		if (!segment) {
+			if (errno == ENODATA && !done)
+				return -1;
+			break;
+		}
+		while ((n = pread(segment->fd, (char *)buf + done, part, pos)) == -1 && errno == EINTR)
+			;
+		segment_put(segment);
+		if (n == -1)
+			return done ? done : -1;
+		if (n == 0)
+			break;
+		done += n;
+		offset += n;
+	}
+	return done;
+}
+
+// Ages run out while nothing is appended, so reads apply retention as well
+static size_t segment_start(struct aesd_storage_handle *handle)
+{
+	segment_retain(handle->storage, log_size(handle));
+	return __atomic_load_n(&handle->storage->segments.start, __ATOMIC_RELAXED);
+}
+
+// Sync the segments written since the last sync, without holding the table lock while syncing
+static int segment_sync(struct aesd_storage *storage)
+{
+	struct aesd_segment_table *table = &storage->segments;
+	struct aesd_segment *dirty[16];
+	size_t next = 0;
+	int result = 0, saved_errno = 0;
+
+	do {
+		int dirty_n = 0;
+		pthread_mutex_lock(&table->lock);
+		if (next < table->first)
+			next = table->first;
+		for (; next < table->first + table->n && dirty_n < sizeof(dirty) / sizeof(dirty[0]); next++) {
+			struct aesd_segment *segment = table->segments[next - table->first];
+			if (__atomic_exchange_n(&segment->dirty, false, __ATOMIC_ACQ_REL)) {
+				__atomic_add_fetch(&segment->refs, 1, __ATOMIC_RELAXED);
+				dirty[dirty_n++] = segment;
+			}
+		}
+		pthread_mutex_unlock(&table->lock);
+		for (int i = 0; i < dirty_n; i++) {
+			if (fdatasync(dirty[i]->fd) == -1) {
+				saved_errno = errno;
+				result = -1;
+			}
+			segment_put(dirty[i]);
+		}
+		if (!dirty_n)
+			break;
+	} while (true);
+	errno = saved_errno;
+	return result;
+}
+
+static int segment_remove(struct aesd_storage *storage)
+{
+	struct aesd_segment_table *table = &storage->segments;
+	char path[PATH_MAX];
+	int result = 0;
+
+	pthread_mutex_lock(&table->lock);
+	for (size_t i = 0; i < table->n; i++) {
+		segment_path(storage, table->segments[i]->index, path, sizeof(path));
+		if (unlink(path) == -1)
+			result = -1;
+	}
+	pthread_mutex_unlock(&table->lock);
+	return result;
+}
+
+static int aesdchar_open(struct aesd_storage *storage)
+{
+	struct stat path_stat;
+
+	if (stat(storage->path, &path_stat) == -1)
+		return -1;
+	if (!S_ISCHR(path_stat.st_mode)) {
+		errno = ENODEV;
+		return -1;
+	}
+	return 0;
+}
+
+static void aesdchar_close(struct aesd_storage *storage)
+{
+}
+
+static int aesdchar_attach(struct aesd_storage *storage, struct aesd_storage_handle *handle)
+{
+	return ((handle->fd = open(storage->path, O_RDWR | O_CLOEXEC)) == -1) ? -1 : 0;
+}
+
+static void aesdchar_detach(struct aesd_storage_handle *handle)
+{
+	if (handle->fd != -1)
+		close(handle->fd);
+}
+
+/**
+ * The driver completes a write command at its newline, the iovecs may be written separately
+ * @param start is not set, offsets of the device change as old writes are dropped
+ */
+static int aesdchar_append(struct aesd_storage_handle *handle, const struct iovec *iov, int iov_n, size_t *start)
+{
+	struct iovec part;
+
+	for (int i = 0; i < iov_n; i++) {
+		part = iov[i];
+		while (part.iov_len) {
+			ssize_t n = write(handle->fd, part.iov_base, part.iov_len);
+			if (n == -1) {
+				if (errno == EINTR)
+					continue;
+				return -1;
+			}
+			part.iov_base = (char *)part.iov_base + n;
+			part.iov_len -= n;
+		}
+	}
+	return 0;
+}
+
+/**
+ * The ioctl moves the file position of this handle, which is where its next response starts.
+ * The driver adds the position of the command to the file position, so it starts from 0
+ */
+static int aesdchar_seekto(struct aesd_storage_handle *handle, uint32_t write_cmd, uint32_t write_cmd_offset, size_t *offset)
+{
+	struct aesd_seekto seek_to = { .write_cmd = write_cmd, .write_cmd_offset = write_cmd_offset };
+	off_t pos;
+
+	if (lseek(handle->fd, 0, SEEK_SET) == -1)
+		return -1;
+	if (ioctl(handle->fd, AESDCHAR_IOCSEEKTO, &seek_to) < 0)
+		return -1;
+	if ((pos = lseek(handle->fd, 0, SEEK_CUR)) == -1)
+		return -1;
+	*offset = pos;
+	return 0;
+}
+
+// Size of what the driver keeps, the file position is left where it was
+static size_t aesdchar_size(struct aesd_storage_handle *handle)
+{
+	off_t pos = lseek(handle->fd, 0, SEEK_CUR);
+	off_t end = lseek(handle->fd, 0, SEEK_END);
+
+	if (pos != -1)
+		lseek(handle->fd, pos, SEEK_SET);
+	return (end == -1) ? 0 : end;
+}
+
+static const struct aesd_storage_ops backends[] = {
+	{
+		.name = "stdio",
+		.flags = AESD_STORAGE_LOG | AESD_STORAGE_FILE,
+		.open = stdio_open,
+		.close = stdio_close,
+		.attach = log_attach,
+		.detach = log_detach,
+		.append = stdio_append,
+		.read = handle_pread,
+		.size = log_size,
+		.sync = log_sync,
+		.remove = log_remove,
+	},
+	{
+		.name = "fd",
+		.flags = AESD_STORAGE_LOG | AESD_STORAGE_FILE,
+		.open = log_open,
+		.close = log_close,
+		.attach = log_attach,
+		.detach = log_detach,
+		.append = fd_append,
+		.read = handle_pread,
+		.size = log_size,
+		.sync = log_sync,
+		.remove = log_remove,
+	},
+	{
+		.name = "segment",
+		.flags = AESD_STORAGE_LOG | AESD_STORAGE_RETAIN,
+		.open = segment_open,
+		.close = segment_close,
+		.attach = log_attach,
+		.detach = log_detach,
+		.append = segment_append,
+		.read = segment_read,
+		.size = log_size,
+		.start = segment_start,
+		.sync = segment_sync,
+		.remove = segment_remove,
+	},
+	{
+		.name = "aesdchar",
+		.open = aesdchar_open,
+		.close = aesdchar_close,
+		.attach = aesdchar_attach,
+		.detach = aesdchar_detach,
+		.append = aesdchar_append,
+		.read = handle_pread,
+		.seekto = aesdchar_seekto,
+		.size = aesdchar_size,
+	},
+};
+
+/**
+ * @return backend called @param name or NULL if there is none
+ */
+const struct aesd_storage_ops *aesd_storage_find(const char *name)
+{
+	for (int i = 0; i < sizeof(backends) / sizeof(backends[0]); i++) {
+		if (!strcmp(backends[i].name, name))
+			return &backends[i];
+	}
+	return NULL;
+}
+
+/**
+ * Open the data file at @param path with backend @param ops, a log backend starts it empty
+ * @param retention segment size and limits of the segment backend, may be NULL for others
+ * @param ordered called for each append in file order, may be NULL, not used by other backends
+ * @return 0 on success, -1 with errno set
+ */
+int aesd_storage_open(struct aesd_storage *storage, const struct aesd_storage_ops *ops, const char *path,
+		const struct aesd_storage_retention *retention, aesd_storage_ordered_fn ordered, void *ctx)
+{
+	memset(storage, 0, sizeof(*storage));
+	storage->ops = ops;
+	storage->path = path;
+	storage->fd = -1;
+	storage->failed = AESD_STORAGE_EOF;
+	if (retention)
+		storage->retention = *retention;
+	storage->ordered = ordered;
+	storage->ctx = ctx;
+	return ops->open(storage);
+}
+
+/**
+ * Every handle must have been detached
+ */
+void aesd_storage_close(struct aesd_storage *storage)
+{
+	storage->ops->close(storage);
+}
+
+/**
+ * Make the appends so far durable, backends without a file of their own have nothing to sync
+ * @return 0 on success, -1 with errno set
+ */
+int aesd_storage_sync(struct aesd_storage *storage)
+{
+	return storage->ops->sync ? storage->ops->sync(storage) : 0;
+}
+
+/**
+ * Delete the files of a log backend, open handles still read and append to them, files created
+ * later get no name. Only the first call deletes, a hot restart may have reused the names since
+ * @return 0 on success, -1 with errno set
+ */
+int aesd_storage_remove(struct aesd_storage *storage)
+{
+	if (__atomic_exchange_n(&storage->removed, true, __ATOMIC_RELAXED))
+		return 0;
+	return storage->ops->remove ? storage->ops->remove(storage) : 0;
+}
+
+/**
+ * Give a connection its view of the storage, detach it even if this fails
+ * @return 0 on success, -1 with errno set
+ */
+int aesd_storage_attach(struct aesd_storage *storage, struct aesd_storage_handle *handle)
+{
+	handle->storage = storage;
+	handle->fd = -1;
+	return storage->ops->attach(storage, handle);
+}
+
+/**
+ * Release the view, does nothing for a handle which was never attached
+ */
+void aesd_storage_detach(struct aesd_storage_handle *handle)
+{
+	if (handle->storage)
+		handle->storage->ops->detach(handle);
+	handle->storage = NULL;
+	handle->fd = -1;
+}
+
+/**
+ * Append the bytes of @param iov as one write, lines of concurrent appends never interleave
+ * @param start receives the offset of the first byte with a log backend, may be NULL
+ * @return 0 on success, -1 with errno set
+ */
+int aesd_storage_append(struct aesd_storage_handle *handle, const struct iovec *iov, int iov_n, size_t *start)
+{
+	return handle->storage->ops->append(handle, iov, iov_n, start);
+}
+
+/**
+ * Read up to @param len bytes at @param offset, the file position is not moved
+ * @return bytes read, 0 at the end of the data, -1 with errno set
+ */
+ssize_t aesd_storage_read(struct aesd_storage_handle *handle, void *buf, size_t len, size_t offset)
+{
+	return handle->storage->ops->read(handle, buf, len, offset);
+}
+
+/**
+ * Seek to byte @param write_cmd_offset of write command @param write_cmd
+ * @param offset receives the data offset the command refers to
+ * @return 0 on success, -1 with errno set, ENOTTY if the backend has no write commands
+ */
+int aesd_storage_seekto(struct aesd_storage_handle *handle, uint32_t write_cmd, uint32_t write_cmd_offset, size_t *offset)
+{
+	if (!handle->storage->ops->seekto) {
+		errno = ENOTTY;
+		return -1;
+	}
+	return handle->storage->ops->seekto(handle, write_cmd, write_cmd_offset, offset);
+}
+
+/**
+ * @return readable size, for a log backend every byte below it is written and never changes
+ */
+size_t aesd_storage_size(struct aesd_storage_handle *handle)
+{
+	return handle->storage->ops->size(handle);
+}
+
+/**
+ * @return offset of the first byte still held, 0 unless the backend drops old data
+ */
+size_t aesd_storage_start(struct aesd_storage_handle *handle)
+{
+	return handle->storage->ops->start ? handle->storage->ops->start(handle) : 0;
+}
+
+/**
+ * Find where the last @param lines lines before @param end start, reading backwards from end
+ * in bounded steps. An unterminated last line counts as a line
+ * @param offset receives the offset, the start of the data if there are fewer lines
+ * @return 0 on success, -1 with errno set
+ */
+int aesd_storage_find_lines(struct aesd_storage_handle *handle, size_t lines, size_t end, size_t *offset)
+{
+	char buf[4096];
+	size_t start = aesd_storage_start(handle);
+	size_t pos = end ? end - 1 : 0;		// the last byte ends the last line
+
+	if (!lines) {
+		*offset = end;
+		return 0;
+	}
+	while (pos > start) {
+		size_t len = (pos - start < sizeof(buf)) ? pos - start : sizeof(buf);
+		ssize_t n = 0, part = 0;
+// Short reads are not the end, aesdchar returns one write per read
+		while (n < len && (part = aesd_storage_read(handle, buf + n, len - n, pos - len + n)) > 0)
+			n += part;
+		if (n < len && part == -1)
+			n = -1;
+// Retention dropped where the scan was heading, it ends at the new start
+		if (n == -1 && errno == ENODATA) {
+			start = aesd_storage_start(handle);
+			continue;
+		}
+// The data ended before the window, it shrank under the scan
+		if (n != len) {
+			if (n != -1)
+				errno = EIO;
+			return -1;
+		}
+		for (size_t i = len; i--; ) {
+			if (buf[i] == '\n' && !--lines) {
+				*offset = pos - len + i + 1;
+				return 0;
+			}
+		}
+		pos -= len;
+	}
+	*offset = (start < end) ? start : end;
+	return 0;
+}
+
+/**
+ * Wait until a log backend holds more than @param offset bytes or @param timeout_ms passed,
+ * other backends do not wait
+ * @return readable size
+ */
+size_t aesd_storage_wait(struct aesd_storage_handle *handle, size_t offset, unsigned int timeout_ms)
+{
+	size_t failed = __atomic_load_n(&handle->storage->failed, __ATOMIC_ACQUIRE);
+	size_t end;
+
+	if (!(handle->storage->ops->flags & AESD_STORAGE_LOG))
+		return aesd_storage_size(handle);
+// Nothing is published after a failed append anymore
+	if (offset >= failed) {
+		poll(NULL, 0, timeout_ms);
+		return failed;
+	}
+	end = aesd_append_wait_published(&handle->storage->log, offset, timeout_ms);
+	return (end < failed) ? end : failed;
+}
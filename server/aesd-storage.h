@@ -0,0 +1,145 @@
+/*
+ * aesd-storage.h
+ *
+ *  @brief Storage backends of the data file, selected at run time: stdio, raw descriptor, segment
+ *  files with retention and /dev/aesdchar
+ */
+
+#ifndef AESD_STORAGE_H
+#define AESD_STORAGE_H
+
+#include <stdio.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+#include "aesd-append.h"
+
+#define AESD_STORAGE_EOF ((size_t)-1)	// end of a range that goes up to the end of the data
+
+/**
+ * Backend flags
+ */
+#define AESD_STORAGE_LOG (1 << 0)	// append only file, offsets never change, appends are published in file order
+#define AESD_STORAGE_FILE (1 << 1)	// one descriptor holds every offset from 0, for sendfile() and io_uring
+#define AESD_STORAGE_RETAIN (1 << 2)	// retention drops old data, it starts at aesd_storage_start()
+
+struct aesd_storage;
+struct aesd_storage_handle;
+struct aesd_segment;
+
+/**
+ * Segment backend layout and retention, a limit of 0 is no limit
+ */
+struct aesd_storage_retention
+{
+    size_t segment_bytes;		// data file offsets per segment file
+    size_t max_bytes;			// segments entirely before the last max_bytes are dropped
+    unsigned int max_age_s;		// segments full for longer are dropped
+};
+
+/**
+ * Retained segments of the segment backend, segment i holds the offsets from i * segment_bytes
+ * in the file named after its first offset
+ */
+struct aesd_segment_table
+{
+    /**
+     * Protects the table, segments are reference counted and outlive their removal
+     */
+    pthread_mutex_t lock;
+    struct aesd_segment **segments;	// segments first to first + n - 1
+    size_t first;
+    size_t n;
+    size_t allocated;
+    size_t start;			// first retained offset, read without locking
+    unsigned long checked_s;		// second of the last age check
+};
+
+/**
+ * Called for every append of a log backend in file order, before readers can see it
+ */
+typedef void (*aesd_storage_ordered_fn)(void *ctx, const struct iovec *iov, int iov_n, size_t offset);
+
+struct aesd_storage_ops
+{
+    const char *name;
+    unsigned int flags;
+    int (*open)(struct aesd_storage *storage);
+    void (*close)(struct aesd_storage *storage);
+    int (*attach)(struct aesd_storage *storage, struct aesd_storage_handle *handle);
+    void (*detach)(struct aesd_storage_handle *handle);
+    int (*append)(struct aesd_storage_handle *handle, const struct iovec *iov, int iov_n, size_t *start);
+    ssize_t (*read)(struct aesd_storage_handle *handle, void *buf, size_t len, size_t offset);
+    /**
+     * NULL if the backend has no write commands to seek to
+     */
+    int (*seekto)(struct aesd_storage_handle *handle, uint32_t write_cmd, uint32_t write_cmd_offset, size_t *offset);
+    size_t (*size)(struct aesd_storage_handle *handle);
+    /**
+     * NULL if nothing before the size was dropped
+     */
+    size_t (*start)(struct aesd_storage_handle *handle);
+    int (*sync)(struct aesd_storage *storage);
+    /**
+     * NULL if the data outlives the server
+     */
+    int (*remove)(struct aesd_storage *storage);
+};
+
+struct aesd_storage
+{
+    const struct aesd_storage_ops *ops;
+    const char *path;
+    /**
+     * Descriptor shared by all handles of a log backend, -1 otherwise
+     */
+    int fd;
+    FILE *file;				// stdio backend, on top of fd
+    struct aesd_append log;		// reserved and published ranges of a log backend
+    struct aesd_storage_retention retention;
+    struct aesd_segment_table segments;
+    aesd_storage_ordered_fn ordered;
+    void *ctx;
+    /**
+     * Offset of the first log append that failed to write, AESD_STORAGE_EOF if none. The log
+     * ends there for readers, later appends fail
+     */
+    size_t failed;
+    bool removed;			// files deleted, the ones created after it have no name
+};
+
+/**
+ * View of the storage of one connection
+ */
+struct aesd_storage_handle
+{
+    struct aesd_storage *storage;
+    /**
+     * Readable at any offset, for sendfile() and io_uring, -1 if the data is split across files
+     */
+    int fd;
+};
+
+extern const struct aesd_storage_ops *aesd_storage_find(const char *name);
+
+extern int aesd_storage_open(struct aesd_storage *storage, const struct aesd_storage_ops *ops, const char *path,
+		const struct aesd_storage_retention *retention, aesd_storage_ordered_fn ordered, void *ctx);
+extern void aesd_storage_close(struct aesd_storage *storage);
+extern int aesd_storage_sync(struct aesd_storage *storage);
+extern int aesd_storage_remove(struct aesd_storage *storage);
+
+extern int aesd_storage_attach(struct aesd_storage *storage, struct aesd_storage_handle *handle);
+extern void aesd_storage_detach(struct aesd_storage_handle *handle);
+
+extern int aesd_storage_append(struct aesd_storage_handle *handle, const struct iovec *iov, int iov_n, size_t *start);
+extern ssize_t aesd_storage_read(struct aesd_storage_handle *handle, void *buf, size_t len, size_t offset);
+extern int aesd_storage_seekto(struct aesd_storage_handle *handle, uint32_t write_cmd, uint32_t write_cmd_offset, size_t *offset);
+extern size_t aesd_storage_size(struct aesd_storage_handle *handle);
+extern size_t aesd_storage_start(struct aesd_storage_handle *handle);
+extern int aesd_storage_find_lines(struct aesd_storage_handle *handle, size_t lines, size_t end, size_t *offset);
+extern size_t aesd_storage_wait(struct aesd_storage_handle *handle, size_t offset, unsigned int timeout_ms);
+
+#endif /* AESD_STORAGE_H */
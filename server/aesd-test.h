@@ -0,0 +1,38 @@
+/*
+ * aesd-test.h
+ *
+ *  @brief Checks shared by the test programs run by 'make test'
+ *
+ * A failed check prints its location and the test goes on, aesd_test_result() turns the
+ * failures into the exit status of the test program.
+ */
+
+#ifndef AESD_TEST_H
+#define AESD_TEST_H
+
+#include <stdio.h>
+
+static int aesd_test_failures;
+
+#define AESD_CHECK(cond) do { \
+	if (!(cond)) { \
+		fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); \
+		aesd_test_failures++; \
+	} \
+} while (0)
+
+// Check @param len bytes at @param data against the string @param expected
+#define AESD_CHECK_BYTES(data, len, expected) \
+	AESD_CHECK((data) && (len) == sizeof(expected) - 1 && !memcmp((data), (expected), (len)))
+
+static inline int aesd_test_result(const char *name)
+{
+	if (aesd_test_failures) {
+		fprintf(stderr, "%s: %d checks failed\n", name, aesd_test_failures);
+		return 1;
+	}
+	printf("%s: passed\n", name);
+	return 0;
+}
+
+#endif /* AESD_TEST_H */
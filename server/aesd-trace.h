@@ -0,0 +1,45 @@
+/*
+ * aesd-trace.h
+ *
+ *  @brief USDT probes of the aesdsocket provider, no-ops without <sys/sdt.h> or with AESD_NO_SDT
+ *
+ * A disabled probe is a single nop, its arguments are already in registers or on the stack.
+ * Every probe of a request fires on the thread handling its connection, the first argument
+ * is the client socket. Argument layouts are stable:
+ *
+ *   accept(int fd)				connection set up, before its first recv
+ *   close(int fd)				connection closed, after an error as well
+ *   line(int fd, size_t len, char *line)	line complete, newline included, not NUL terminated,
+ *						or request of the binary protocol
+ *   write_begin(int fd, size_t len)		append of a line or batch of lines
+ *   write_end(int fd, size_t len, int result)	result 0, or -1 if the connection is closed
+ *   send_begin(int fd, size_t offset)		response starting at data offset
+ *   send_end(int fd, int result)		result 0, or -1 if the connection is closed
+ *   ioctl_seek(int fd, int result, size_t offset)	AESDCHAR_IOCSEEKTO done, result 0 or -1,
+ *						the response starts at offset
+ *
+ * e.g. bpftrace -e 'usdt:./aesdsocket:aesdsocket:write_begin { @s[tid] = nsecs; }
+ *	usdt:./aesdsocket:aesdsocket:write_end /@s[tid]/ { @ns = hist(nsecs - @s[tid]); delete(@s[tid]); }'
+ */
+
+#ifndef AESD_TRACE_H
+#define AESD_TRACE_H
+
+#if !defined(AESD_NO_SDT) && defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#include <sys/sdt.h>
+#define AESD_HAVE_SDT 1
+#endif
+#endif
+
+#ifdef AESD_HAVE_SDT
+#define AESD_TRACE1(name, a) DTRACE_PROBE1(aesdsocket, name, a)
+#define AESD_TRACE2(name, a, b) DTRACE_PROBE2(aesdsocket, name, a, b)
+#define AESD_TRACE3(name, a, b, c) DTRACE_PROBE3(aesdsocket, name, a, b, c)
+#else
+#define AESD_TRACE1(name, a) do { } while (0)
+#define AESD_TRACE2(name, a, b) do { } while (0)
+#define AESD_TRACE3(name, a, b, c) do { } while (0)
+#endif
+
+#endif /* AESD_TRACE_H */
@@ -0,0 +1,212 @@
+/**
+ * @file aesd-uring.c
+ * @brief Minimal io_uring wrapper on raw syscalls
+ *
+ * Supports what aesdsocket needs: one registered buffer, a small fixed file table and
+ * batches of (linked) SQEs submitted with a single io_uring_enter().
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include "aesd-uring.h"
+
+static int sys_io_uring_setup(unsigned entries, struct io_uring_params *p)
+{
+	return syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int sys_io_uring_enter(int fd, unsigned to_submit, unsigned min_complete, unsigned flags)
+{
+	return syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, NULL, 0);
+}
+
+static int sys_io_uring_register(int fd, unsigned opcode, const void *arg, unsigned nr_args)
+{
+	return syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+/**
+ * Set up a ring with @param entries SQEs and register a @param buf_size fixed buffer
+ * and an empty fixed file table
+ * @return 0 on success, -1 with errno set if io_uring is not usable
+ */
+int aesd_uring_init(struct aesd_uring *ring, unsigned entries, size_t buf_size)
+{
+	struct io_uring_params p;
+	struct iovec iov;
+	int saved_errno;
+
+	memset(ring, 0, sizeof(*ring));
+	memset(&p, 0, sizeof(p));
+	ring->ring_fd = sys_io_uring_setup(entries, &p);
+	if (ring->ring_fd < 0)
+		return -1;
+
+// Map submission and completion rings and the SQE array
+	ring->sq_ring_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+	ring->cq_ring_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	ring->sq_ring = mmap(NULL, ring->sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->ring_fd, IORING_OFF_SQ_RING);
+	if (ring->sq_ring == MAP_FAILED)
+		goto error_sq_mmap;
+	ring->cq_ring = mmap(NULL, ring->cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->ring_fd, IORING_OFF_CQ_RING);
+	if (ring->cq_ring == MAP_FAILED)
+		goto error_cq_mmap;
+	ring->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+	ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->ring_fd, IORING_OFF_SQES);
+	if (ring->sqes == MAP_FAILED)
+		goto error_sqes_mmap;
+
+	ring->sq_head = (unsigned *)((char *)ring->sq_ring + p.sq_off.head);
+	ring->sq_tail = (unsigned *)((char *)ring->sq_ring + p.sq_off.tail);
+	ring->sq_mask = (unsigned *)((char *)ring->sq_ring + p.sq_off.ring_mask);
+	ring->sq_array = (unsigned *)((char *)ring->sq_ring + p.sq_off.array);
+	ring->sq_entries = p.sq_entries;
+	ring->cq_head = (unsigned *)((char *)ring->cq_ring + p.cq_off.head);
+	ring->cq_tail = (unsigned *)((char *)ring->cq_ring + p.cq_off.tail);
+	ring->cq_mask = (unsigned *)((char *)ring->cq_ring + p.cq_off.ring_mask);
+	ring->cqes = (struct io_uring_cqe *)((char *)ring->cq_ring + p.cq_off.cqes);
+
+// Register the buffer used by READ_FIXED
+	if (!(ring->buf = malloc(buf_size)))
+		goto error_buf_malloc;
+	ring->buf_size = buf_size;
+	iov.iov_base = ring->buf;
+	iov.iov_len = buf_size;
+	if (sys_io_uring_register(ring->ring_fd, IORING_REGISTER_BUFFERS, &iov, 1) < 0)
+		goto error_register;
+
+// Register an empty file table, slots are filled by aesd_uring_set_files()
+	for (int i = 0; i < AESD_URING_FILES; i++)
+		ring->files[i] = -1;
+	if (sys_io_uring_register(ring->ring_fd, IORING_REGISTER_FILES, ring->files, AESD_URING_FILES) < 0)
+		goto error_register;
+	return 0;
+
+error_register:
+	saved_errno = errno;
+	free(ring->buf);
+	errno = saved_errno;
+error_buf_malloc:
+	munmap(ring->sqes, ring->sqes_size);
+error_sqes_mmap:
+	munmap(ring->cq_ring, ring->cq_ring_size);
+error_cq_mmap:
+	munmap(ring->sq_ring, ring->sq_ring_size);
+error_sq_mmap:
+	saved_errno = errno;
+	close(ring->ring_fd);
+	errno = saved_errno;
+	ring->ring_fd = -1;
+	return -1;
+}
+
+/**
+ * Tear down the ring, registered resources are released with the ring descriptor
+ */
+void aesd_uring_exit(struct aesd_uring *ring)
+{
+	if (ring->ring_fd < 0)
+		return;
+	munmap(ring->sqes, ring->sqes_size);
+	munmap(ring->cq_ring, ring->cq_ring_size);
+	munmap(ring->sq_ring, ring->sq_ring_size);
+	close(ring->ring_fd);
+	free(ring->buf);
+	ring->ring_fd = -1;
+}
+
+/**
+ * Point the fixed file slots at @param fds, only updates the kernel table when they changed
+ * @return 0 on success, -1 on failure
+ */
+int aesd_uring_set_files(struct aesd_uring *ring, const int *fds)
+{
+	struct io_uring_files_update update;
+
+	if (!memcmp(ring->files, fds, sizeof(ring->files)))
+		return 0;
+	memset(&update, 0, sizeof(update));
+	update.offset = 0;
+	update.fds = (__u64)(unsigned long)fds;
+	if (sys_io_uring_register(ring->ring_fd, IORING_REGISTER_FILES_UPDATE, &update, AESD_URING_FILES) < 0)
+		return -1;
+	memcpy(ring->files, fds, sizeof(ring->files));
+	return 0;
+}
+
+/**
+ * Get next free SQE, user_data is set to its index in the current batch
+ * @return SQE or NULL if the submission queue is full
+ */
+struct io_uring_sqe *aesd_uring_get_sqe(struct aesd_uring *ring)
+{
+	unsigned tail = *ring->sq_tail + ring->queued;
+	unsigned head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+	struct io_uring_sqe *sqe;
+
+	if (tail - head >= ring->sq_entries)
+		return NULL;
+	sqe = &ring->sqes[tail & *ring->sq_mask];
+	memset(sqe, 0, sizeof(*sqe));
+	sqe->user_data = ring->queued;
+	ring->sq_array[tail & *ring->sq_mask] = tail & *ring->sq_mask;
+	ring->queued++;
+	return sqe;
+}
+
+/**
+ * Fill in a read/write/send style request
+ */
+void aesd_uring_prep(struct io_uring_sqe *sqe, int op, int fd, const void *addr, unsigned len, __u64 off)
+{
+	sqe->opcode = op;
+	sqe->fd = fd;
+	sqe->addr = (__u64)(unsigned long)addr;
+	sqe->len = len;
+	sqe->off = off;
+}
+
+/**
+ * Submit the queued batch and wait for all of its completions
+ * @param results receives the result of each SQE, indexed by its position in the batch
+ * @return 0 on success, -1 with errno set if io_uring_enter() failed
+ */
+int aesd_uring_submit_and_wait(struct aesd_uring *ring, int *results)
+{
+	unsigned submitted = ring->queued;
+	unsigned to_submit = ring->queued;
+	unsigned completed = 0;
+	int ret;
+
+	__atomic_store_n(ring->sq_tail, *ring->sq_tail + ring->queued, __ATOMIC_RELEASE);
+	ring->queued = 0;
+
+	while (completed < submitted) {
+		unsigned head = *ring->cq_head;
+		unsigned tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+
+		for (; head != tail; head++, completed++) {
+			struct io_uring_cqe *cqe = &ring->cqes[head & *ring->cq_mask];
+			if (cqe->user_data < submitted)
+				results[cqe->user_data] = cqe->res;
+		}
+		__atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+		if (completed == submitted)
+			break;
+
+// First pass submits, later passes only wait for the rest
+		ret = sys_io_uring_enter(ring->ring_fd, to_submit, submitted - completed, IORING_ENTER_GETEVENTS);
+		if (ret < 0) {
+			if (errno != EINTR)
+				return -1;
+			continue;
+		}
+		to_submit -= (ret < to_submit) ? ret : to_submit;
+	}
+	return 0;
+}
@@ -0,0 +1,68 @@
+/*
+ * aesd-uring.h
+ *
+ *  @brief Minimal io_uring wrapper on raw syscalls, liburing is not available on the target
+ */
+
+#ifndef AESD_URING_H
+#define AESD_URING_H
+
+#include <stddef.h>
+#include <linux/io_uring.h>
+
+#define AESD_URING_FILES 2
+
+struct aesd_uring
+{
+    /**
+     * Ring file descriptor returned by io_uring_setup()
+     */
+    int ring_fd;
+    /**
+     * Submission queue ring, indexes into sqes
+     */
+    unsigned *sq_head;
+    unsigned *sq_tail;
+    unsigned *sq_mask;
+    unsigned *sq_array;
+    unsigned sq_entries;
+    struct io_uring_sqe *sqes;
+    /**
+     * Completion queue ring
+     */
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned *cq_mask;
+    struct io_uring_cqe *cqes;
+    /**
+     * Mappings, released by aesd_uring_exit()
+     */
+    void *sq_ring;
+    size_t sq_ring_size;
+    void *cq_ring;
+    size_t cq_ring_size;
+    size_t sqes_size;
+    /**
+     * SQEs prepared but not submitted yet
+     */
+    unsigned queued;
+    /**
+     * Buffer registered as fixed buffer 0
+     */
+    char *buf;
+    size_t buf_size;
+    /**
+     * Descriptors currently registered as fixed files, -1 if slot is empty
+     */
+    int files[AESD_URING_FILES];
+};
+
+extern int aesd_uring_init(struct aesd_uring *ring, unsigned entries, size_t buf_size);
+extern void aesd_uring_exit(struct aesd_uring *ring);
+
+extern int aesd_uring_set_files(struct aesd_uring *ring, const int *fds);
+extern struct io_uring_sqe *aesd_uring_get_sqe(struct aesd_uring *ring);
+extern void aesd_uring_prep(struct io_uring_sqe *sqe, int op, int fd, const void *addr, unsigned len, __u64 off);
+extern int aesd_uring_submit_and_wait(struct aesd_uring *ring, int *results);
+
+#endif /* AESD_URING_H */
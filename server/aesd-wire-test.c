@@ -0,0 +1,55 @@
+/**
+ * @file aesd-wire-test.c
+ * @brief Tests of the binary protocol frame header: its size and layout as sent, and decoding
+ * what was encoded from any alignment
+ */
+
+#include <stddef.h>
+#include <string.h>
+#include "aesd-wire.h"
+#include "aesd-test.h"
+
+// The header is sent as it is in memory, its layout is the protocol
+static void test_layout(void)
+{
+	static const unsigned char expected[] = {
+		AESD_WIRE_RESPONSE, 0, 0, 0, 0, 0, 0, 0,
+		0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07, 0x08,
+	};
+	struct aesd_wire_header header;
+
+	AESD_CHECK(sizeof(header) == 16);
+	AESD_CHECK(offsetof(struct aesd_wire_header, length) == 8);
+	AESD_CHECK(sizeof(AESD_WIRE_PREAMBLE) - 1 == AESD_WIRE_PREAMBLE_SIZE);
+	memset(&header, 0xff, sizeof(header));
+	aesd_wire_encode(&header, AESD_WIRE_RESPONSE, 0x0102030405060708ULL);
+	AESD_CHECK(!memcmp(&header, expected, sizeof(expected)));
+}
+
+static void test_round_trip(void)
+{
+	static const uint64_t lengths[] = { 0, 1, '\n', 255, 256, AESD_WIRE_MAX_REQUEST, AESD_WIRE_MAX_REQUEST + 1, UINT64_MAX };
+	unsigned char buf[sizeof(struct aesd_wire_header) + 8];
+
+	for (int i = 0; i < sizeof(lengths) / sizeof(lengths[0]); i++) {
+		for (int type = AESD_WIRE_REQUEST; type <= AESD_WIRE_RESPONSE; type++) {
+			for (int misalign = 0; misalign < 8; misalign++) {
+				struct aesd_wire_header header;
+				uint64_t length = 0;
+				uint8_t decoded_type = 0;
+				aesd_wire_encode(&header, type, lengths[i]);
+				memcpy(buf + misalign, &header, sizeof(header));
+				aesd_wire_decode(buf + misalign, &decoded_type, &length);
+				AESD_CHECK(decoded_type == type);
+				AESD_CHECK(length == lengths[i]);
+			}
+		}
+	}
+}
+
+int main(void)
+{
+	test_layout();
+	test_round_trip();
+	return aesd_test_result("aesd-wire-test");
+}
@@ -0,0 +1,58 @@
+/*
+ * aesd-wire.h
+ *
+ *  @brief Length prefixed binary protocol of aesdsocket, negotiated with a preamble on connect
+ *
+ * A client which starts with the AESD_WIRE_PREAMBLE_SIZE bytes of AESD_WIRE_PREAMBLE speaks
+ * frames for the rest of the connection, others the newline terminated text protocol. A frame
+ * is a header and length bytes of payload. The payload of an AESD_WIRE_REQUEST is handled like
+ * a line of the text protocol, commands included, and is not searched for a newline, so it
+ * must end with one like a line does, others close the connection. Each request is answered with exactly one AESD_WIRE_RESPONSE
+ * holding what the text protocol would send, possibly nothing. Failures close the connection.
+ */
+
+#ifndef AESD_WIRE_H
+#define AESD_WIRE_H
+
+#include <stdint.h>
+#include <string.h>
+#include <endian.h>
+
+#define AESD_WIRE_PREAMBLE "\0AESDBIN"
+#define AESD_WIRE_PREAMBLE_SIZE (8)
+#define AESD_WIRE_MAX_REQUEST (16*1024*1024)	// larger requests close the connection
+
+/**
+ * Frame types
+ */
+#define AESD_WIRE_REQUEST (1)
+#define AESD_WIRE_RESPONSE (2)
+
+/**
+ * Frame header as sent, length in network byte order
+ */
+struct aesd_wire_header
+{
+    uint8_t type;
+    uint8_t reserved[7];		// zero
+    uint64_t length;			// payload bytes following the header
+};
+
+static inline void aesd_wire_encode(struct aesd_wire_header *header, uint8_t type, uint64_t length)
+{
+	memset(header, 0, sizeof(*header));
+	header->type = type;
+	header->length = htobe64(length);
+}
+
+// Decode a header from received bytes, which need not be aligned
+static inline void aesd_wire_decode(const void *buf, uint8_t *type, uint64_t *length)
+{
+	struct aesd_wire_header header;
+
+	memcpy(&header, buf, sizeof(header));
+	*type = header.type;
+	*length = be64toh(header.length);
+}
+
+#endif /* AESD_WIRE_H */
@@ -0,0 +1,100 @@
+/**
+ * @file aesd-work-queue.c
+ * @brief Per worker task queue with stealing
+ *
+ * The owner takes tasks in FIFO order, so a connection that is always ready cannot
+ * starve the others queued behind it. Idle workers steal from the opposite end.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include "aesd-work-queue.h"
+
+/**
+ * Initialize an empty queue
+ * @return 0 on success, -1 if memory could not be allocated
+ */
+int aesd_work_queue_init(struct aesd_work_queue *queue)
+{
+	memset(queue, 0, sizeof(*queue));
+	queue->tasks = malloc(AESD_WORK_QUEUE_INITIAL_CAPACITY * sizeof(void *));
+	if (!queue->tasks)
+		return -1;
+	queue->capacity = AESD_WORK_QUEUE_INITIAL_CAPACITY;
+	pthread_mutex_init(&queue->lock, NULL);
+	return 0;
+}
+
+/**
+ * Free queue memory, queued tasks are not touched
+ */
+void aesd_work_queue_destroy(struct aesd_work_queue *queue)
+{
+	free(queue->tasks);
+	queue->tasks = NULL;
+	queue->capacity = queue->count = queue->head = 0;
+	pthread_mutex_destroy(&queue->lock);
+}
+
+/**
+ * Add a task at the tail, the ring buffer is doubled when full
+ * @return 0 on success, -1 if memory could not be allocated
+ */
+int aesd_work_queue_push(struct aesd_work_queue *queue, void *task)
+{
+	pthread_mutex_lock(&queue->lock);
+	if (queue->count == queue->capacity) {
+		size_t capacity = queue->capacity * 2;
+		void **tasks = malloc(capacity * sizeof(void *));
+		if (!tasks) {
+			pthread_mutex_unlock(&queue->lock);
+			return -1;
+		}
+// Unwrap the ring into the new buffer
+		for (size_t i = 0; i < queue->count; i++)
+			tasks[i] = queue->tasks[(queue->head + i) % queue->capacity];
+		free(queue->tasks);
+		queue->tasks = tasks;
+		queue->capacity = capacity;
+		queue->head = 0;
+	}
+	queue->tasks[(queue->head + queue->count) % queue->capacity] = task;
+	queue->count++;
+	pthread_mutex_unlock(&queue->lock);
+	return 0;
+}
+
+/**
+ * Take the oldest task, called by the owning worker
+ * @return task or NULL if the queue is empty
+ */
+void *aesd_work_queue_pop(struct aesd_work_queue *queue)
+{
+	void *task = NULL;
+
+	pthread_mutex_lock(&queue->lock);
+	if (queue->count) {
+		task = queue->tasks[queue->head];
+		queue->head = (queue->head + 1) % queue->capacity;
+		queue->count--;
+	}
+	pthread_mutex_unlock(&queue->lock);
+	return task;
+}
+
+/**
+ * Take the newest task, called by other workers when their own queue is empty
+ * @return task or NULL if the queue is empty
+ */
+void *aesd_work_queue_steal(struct aesd_work_queue *queue)
+{
+	void *task = NULL;
+
+	pthread_mutex_lock(&queue->lock);
+	if (queue->count) {
+		queue->count--;
+		task = queue->tasks[(queue->head + queue->count) % queue->capacity];
+	}
+	pthread_mutex_unlock(&queue->lock);
+	return task;
+}
@@ -0,0 +1,43 @@
+/*
+ * aesd-work-queue.h
+ *
+ *  @brief Per worker task queue with stealing, used by the aesdsocket worker pool
+ */
+
+#ifndef AESD_WORK_QUEUE_H
+#define AESD_WORK_QUEUE_H
+
+#include <stddef.h>
+#include <pthread.h>
+
+#define AESD_WORK_QUEUE_INITIAL_CAPACITY 64
+
+struct aesd_work_queue
+{
+    /**
+     * Protects the ring buffer, taken by the owner and by stealing workers
+     */
+    pthread_mutex_t lock;
+    /**
+     * Ring buffer of queued tasks, grows when full
+     */
+    void **tasks;
+    size_t capacity;
+    /**
+     * Index of the oldest task, the owner takes tasks from here
+     */
+    size_t head;
+    /**
+     * Number of queued tasks, thieves take the newest one at head + count - 1
+     */
+    size_t count;
+};
+
+extern int aesd_work_queue_init(struct aesd_work_queue *queue);
+extern void aesd_work_queue_destroy(struct aesd_work_queue *queue);
+
+extern int aesd_work_queue_push(struct aesd_work_queue *queue, void *task);
+extern void *aesd_work_queue_pop(struct aesd_work_queue *queue);
+extern void *aesd_work_queue_steal(struct aesd_work_queue *queue);
+
+#endif /* AESD_WORK_QUEUE_H */
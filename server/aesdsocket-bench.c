@@ -0,0 +1,482 @@
+/**
+ * @file aesdsocket-bench.c
+ * @brief Load generator for aesdsocket
+ *
+ * Opens connections to the server, one thread each, and sends newline terminated lines of
+ * a fixed or uniformly distributed size, either as fast as replies come back or at a target
+ * rate per connection, optionally interleaving AESDCHAR_IOCSEEKTO commands. Every line
+ * carries a unique token, its latency ends when the reply holding it has been received.
+ * With a target rate latency starts at the scheduled send time, so a server that falls
+ * behind is not hidden by the client waiting for it.
+ *
+ * Tokens hold a run id, lines of earlier runs left in the data file never match.
+ * Connections switch to tail mode unless -a is given, so replies stay the size of the new
+ * data instead of the whole data file, and wait for a start line before the clock starts.
+ * On the aesdchar backend, which has no tail mode, a line is found only while it is among
+ * the writes the device keeps.
+ *
+ * With -U the connections go to the UNIX socket of the server instead of host and port.
+ *
+ * Prints CSV: one row for lines and, with -k, one for seek commands. The throughput
+ * columns cover all traffic of the run.
+ * Usage: aesdsocket-bench [-h host] [-p port] [-U unix_path] [-c connections] [-d seconds] [-n lines]
+ *                         [-r lines_per_s] [-s bytes|min-max] [-k seek_every] [-a] [-L label] [-q]
+ */
+
+#define _GNU_SOURCE
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <netdb.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#define RECV_BUF_SIZE (64 * 1024)
+#define REPLY_TIMEOUT_S 5
+#define SEEK_COMMAND "AESDCHAR_IOCSEEKTO:0,0\n"
+#define TAIL_COMMAND "AESDSOCKET_TAIL:1\n"
+
+enum bench_op {
+	OP_LINE,		// data line
+	OP_SEEK,		// AESDCHAR_IOCSEEKTO followed by a data line
+	OPS,
+};
+
+static const char *op_names[OPS] = {
+	[OP_LINE] = "line",
+	[OP_SEEK] = "seek",
+};
+
+struct latencies {
+	unsigned long long *ns;
+	size_t n;
+	size_t allocated;
+};
+
+struct bench_thread {
+	pthread_t thread;
+	int id;
+	int socket;
+	unsigned int seed;
+// Reply stream, scanned for the token of the line in flight
+	char recv_buf[RECV_BUF_SIZE];
+	size_t recv_pos;
+	size_t recv_len;
+	long match_pos;			// bytes of the current reply line matching the expected one, -1 on mismatch
+	struct latencies latencies[OPS];
+	unsigned long long tx_bytes;
+	unsigned long long rx_bytes;
+	unsigned long errors;
+};
+
+static struct {
+	const char *host;
+	const char *port;
+	const char *unix_path;
+	int connections;
+	unsigned int seconds;
+	unsigned long lines;
+	unsigned long rate;
+	const char *size_spec;
+	size_t size_min;
+	size_t size_max;
+	unsigned long seek_every;
+	bool whole_file;
+	const char *label;
+	bool header;
+} config = {
+	.host = "localhost",
+	.port = "9000",
+	.connections = 4,
+	.seconds = 5,
+	.size_spec = "64",
+	.size_min = 64,
+	.size_max = 64,
+	.label = "",
+	.header = true,
+};
+
+static pthread_barrier_t start_barrier;
+static unsigned long long start_ns;
+static unsigned long run_id;
+
+static unsigned long long now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void sleep_until_ns(unsigned long long ns)
+{
+	struct timespec ts = { .tv_sec = ns / 1000000000ULL, .tv_nsec = ns % 1000000000ULL };
+
+	while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR)
+		;
+}
+
+static int latencies_add(struct latencies *l, unsigned long long ns)
+{
+	if (l->n == l->allocated) {
+		size_t allocated = l->allocated ? l->allocated * 2 : 4096;
+		unsigned long long *new_ns = realloc(l->ns, allocated * sizeof(*new_ns));
+		if (!new_ns)
+			return -1;
+		l->ns = new_ns;
+		l->allocated = allocated;
+	}
+	l->ns[l->n++] = ns;
+	return 0;
+}
+
+static int compare_ns(const void *a, const void *b)
+{
+	unsigned long long x = *(const unsigned long long *)a, y = *(const unsigned long long *)b;
+
+	return (x > y) - (x < y);
+}
+
+// Nearest rank percentile of sorted latencies, in microseconds
+static double percentile_us(const struct latencies *l, double p)
+{
+	size_t rank;
+
+	if (!l->n)
+		return 0;
+	rank = (size_t)(p / 100.0 * l->n + 0.999999);
+	if (rank < 1)
+		rank = 1;
+	if (rank > l->n)
+		rank = l->n;
+	return l->ns[rank - 1] / 1000.0;
+}
+
+static int send_all(int socket, const char *buf, size_t len)
+{
+	while (len) {
+		ssize_t sent = send(socket, buf, len, MSG_NOSIGNAL);
+		if (sent == -1) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		buf += sent;
+		len -= sent;
+	}
+	return 0;
+}
+
+/**
+ * Receive until a reply line equals @param line of @param len bytes, newline included.
+ * Bytes after it stay buffered, they are the rest of the reply or of later ones
+ * @return 0 when found, -1 on error, timeout or end of stream
+ */
+static int wait_for_line(struct bench_thread *t, const char *line, size_t len)
+{
+	while (1) {
+		while (t->recv_pos < t->recv_len) {
+			char c = t->recv_buf[t->recv_pos++];
+			if (t->match_pos >= 0)
+				t->match_pos = ((size_t)t->match_pos < len && c == line[t->match_pos]) ? t->match_pos + 1 : -1;
+			if (c == '\n') {
+				bool found = ((size_t)t->match_pos == len);
+				t->match_pos = 0;
+				if (found)
+					return 0;
+			}
+		}
+		ssize_t n = recv(t->socket, t->recv_buf, sizeof(t->recv_buf), 0);
+		if (n <= 0) {
+			if (n == -1 && errno == EINTR)
+				continue;
+			if (n == 0)
+				errno = ECONNRESET;
+			return -1;
+		}
+		t->rx_bytes += n;
+		t->recv_pos = 0;
+		t->recv_len = n;
+	}
+}
+
+// Line of size_min..size_max bytes starting with a token unique to connection and sequence number
+static size_t make_line(struct bench_thread *t, unsigned long seq, char *line)
+{
+	size_t len = config.size_min;
+	int token_len;
+
+	if (config.size_max > config.size_min)
+		len += rand_r(&t->seed) % (config.size_max - config.size_min + 1);
+	token_len = sprintf(line, "bench %lx.%d %lu ", run_id, t->id, seq);
+	if (len < (size_t)token_len + 1)
+		len = token_len + 1;
+	for (size_t i = token_len; i < len - 1; i++)
+		line[i] = 'a' + (seq + i) % 26;
+	line[len - 1] = '\n';
+	return len;
+}
+
+static void *bench_thread(void *arg)
+{
+	struct bench_thread *t = arg;
+	size_t line_size = (config.size_max > 64) ? config.size_max + 1 : 65;
+	char *line = malloc(line_size);
+	unsigned long long end_ns, scheduled_ns;
+	bool failed = !line;
+	int start_len;
+
+// The reply to the tail command is the whole data file, take it before the clock starts
+	if (!failed && !config.whole_file) {
+		start_len = sprintf(line, "bench %lx.%d start\n", run_id, t->id);
+		if (send_all(t->socket, TAIL_COMMAND, sizeof(TAIL_COMMAND) - 1) == -1
+				|| send_all(t->socket, line, start_len) == -1 || wait_for_line(t, line, start_len) == -1) {
+			fprintf(stderr, "connection %d: %s\n", t->id, strerror(errno));
+			t->errors++;
+			failed = true;
+		}
+		t->rx_bytes = 0;
+	}
+// Once all connections are ready main sets start_ns
+	pthread_barrier_wait(&start_barrier);
+	pthread_barrier_wait(&start_barrier);
+	if (failed)
+		goto exit;
+	end_ns = start_ns + config.seconds * 1000000000ULL;
+	scheduled_ns = start_ns;
+	for (unsigned long seq = 0; !config.lines || seq < config.lines; seq++) {
+		enum bench_op op = (config.seek_every && seq % config.seek_every == config.seek_every - 1) ? OP_SEEK : OP_LINE;
+		unsigned long long sent_ns;
+		size_t len;
+
+		if (config.rate) {
+			scheduled_ns = start_ns + seq * 1000000000ULL / config.rate;
+			if (scheduled_ns >= end_ns)
+				break;
+			sleep_until_ns(scheduled_ns);
+		}
+		sent_ns = now_ns();
+		if (sent_ns >= end_ns)
+			break;
+		len = make_line(t, seq, line);
+// The seek and the line are sent together, the line's reply comes after the seek's
+		if ((op == OP_SEEK && send_all(t->socket, SEEK_COMMAND, sizeof(SEEK_COMMAND) - 1) == -1)
+				|| send_all(t->socket, line, len) == -1
+				|| wait_for_line(t, line, len) == -1) {
+			fprintf(stderr, "connection %d: %s\n", t->id, strerror(errno));
+			t->errors++;
+			break;
+		}
+		t->tx_bytes += len + (op == OP_SEEK ? sizeof(SEEK_COMMAND) - 1 : 0);
+		if (latencies_add(&t->latencies[op], now_ns() - (config.rate ? scheduled_ns : sent_ns)) == -1) {
+			t->errors++;
+			break;
+		}
+	}
+exit:
+	free(line);
+	shutdown(t->socket, SHUT_WR);
+	return NULL;
+}
+
+static int bench_connect_unix(void)
+{
+	struct sockaddr_un addr = { .sun_family = AF_UNIX };
+	int fd;
+
+	if (strlen(config.unix_path) >= sizeof(addr.sun_path)) {
+		fprintf(stderr, "Path too long: %s\n", config.unix_path);
+		return -1;
+	}
+	strcpy(addr.sun_path, config.unix_path);
+	if ((fd = socket(AF_UNIX, SOCK_STREAM, 0)) == -1 || connect(fd, (struct sockaddr *)&addr, sizeof(addr)) == -1) {
+		fprintf(stderr, "Cannot connect to %s: %s\n", config.unix_path, strerror(errno));
+		if (fd != -1)
+			close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+static int bench_connect(void)
+{
+	struct addrinfo hints = { .ai_family = AF_UNSPEC, .ai_socktype = SOCK_STREAM }, *servinfo, *p;
+	struct timeval timeout = { .tv_sec = REPLY_TIMEOUT_S };
+	int rv, fd = -1;
+
+	if (config.unix_path) {
+		if ((fd = bench_connect_unix()) != -1)
+			setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+		return fd;
+	}
+	if ((rv = getaddrinfo(config.host, config.port, &hints, &servinfo)) != 0) {
+		fprintf(stderr, "getaddrinfo: %s\n", gai_strerror(rv));
+		return -1;
+	}
+	for (p = servinfo; p; p = p->ai_next) {
+		if ((fd = socket(p->ai_family, p->ai_socktype, p->ai_protocol)) == -1)
+			continue;
+		if (connect(fd, p->ai_addr, p->ai_addrlen) == 0)
+			break;
+		close(fd);
+		fd = -1;
+	}
+	freeaddrinfo(servinfo);
+	if (fd == -1) {
+		fprintf(stderr, "Cannot connect to %s:%s: %s\n", config.host, config.port, strerror(errno));
+		return -1;
+	}
+	setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+	return fd;
+}
+
+static int parse_size(const char *spec)
+{
+	char *end;
+
+	config.size_min = config.size_max = strtoul(spec, &end, 10);
+	if (*end == '-')
+		config.size_max = strtoul(end + 1, &end, 10);
+	if (*end || !config.size_min || config.size_max < config.size_min)
+		return -1;
+	config.size_spec = spec;
+	return 0;
+}
+
+static void usage(const char *name)
+{
+	fprintf(stderr, "Usage: %s [-h host] [-p port] [-U unix_path] [-c connections] [-d seconds] [-n lines] "
+			"[-r lines_per_s] [-s bytes|min-max] [-k seek_every] [-a] [-L label] [-q]\n", name);
+}
+
+int main(int argc, char *argv[])
+{
+	struct bench_thread *threads;
+	struct latencies all[OPS] = {0};
+	unsigned long long tx_bytes = 0, rx_bytes = 0;
+	unsigned long errors = 0;
+	double elapsed;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "ac:d:h:k:L:n:p:qr:s:U:")) != -1) {
+		switch (opt) {
+		case 'a':
+			config.whole_file = true;
+			break;
+		case 'c':
+			config.connections = atoi(optarg);
+			break;
+		case 'd':
+			config.seconds = strtoul(optarg, NULL, 10);
+			break;
+		case 'h':
+			config.host = optarg;
+			break;
+		case 'k':
+			config.seek_every = strtoul(optarg, NULL, 10);
+			break;
+		case 'L':
+			config.label = optarg;
+			break;
+		case 'n':
+			config.lines = strtoul(optarg, NULL, 10);
+			break;
+		case 'p':
+			config.port = optarg;
+			break;
+		case 'q':
+			config.header = false;
+			break;
+		case 'r':
+			config.rate = strtoul(optarg, NULL, 10);
+			break;
+		case 'U':
+			config.unix_path = optarg;
+			break;
+		case 's':
+			if (parse_size(optarg) == -1) {
+				fprintf(stderr, "Invalid size '%s'\n", optarg);
+				return 1;
+			}
+			break;
+		default:
+			usage(argv[0]);
+			return 1;
+		}
+	}
+	if (config.connections < 1 || !config.seconds) {
+		usage(argv[0]);
+		return 1;
+	}
+
+	run_id = (getpid() << 20) ^ (now_ns() & 0xfffff);
+	if (!(threads = calloc(config.connections, sizeof(struct bench_thread)))) {
+		perror("calloc");
+		return 1;
+	}
+	for (int i = 0; i < config.connections; i++) {
+		struct bench_thread *t = &threads[i];
+		t->id = i;
+		t->seed = i + 1;
+		if ((t->socket = bench_connect()) == -1)
+			return 1;
+	}
+
+	pthread_barrier_init(&start_barrier, NULL, config.connections + 1);
+	for (int i = 0; i < config.connections; i++) {
+		if ((errno = pthread_create(&threads[i].thread, NULL, bench_thread, &threads[i]))) {
+			perror("pthread_create");
+			return 1;
+		}
+	}
+	pthread_barrier_wait(&start_barrier);
+	start_ns = now_ns();
+	pthread_barrier_wait(&start_barrier);
+	for (int i = 0; i < config.connections; i++)
+		pthread_join(threads[i].thread, NULL);
+	elapsed = (now_ns() - start_ns) / 1e9;
+	pthread_barrier_destroy(&start_barrier);
+
+	for (int i = 0; i < config.connections; i++) {
+		struct bench_thread *t = &threads[i];
+		for (int op = 0; op < OPS; op++) {
+			for (size_t j = 0; j < t->latencies[op].n; j++) {
+				if (latencies_add(&all[op], t->latencies[op].ns[j]) == -1) {
+					perror("realloc");
+					return 1;
+				}
+			}
+			free(t->latencies[op].ns);
+		}
+		tx_bytes += t->tx_bytes;
+		rx_bytes += t->rx_bytes;
+		errors += t->errors;
+		close(t->socket);
+	}
+	free(threads);
+
+	if (config.header)
+		printf("label,op,connections,line_bytes,rate,seek_every,tail,seconds,ops,errors,ops_per_s,"
+				"tx_mb_s,rx_mb_s,p50_us,p90_us,p99_us,p999_us,max_us\n");
+	for (int op = 0; op < OPS; op++) {
+		struct latencies *l = &all[op];
+		if (op == OP_SEEK && !config.seek_every)
+			continue;
+		qsort(l->ns, l->n, sizeof(*l->ns), compare_ns);
+		printf("%s,%s,%d,%s,%lu,%lu,%d,%.2f,%zu,%lu,%.1f,%.2f,%.2f,%.1f,%.1f,%.1f,%.1f,%.1f\n",
+				config.label, op_names[op], config.connections, config.size_spec, config.rate,
+				config.seek_every, !config.whole_file, elapsed, l->n, errors, l->n / elapsed,
+				tx_bytes / elapsed / (1024 * 1024), rx_bytes / elapsed / (1024 * 1024),
+				percentile_us(l, 50), percentile_us(l, 90), percentile_us(l, 99), percentile_us(l, 99.9),
+				l->n ? l->ns[l->n - 1] / 1000.0 : 0);
+		free(l->ns);
+	}
+	return errors ? 2 : 0;
+}
@@ -0,0 +1,296 @@
+/**
+ * @file aesdsocket-test.c
+ * @brief Tests of the commands of a running aesdsocket: AESDSOCKET_RANGE, AESDSOCKET_LAST and
+ * AESDSOCKET_STATS, malformed commands stored as data and a command in a binary frame
+ *
+ * Starts the server with a data file in a temporary directory, once per mode and backend, and
+ * talks to it through its UNIX socket. Every request is a connection of its own which sends
+ * its lines, shuts down its side and reads the response up to the end of the connection.
+ * Usage: aesdsocket-test [aesdsocket]
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <limits.h>
+#include <signal.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include "aesd-wire.h"
+#include "aesd-test.h"
+
+#define RESPONSE_MAX (64*1024)
+#define START_TIMEOUT_MS (5000)
+
+static const char *server = "./aesdsocket";
+static char dir[] = "/tmp/aesdsocket-test.XXXXXX";
+static char data_path[PATH_MAX];
+static char socket_path[sizeof(((struct sockaddr_un *)0)->sun_path)];
+static char response[RESPONSE_MAX];
+
+static int connect_server(void)
+{
+	struct sockaddr_un addr = { .sun_family = AF_UNIX };
+	int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+
+	if (fd == -1)
+		return -1;
+	strncpy(addr.sun_path, socket_path, sizeof(addr.sun_path) - 1);
+	if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) == -1) {
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+/**
+ * Send @param len bytes of @param request on a new connection and read the response into
+ * response until the server closes the connection
+ * @return response length, -1 on failure
+ */
+static ssize_t request_bytes(const char *request, size_t len)
+{
+	size_t done = 0;
+	ssize_t n = 0;
+	int fd = connect_server();
+
+	if (fd == -1)
+		return -1;
+	while (done < len && (n = send(fd, request + done, len - done, MSG_NOSIGNAL)) > 0)
+		done += n;
+	if (done < len || shutdown(fd, SHUT_WR) == -1) {
+		close(fd);
+		return -1;
+	}
+	done = 0;
+	while (done < sizeof(response) && (n = recv(fd, response + done, sizeof(response) - done, 0)) > 0)
+		done += n;
+	close(fd);
+	return (n == -1 || done == sizeof(response)) ? -1 : done;
+}
+
+static ssize_t request(const char *request)
+{
+	return request_bytes(request, strlen(request));
+}
+
+// Check that the response to @param req is the string @param expected
+#define CHECK_RESPONSE(req, expected) do { \
+	ssize_t len = request(req); \
+	AESD_CHECK(len == sizeof(expected) - 1 && !memcmp(response, expected, len)); \
+} while (0)
+
+/**
+ * Start the server with @param args after the data file and socket options, and wait until it
+ * accepts connections
+ * @return pid of the server, -1 if it did not start
+ */
+static pid_t start_server(char *const args[])
+{
+	char *argv[32] = { (char *)server, "-p", "0", "-U", socket_path, "-D", data_path };
+	int argc = 7;
+	pid_t pid;
+
+	while (*args && argc < sizeof(argv) / sizeof(argv[0]) - 1)
+		argv[argc++] = *args++;
+	argv[argc] = NULL;
+	unlink(socket_path);
+	if ((pid = fork()) == -1)
+		return -1;
+	if (pid == 0) {
+		execv(server, argv);
+		perror(server);
+		_exit(127);
+	}
+	for (int waited = 0; waited < START_TIMEOUT_MS; waited += 10) {
+		int fd = connect_server(), status;
+		if (fd != -1) {
+			close(fd);
+			return pid;
+		}
+		if (waitpid(pid, &status, WNOHANG) == pid)
+			return -1;
+		poll(NULL, 0, 10);
+	}
+	kill(pid, SIGKILL);
+	waitpid(pid, NULL, 0);
+	return -1;
+}
+
+// Stop the server as the init script does, it must exit cleanly
+static void stop_server(pid_t pid)
+{
+	int status = 0;
+
+	AESD_CHECK(kill(pid, SIGTERM) == 0);
+	AESD_CHECK(waitpid(pid, &status, 0) == pid);
+	AESD_CHECK(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+}
+
+/**
+ * Value of the STATS metric line starting with @param name in the response
+ * @return value, -1 if there is no such line
+ */
+static long stats_value(size_t len, const char *name)
+{
+	size_t name_len = strlen(name);
+
+	for (const char *line = response; line < response + len; ) {
+		const char *newline = memchr(line, '\n', response + len - line);
+		if (!newline)
+			break;
+		if (newline - line > name_len && !memcmp(line, name, name_len) && line[name_len] == ' ')
+			return strtol(line + name_len + 1, NULL, 10);
+		line = newline + 1;
+	}
+	return -1;
+}
+
+static void test_range(void)
+{
+	CHECK_RESPONSE("AESDSOCKET_RANGE:0,4\n", "one\n");
+	CHECK_RESPONSE("AESDSOCKET_RANGE:4,4\n", "two\n");
+	CHECK_RESPONSE("AESDSOCKET_RANGE:5,2\n", "wo");
+	CHECK_RESPONSE("AESDSOCKET_RANGE:4,0\n", "");
+// Clipped to the data
+	CHECK_RESPONSE("AESDSOCKET_RANGE:8,100\n", "three\n");
+	CHECK_RESPONSE("AESDSOCKET_RANGE:14,1\n", "");
+	CHECK_RESPONSE("AESDSOCKET_RANGE:100,1\n", "");
+	CHECK_RESPONSE("AESDSOCKET_RANGE:8,18446744073709551615\n", "three\n");
+// Each of pipelined commands is answered in order
+	CHECK_RESPONSE("AESDSOCKET_RANGE:8,6\nAESDSOCKET_RANGE:0,4\n", "three\none\n");
+}
+
+static void test_last(void)
+{
+	CHECK_RESPONSE("AESDSOCKET_LAST:1\n", "three\n");
+	CHECK_RESPONSE("AESDSOCKET_LAST:2\n", "two\nthree\n");
+	CHECK_RESPONSE("AESDSOCKET_LAST:3\n", "one\ntwo\nthree\n");
+	CHECK_RESPONSE("AESDSOCKET_LAST:100\n", "one\ntwo\nthree\n");
+	CHECK_RESPONSE("AESDSOCKET_LAST:0\n", "");
+}
+
+static void test_stats(const char *backend)
+{
+	char info[64];
+	ssize_t len = request("AESDSOCKET_STATS\n");
+
+	AESD_CHECK(len > 6 && !memcmp(response + len - 6, "# EOF\n", 6));
+	if (len <= 0)
+		return;
+	snprintf(info, sizeof(info), "aesdsocket_storage_info{backend=\"%s\"}", backend);
+	AESD_CHECK(stats_value(len, info) == 1);
+	AESD_CHECK(stats_value(len, "aesdsocket_storage_size_bytes") == 14);
+	AESD_CHECK(stats_value(len, "aesdsocket_storage_start_bytes") == 0);
+	AESD_CHECK(stats_value(len, "aesdsocket_connections_active") >= 1);
+}
+
+// A command in a request frame is answered with one response frame
+static void test_binary(void)
+{
+	static const char command[] = "AESDSOCKET_RANGE:4,4\n";
+	char frame[AESD_WIRE_PREAMBLE_SIZE + sizeof(struct aesd_wire_header) + sizeof(command)];
+	struct aesd_wire_header header;
+	uint64_t length = 0;
+	uint8_t type = 0;
+	ssize_t len;
+
+	aesd_wire_encode(&header, AESD_WIRE_REQUEST, sizeof(command) - 1);
+	memcpy(frame, AESD_WIRE_PREAMBLE, AESD_WIRE_PREAMBLE_SIZE);
+	memcpy(frame + AESD_WIRE_PREAMBLE_SIZE, &header, sizeof(header));
+	memcpy(frame + AESD_WIRE_PREAMBLE_SIZE + sizeof(header), command, sizeof(command) - 1);
+	len = request_bytes(frame, sizeof(frame) - 1);
+	AESD_CHECK(len == sizeof(header) + 4);
+	if (len < (ssize_t)sizeof(header))
+		return;
+	aesd_wire_decode(response, &type, &length);
+	AESD_CHECK(type == AESD_WIRE_RESPONSE && length == 4);
+	AESD_CHECK(!memcmp(response + sizeof(header), "two\n", 4));
+}
+
+// Lines which are not well formed commands are data, and answered with all the data
+static void test_malformed(void)
+{
+	CHECK_RESPONSE("AESDSOCKET_RANGE:1,2,3\n", "one\ntwo\nthree\nAESDSOCKET_RANGE:1,2,3\n");
+	CHECK_RESPONSE("AESDSOCKET_LAST:99999999999999999999999\n",
+			"one\ntwo\nthree\nAESDSOCKET_RANGE:1,2,3\nAESDSOCKET_LAST:99999999999999999999999\n");
+	CHECK_RESPONSE("AESDSOCKET_LAST:1\n", "AESDSOCKET_LAST:99999999999999999999999\n");
+}
+
+// Commands of one mode and backend of the server
+static void test_server(char *const args[], const char *backend)
+{
+	pid_t pid = start_server(args);
+
+	AESD_CHECK(pid != -1);
+	if (pid == -1) {
+		fprintf(stderr, "%s %s did not start\n", server, args[1]);
+		return;
+	}
+// Each line is answered with the data up to it
+	CHECK_RESPONSE("one\ntwo\nthree\n", "one\none\ntwo\none\ntwo\nthree\n");
+	test_range();
+	test_last();
+	test_stats(backend);
+	test_binary();
+	test_malformed();
+	stop_server(pid);
+}
+
+/*
+ * Retention dropped the first segments: a range starting in them begins at the retained start,
+ * lines are found back to it and STATS reports it
+ */
+static void test_retention(void)
+{
+	char *args[] = { "-m", "epoll", "-f", "segment", "-S", "100", "-r", "300", NULL };
+	char lines[20 * 30 + 1];
+	pid_t pid = start_server(args);
+	ssize_t len = 0;
+
+	AESD_CHECK(pid != -1);
+	if (pid == -1)
+		return;
+	for (int i = 0; i < 20; i++) {
+		snprintf(lines + i * 30, sizeof(lines) - i * 30, "line %02d .....................\n", i);
+		len = request(lines + i * 30);
+	}
+	AESD_CHECK(len == 300 && !memcmp(response, lines + 300, 300));
+	CHECK_RESPONSE("AESDSOCKET_RANGE:0,330\n", "line 10 .....................\n");
+	CHECK_RESPONSE("AESDSOCKET_RANGE:330,30\n", "line 11 .....................\n");
+	CHECK_RESPONSE("AESDSOCKET_LAST:1\n", "line 19 .....................\n");
+	len = request("AESDSOCKET_LAST:100\n");
+	AESD_CHECK(len == 300 && !memcmp(response, lines + 300, 300));
+	len = request("AESDSOCKET_STATS\n");
+	AESD_CHECK(len > 0 && stats_value(len, "aesdsocket_storage_start_bytes") == 300);
+	AESD_CHECK(len > 0 && stats_value(len, "aesdsocket_storage_size_bytes") == 600);
+	stop_server(pid);
+}
+
+int main(int argc, char *argv[])
+{
+	char *thread_fd[] = { "-m", "thread", "-f", "fd", NULL };
+	char *epoll_stdio[] = { "-m", "epoll", "-f", "stdio", NULL };
+	char *pool_segment[] = { "-m", "pool", "-f", "segment", "-S", "4", NULL };
+
+	if (argc > 1)
+		server = argv[1];
+	if (!mkdtemp(dir)) {
+		perror("mkdtemp");
+		return 1;
+	}
+	snprintf(data_path, sizeof(data_path), "%s/aesdsocketdata", dir);
+	snprintf(socket_path, sizeof(socket_path), "%s/aesdsocket.sock", dir);
+
+	test_server(thread_fd, "fd");
+	test_server(epoll_stdio, "stdio");
+	test_server(pool_segment, "segment");
+	test_retention();
+
+	unlink(socket_path);
+	rmdir(dir);
+	return aesd_test_result("aesdsocket-test");
+}
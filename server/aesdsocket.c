@@ -47,6 +47,7 @@
 #include <string.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/un.h>
 #include <netinet/in.h>
 #include <netdb.h>
 #include <arpa/inet.h>
@@ -57,45 +58,58 @@
 #include <sys/stat.h>
 #include <fcntl.h>
 #include <pthread.h>
+#include <sched.h>
 #include <sys/queue.h>
-
-#define AESD_DEBUG 
-#define AESD_DEBUG_PACKET 
-
-#define USE_BUFFERED_IO 1
-//#define USE_FILE_MUTEX
-#define USE_AESD_CHAR_DEVICE 1
-
-#ifdef USE_AESD_CHAR_DEVICE 
-#include <sys/ioctl.h>
-#include "../aesd-char-driver/aesd_ioctl.h"
-#endif
-
-#ifndef USE_AESD_CHAR_DEVICE 
-#define USE_FILE_MUTEX
-#endif
-
-#ifdef AESD_DEBUG
-#define PDEBUG(fmt, args...) fprintf(stderr, fmt, ## args)
-#else
-#define PDEBUG(fmt, args...) /* not debugging: nothing */
-#endif
-
-#ifdef AESD_DEBUG_PACKET 
-#define PPDEBUG(fmt, args...) fprintf(stderr, fmt, ## args)
-#else
-#define PPDEBUG(fmt, args...) /* not debugging: nothing */
-#endif
-
-#define PORT "9000"  // the port users will be connecting to
-#define BACKLOG 10   // how many pending connections queue will hold
+#include <sys/epoll.h>
+#include <poll.h>
+#include <sys/sendfile.h>
+#include <sys/uio.h>
+#include <limits.h>
+#include "aesd-work-queue.h"
+#include "aesd-uring.h"
+#include "aesd-snapshot.h"
+#include "aesd-framer.h"
+#include "aesd-buffer-pool.h"
+#include "aesd-group-commit.h"
+#include "aesd-storage.h"
+#include "aesd-metrics.h"
+#include "aesd-trace.h"
+#include "aesd-log.h"
+#include "aesd-replication.h"
+#include "aesd-wire.h"
+#include "aesd-command.h"
+#include "aesd-handoff.h"
+
+#define USE_AESD_CHAR_DEVICE 1	// default storage backend, -f selects another one
+
+// Debug and per packet messages, logged from level LOG_DEBUG / AESD_LOG_PACKET on, see -v
+#define PDEBUG(fmt, args...) AESD_LOG(LOG_DEBUG, fmt, ## args)
+#define PPDEBUG(fmt, args...) AESD_LOG(AESD_LOG_PACKET, fmt, ## args)
+
+#define PORT "9000"  // the port users will be connecting to, default of -p
+#define BACKLOG 10   // how many pending connections queue will hold, default of -b
+#define DEVICE_FILE "/dev/aesdchar"
+#define DATA_PATH "/var/tmp"
+#define DATA_FILE "/var/tmp/aesdsocketdata"	// default of -D
+#define SEGMENT_BYTES (1024*1024)	// default of -S
 #ifdef USE_AESD_CHAR_DEVICE
-#define DATA_FILE "/dev/aesdchar"
+#define DEFAULT_STORAGE "aesdchar"
 #else
-#define DATA_PATH "/var/tmp"
-#define DATA_FILE "/var/tmp/aesdsocketdata"
+#define DEFAULT_STORAGE "fd"
 #endif
 #define SOCKET_ERROR (-1)
+#define MAX_EVENTS (64)		// epoll events handled per epoll_wait()
+#define PACKET_BUF_SIZE    (1024+10)
+#define RECV_BUF_SIZE (1024)
+#define SEND_BUF_SIZE (1024)
+#define URING_ENTRIES (16)		// enough for a write and URING_BUF_SIZE / URING_CHUNK_SIZE read/send pairs
+#define URING_BUF_SIZE (64*1024)	// registered buffer per thread
+#define URING_CHUNK_SIZE (16*1024)	// bytes per linked read/send pair
+#define ZERO_COPY_CHUNK_SIZE (64*1024)	// bytes per sendfile()/splice() call
+#define BATCH_MAX (RECV_BUF_SIZE+1)	// packets one recv can complete
+#define BATCH_PREFIX_MAX (64*1024)	// file bytes before a batch read into memory, more are sent from the file
+#define DRAIN_POLL_MS (100)		// a draining server checks for its last connection this often
+#define COMMAND_ARGS_MAX (3)
 
 #ifndef  gettid
 // glibc from aarm64 buildroot does not support this
@@ -104,9 +118,68 @@ pid_t gettid(void) { return 1; }
 
 volatile int running = false;					// thread loop running ?
 
-#ifdef USE_FILE_MUTEX
-pthread_mutex_t file_mutex = PTHREAD_MUTEX_INITIALIZER; 	// file mutex
-#endif
+// Connection handling modes
+enum server_mode {
+	MODE_THREAD,		// one thread per connection
+	MODE_EPOLL,		// fixed number of epoll event loop threads
+	MODE_SHARD,		// event loops pinned to cores, each accepting on its own SO_REUSEPORT listener
+	MODE_POOL,		// worker pool with work stealing queues
+};
+
+// Protocol of a connection, told by its first bytes
+enum connection_protocol {
+	PROTOCOL_NEW,		// nothing or a prefix of the binary preamble received yet
+	PROTOCOL_TEXT,		// newline terminated lines
+	PROTOCOL_BINARY,	// length prefixed frames, see aesd-wire.h
+};
+
+const char *port = PORT;			// port clients connect to
+const char *unix_path = NULL;			// UNIX socket same host clients may connect to as well, see -U
+int unix_socket = -1;				// listening on unix_path
+const char *data_file = DATA_FILE;		// regular data file, several servers on one host need their own
+bool use_uring = false;				// io_uring for data file and send
+bool use_zero_copy = true;			// sendfile() in send_file_range()
+int backlog = BACKLOG;				// listen() backlog
+unsigned long max_connections = 0;		// admission limit on open connections, 0 is unlimited
+size_t max_inflight_bytes = 0;			// admission limit on buffered input and pending responses, 0 is unlimited
+unsigned long connections_active = 0;		// admitted connections, updated atomically
+size_t inflight_bytes = 0;			// bytes buffered or being sent, updated atomically
+unsigned long connections_rejected = 0;		// connections turned away, updated atomically
+int spare_fd = -1;				// reserved descriptor, freed to shed a connection on EMFILE
+pthread_mutex_t spare_mutex = PTHREAD_MUTEX_INITIALIZER;	// protects spare_fd
+size_t snapshot_cache_max = 0;			// snapshot cache memory cap, 0 disables the cache
+bool use_group_commit = false;			// appends go through the group committer
+enum aesd_commit_sync commit_sync;		// group commit durability policy
+unsigned int commit_interval_ms;		// sync interval of AESD_COMMIT_SYNC_INTERVAL
+const struct aesd_storage_ops *storage_ops;	// backend selected with -f
+struct aesd_storage_retention retention = { .segment_bytes = SEGMENT_BYTES };	// segment backend, see -S, -r and -a
+struct aesd_storage storage;			// data file, /dev/aesdchar or the regular file
+pthread_key_t uring_key;			// per thread struct aesd_uring
+char uring_unavailable;				// marks threads where io_uring setup failed
+struct aesd_snapshot_cache snapshot_cache;	// data file contents shared by all connections
+struct aesd_commit_queue commit_queue;		// group committer of data file appends
+struct aesd_storage_handle commit_data;		// view of the data file the committer appends through
+bool commit_started = false;
+const char *replication_port = NULL;		// followers connect to it, see -R
+struct aesd_primary primary;			// streams the data file to followers
+bool primary_started = false;
+char *follow_host = NULL;			// primary replicated from, see -F, client lines are not written then
+char *follow_port = NULL;
+struct aesd_follower follower;			// appends the stream of the primary to the data file
+bool follower_started = false;
+const char *handoff_path = NULL;		// hot restart socket, see -H
+int handoff_fds[AESD_HANDOFF_MAX_FDS];		// listening sockets taken over from the previous server
+int handoff_fds_n = 0;
+struct aesd_handoff handoff;			// passes the listening sockets to the next server
+bool handoff_started = false;
+bool handed_off = false;			// the next server accepts, this one drains
+bool accept_stopped = false;			// main left its accept loop
+pthread_t main_thread;
+int start_group_commit();
+void stop_group_commit();
+void thread_uring_free(void *ring);
+struct connection;
+int send_file_range(struct connection *conn, size_t offset, size_t end);
 
 struct thread_params {
 	int client_socket;			// new connection on client_socket
@@ -123,22 +196,95 @@ struct thread_entry {
 
 SLIST_HEAD(thread_list, thread_entry) threads;	// thread pool
 
+// Response bytes a nonblocking socket did not take yet
+struct pending_output {
+	char *buf;				// copied bytes [offset, end), or NULL for data file bytes [offset, end)
+	size_t allocated;
+	size_t offset;				// next byte to send
+	size_t end;				// AESD_STORAGE_EOF sends up to the end of the data
+	size_t counted;				// bytes counted in inflight_bytes until sent
+	TAILQ_ENTRY(pending_output) entries;
+};
+
+// Per connection state, used by both the thread and the event loop modes
+struct connection {
+	int client_socket;			// connected socket
+	char client_address[INET6_ADDRSTRLEN];	// client IP address
+	struct aesd_storage_handle data;	// view of the data file, attached per connection
+	struct aesd_framer framer;		// received data split into lines
+	size_t inflight;			// incomplete line bytes counted in inflight_bytes
+	int worker;				// home worker in pool mode
+	bool tail;				// tail mode, send only data not sent yet
+	size_t tail_offset;			// data file offset sent so far in tail mode
+	enum connection_protocol protocol;
+	bool nonblocking;			// event loop or pool socket, sends never wait for the peer
+	TAILQ_HEAD(pending_list, pending_output) pending;	// output the socket did not take, sent in order once writable
+	LIST_ENTRY(connection) entries;		// event loop / worker pool connection list
+};
+
+// Event loop, multiplexes many nonblocking connections on one thread
+struct event_loop {
+	pthread_t thread;			// loop thread
+	int epoll_fd;				// epoll instance
+	int handoff[2];				// pipe, accepted connections are passed through
+	int listen_socket;			// own SO_REUSEPORT listener in shard mode, else -1
+	int cpu;				// core the loop is pinned to in shard mode, else -1
+	unsigned long accepted;			// connections accepted on listen_socket
+	LIST_HEAD(connection_list, connection) connections;
+};
+
+// Worker pool, a dispatcher queues ready connections to workers which steal from each other
+struct pool_worker {
+	pthread_t thread;			// worker thread
+	int id;					// index in the pool
+	struct aesd_work_queue queue;		// ready connections
+	struct worker_pool *pool;
+};
+
+struct worker_pool {
+	int workers_n;
+	struct pool_worker *workers;
+	pthread_t dispatcher;			// waits for ready connections
+	int epoll_fd;				// connections armed with EPOLLONESHOT
+	int wakeup[2];				// pipe, closed to stop the dispatcher
+	pthread_mutex_t lock;			// protects fields below
+	pthread_cond_t cond;			// signalled when a task is queued
+	size_t pending;				// tasks queued in all workers
+	bool stopping;
+	struct connection_list connections;	// all connections in the pool
+	int next_worker;			// round robin home worker
+};
+
 // Signal handler
 void handle_signal(int signal) {
-	syslog(LOG_INFO, "Caught signal, exiting");
 	running = false;
 }
 
+// Only interrupts accept() or sigsuspend() of main, see handoff_done()
+void handle_wakeup_signal(int signal) {
+}
+
+// Stop the server from another thread, main may wait in accept() or sigsuspend() for a signal
+void stop_running() {
+	running = false;
+	pthread_kill(main_thread, SIGRTMIN);
+}
+
+// SIGUSR1 logs more, SIGUSR2 less
+void handle_log_level_signal(int signal) {
+	aesd_log_set_level(aesd_log_level + ((signal == SIGUSR1) ? 1 : -1));
+}
+
 // Turns into a daemon process
 int daemonize() {
 	pid_t pid = fork();
 	if (pid < 0) {
-		syslog(LOG_ERR, "Failed to fork: %s", strerror(errno));
+		AESD_LOG(LOG_ERR, "Failed to fork: %s", strerror(errno));
 		return -1;
 	}
 // Exit if parent 
 	if (pid > 0) {
-		syslog(LOG_INFO, "Parent exiting");
+		AESD_LOG(LOG_INFO, "Parent exiting");
 		closelog();
 		exit(0);
 	}
@@ -153,7 +299,7 @@ int daemonize() {
 	open("/dev/null", O_RDONLY);
 	open("/dev/null", O_WRONLY);
 	open("/dev/null", O_RDWR);
-	syslog(LOG_INFO, "Running as a daemon");
+	AESD_LOG(LOG_INFO, "Running as a daemon");
 	return 0;
 }
 
@@ -166,10 +312,114 @@ void setup_signal_handlers() {
 	sa.sa_handler = handle_signal;
 	sigaction(SIGINT,  &sa, NULL);
 	sigaction(SIGTERM, &sa, NULL);
+
+// Changing the level must not interrupt a recv()
+	sa.sa_flags = SA_RESTART;
+	sa.sa_handler = handle_log_level_signal;
+	sigaction(SIGUSR1, &sa, NULL);
+	sigaction(SIGUSR2, &sa, NULL);
+	sa.sa_flags = 0;
+	sa.sa_handler = handle_wakeup_signal;
+	sigaction(SIGRTMIN, &sa, NULL);
+
+// A client closing during its response must only end that connection
+	sa.sa_handler = SIG_IGN;
+	sigaction(SIGPIPE, &sa, NULL);
+}
+
+// Take a connection slot, refused while a limit is reached
+bool connection_admit() {
+	if (max_inflight_bytes && __atomic_load_n(&inflight_bytes, __ATOMIC_RELAXED) >= max_inflight_bytes) 
+		return false;
+	if (__atomic_add_fetch(&connections_active, 1, __ATOMIC_RELAXED) > max_connections && max_connections) {
+		__atomic_sub_fetch(&connections_active, 1, __ATOMIC_RELAXED);
+		return false;
+	}
+	aesd_metrics_add(AESD_COUNTER_CONNECTIONS, 1);
+	return true;
+}
+
+void connection_release() {
+	__atomic_sub_fetch(&connections_active, 1, __ATOMIC_RELAXED);
+}
+
+void inflight_add(ssize_t bytes) {
+	__atomic_add_fetch(&inflight_bytes, bytes, __ATOMIC_RELAXED);
+}
+
+// Turn a connection away with a reset, no thread, buffer or file is set up for it
+void connection_reject(int client_socket) {
+	struct linger linger = { .l_onoff = 1, .l_linger = 0 };
+
+	setsockopt(client_socket, SOL_SOCKET, SO_LINGER, &linger, sizeof(linger));
+	close(client_socket);
+	__atomic_add_fetch(&connections_rejected, 1, __ATOMIC_RELAXED);
+}
+
+/***
+ * Handle an accept() failure without stopping the server
+ * @return 
+ * 	 0 keep accepting
+ *     	-1 the listener itself is broken
+ */
+int accept_failed(int server_socket) {
+	bool shed = false;
+
+	switch (errno) {
+// A listener shared with a shard server is nonblocking, main waits for a connection or a signal,
+// with a UNIX listener it waits for both anyway
+	case EAGAIN:
+#if EAGAIN != EWOULDBLOCK
+	case EWOULDBLOCK:
+#endif
+		if (unix_socket == -1)
+			poll(&(struct pollfd){ .fd = server_socket, .events = POLLIN }, 1, -1);
+		return 0;
+// Signal, or the connection failed before it was taken off the queue
+	case EINTR:
+	case ECONNABORTED:
+	case EPROTO:
+	case ENOPROTOOPT:
+	case EOPNOTSUPP:
+	case ENETDOWN:
+	case ENETUNREACH:
+	case EHOSTDOWN:
+	case EHOSTUNREACH:
+	case ENONET:
+		return 0;
+	case EBADF:
+	case EINVAL:
+	case ENOTSOCK:
+	case EFAULT:
+		AESD_LOG(LOG_ERR, "Failed to accept connection: %s", strerror(errno));
+		return -1;
+	case EMFILE:
+	case ENFILE:
+// Out of descriptors, free the spare one to take the pending connection off the queue and reset it
+		pthread_mutex_lock(&spare_mutex);
+		if (spare_fd != -1) {
+			close(spare_fd);
+			int client_socket = accept(server_socket, NULL, NULL);
+			if (client_socket != -1) 
+				connection_reject(client_socket);
+			spare_fd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+			shed = true;
+		}
+		pthread_mutex_unlock(&spare_mutex);
+		if (shed)
+			return 0;
+		break;
+	default:
+		AESD_LOG(LOG_ERR, "Failed to accept connection: %s", strerror(errno));
+		break;
+	}
+// Nothing could be shed, give connections a moment to close before the next attempt
+	poll(NULL, 0, 10);
+	return 0;
 }
 
-// Create server socket, terminate if failed
-int create_server_socket() {
+// Create server socket on port, terminate if failed
+int create_server_socket(const char *port) {
 	struct addrinfo hints, *servinfo, *p;
 	int rv;
 	int yes=1;
@@ -181,32 +431,32 @@ int create_server_socket() {
 	hints.ai_socktype = SOCK_STREAM;
 	hints.ai_flags = AI_PASSIVE; // use my IP
 
-	if ((rv = getaddrinfo(NULL, PORT, &hints, &servinfo)) != 0) { 
-		syslog(LOG_ERR, "getaddrinfo: %s", gai_strerror(rv));
+	if ((rv = getaddrinfo(NULL, port, &hints, &servinfo)) != 0) { 
+		AESD_LOG(LOG_ERR, "getaddrinfo: %s", gai_strerror(rv));
 		return -1;
 	}
 // loop through all the results and bind to the first we can
 	for(p = servinfo; p != NULL; p = p->ai_next) {
 		if ((server_socket = socket(p->ai_family, p->ai_socktype, p->ai_protocol)) == -1) {
-			syslog(LOG_ERR, "Failed to create socket: %s", strerror(errno));
+			AESD_LOG(LOG_ERR, "Failed to create socket: %s", strerror(errno));
 			continue;
 		}
 
 // Work around ... already in use ... errors
 		if (setsockopt(server_socket, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(int)) == -1) {
 			freeaddrinfo(servinfo); // all done with this structure
-			syslog(LOG_ERR, "setsockopt(SO_REUSEADDR) failed: %s", strerror(errno));
+			AESD_LOG(LOG_ERR, "setsockopt(SO_REUSEADDR) failed: %s", strerror(errno));
 			return -1;
 		}
 		if (setsockopt(server_socket, SOL_SOCKET, SO_REUSEPORT, &yes, sizeof(int)) == -1) {
 			freeaddrinfo(servinfo); // all done with this structure
-			syslog(LOG_ERR, "setsockopt(SO_REUSEPORT) failed: %s", strerror(errno));
+			AESD_LOG(LOG_ERR, "setsockopt(SO_REUSEPORT) failed: %s", strerror(errno));
 			return -1;
 		}
 // Bind 
 		if (bind(server_socket, p->ai_addr, p->ai_addrlen) == -1) {
 			close(server_socket);
-			syslog(LOG_ERR, "Failed to bind socket: %s", strerror(errno));
+			AESD_LOG(LOG_ERR, "Failed to bind socket: %s", strerror(errno));
 			continue;
 		}
 		break; 
@@ -215,12 +465,37 @@ int create_server_socket() {
 // Exit if no address bound
 	freeaddrinfo(servinfo); // all done with this structure
 	if (!p) {
-		syslog(LOG_ERR, "server: service not available");
+		AESD_LOG(LOG_ERR, "server: service not available");
 		return -1;
 	}
 	return server_socket;
 }
 
+// Create the UNIX stream socket at path, a socket file left there by an earlier server is replaced
+int create_unix_socket(const char *path) {
+	struct sockaddr_un addr;
+	int s;
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	if (strlen(path) >= sizeof(addr.sun_path)) {
+		AESD_LOG(LOG_ERR, "UNIX socket path %s is too long", path);
+		return -1;
+	}
+	strcpy(addr.sun_path, path);
+	if ((s = socket(AF_UNIX, SOCK_STREAM, 0)) == -1) {
+		AESD_LOG(LOG_ERR, "Failed to create socket: %s", strerror(errno));
+		return -1;
+	}
+	unlink(path);
+	if (bind(s, (struct sockaddr *)&addr, sizeof(addr)) == -1) {
+		AESD_LOG(LOG_ERR, "Failed to bind socket %s: %s", path, strerror(errno));
+		close(s);
+		return -1;
+	}
+	return s;
+}
+
 // get sockaddr, IPv4 or IPv6:
 void *get_in_addr(struct sockaddr *sa) {
 	if (sa->sa_family == AF_INET) 
@@ -228,113 +503,754 @@ void *get_in_addr(struct sockaddr *sa) {
 	return &(((struct sockaddr_in6*)sa)->sin6_addr);
 }
 
-#ifdef USE_AESD_CHAR_DEVICE
-int is_char_device(const char *path)
-{
-    	struct stat path_stat;
-    	stat(path, &path_stat);
-    	return S_ISCHR(path_stat.st_mode);
+// Client address for the log, clients of the UNIX socket are unnamed
+void client_address(struct sockaddr_storage *addr, char *buf, size_t size) {
+	if (addr->ss_family == AF_UNIX) 
+		snprintf(buf, size, "local");
+	else
+		inet_ntop(addr->ss_family, get_in_addr((struct sockaddr *)addr), buf, size);
+}
+
+/***
+ * Wait until the TCP or the UNIX listener has a connection, in shard mode only the UNIX one
+ * @return the listener ready, -1 if interrupted
+ */
+int wait_listener(int server_socket, bool tcp) {
+	struct pollfd pfds[2] = {
+		{ .fd = unix_socket, .events = POLLIN },
+		{ .fd = server_socket, .events = POLLIN },
+	};
+
+	if (poll(pfds, tcp ? 2 : 1, -1) == -1)
+		return -1;
+	return (pfds[0].revents) ? unix_socket : server_socket;
 }
-#endif
 
 void *connection_thread(void *args);
+int connection_open(struct connection *conn);
+void *event_loop_thread(void *args);
+void connection_close(struct connection *conn);
+void stop_worker_pool(struct worker_pool *pool);
+
+// Block SIGINT/SIGTERM before creating helper threads, so signals interrupt accept() in main
+void block_signals(sigset_t *old_set) {
+	sigset_t set;
+
+	sigemptyset(&set);
+	sigaddset(&set, SIGINT);
+	sigaddset(&set, SIGTERM);
+	pthread_sigmask(SIG_BLOCK, &set, old_set);
+}
+
+// Listener of shard i, shard 0 takes the main server socket, the others bind another one to the same port
+int shard_listener(int i, int server_socket) {
+	int s = server_socket;
+
+	if (i)
+		s = (i < handoff_fds_n) ? handoff_fds[i] : create_server_socket(port);
+
+	if (s == -1) 
+		return -1;
+	if (i && listen(s, backlog) == -1) {
+		AESD_LOG(LOG_ERR, "Failed to listen: %s", strerror(errno));
+		close(s);
+		return -1;
+	}
+	fcntl(s, F_SETFL, fcntl(s, F_GETFL, 0) | O_NONBLOCK);
+	return s;
+}
+
+// Start event loop threads with SIGINT/SIGTERM blocked, in shard mode each with a listener and pinned to a core
+int start_event_loops(struct event_loop *loops, int loops_n, bool shard, int server_socket) {
+	sigset_t old_set;
+	cpu_set_t allowed;
+	int cpus_n = 0, cpus[CPU_SETSIZE];
+	int i;
+
+// Shards are spread over the cores this process may run on
+	if (shard && sched_getaffinity(0, sizeof(allowed), &allowed) == 0) {
+		for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) 
+			if (CPU_ISSET(cpu, &allowed))
+				cpus[cpus_n++] = cpu;
+	}
+
+	block_signals(&old_set);
+	for (i = 0; i < loops_n; i++) {
+		struct event_loop *loop = &loops[i];
+		pthread_attr_t attr;
+		LIST_INIT(&loop->connections);
+		loop->listen_socket = loop->cpu = -1;
+		if (shard && (loop->listen_socket = shard_listener(i, server_socket)) == -1) 
+			break;
+		if ((loop->epoll_fd = epoll_create1(0)) == -1) {
+			AESD_LOG(LOG_ERR, "epoll_create1 %s", strerror(errno));
+			goto error_loop;
+		}
+		if (pipe(loop->handoff) == -1) {
+			AESD_LOG(LOG_ERR, "pipe %s", strerror(errno));
+			close(loop->epoll_fd);
+			goto error_loop;
+		}
+		pthread_attr_init(&attr);
+		if (cpus_n) {
+			cpu_set_t set;
+			CPU_ZERO(&set);
+			loop->cpu = cpus[i % cpus_n];
+			CPU_SET(loop->cpu, &set);
+			pthread_attr_setaffinity_np(&attr, sizeof(set), &set);
+		}
+		int result = pthread_create(&loop->thread, &attr, event_loop_thread, loop);
+		pthread_attr_destroy(&attr);
+		if (result != 0) {
+			AESD_LOG(LOG_ERR, "pthread_create %s", strerror(result));
+			close(loop->handoff[0]);
+			close(loop->handoff[1]);
+			close(loop->epoll_fd);
+			goto error_loop;
+		}
+		continue;
+
+error_loop:
+		if (i && loop->listen_socket != -1) 
+			close(loop->listen_socket);
+		break;
+	}
+	pthread_sigmask(SIG_SETMASK, &old_set, NULL);
+	return i;
+}
+
+// Ask event loops to finish, they close their connections on exit
+void stop_event_loops(struct event_loop *loops, int loops_n) {
+	for (int i = 0; i < loops_n; i++) 
+		close(loops[i].handoff[1]);
+	for (int i = 0; i < loops_n; i++) {
+		if (pthread_join(loops[i].thread, NULL) != 0) 
+			AESD_LOG(LOG_ERR, "pthread_join failed, ignoring ...");
+		close(loops[i].handoff[0]);
+		close(loops[i].epoll_fd);
+		if (loops[i].listen_socket == -1)
+			continue;
+		AESD_LOG(LOG_INFO, "Shard %d on cpu %d accepted %lu connections", i, loops[i].cpu, loops[i].accepted);
+// Shard 0 listens on the main server socket, main closes it
+		if (i)
+			close(loops[i].listen_socket);
+	}
+}
+
+void *worker_thread(void *args);
+void *dispatcher_thread(void *args);
+
+// Snapshot appends follow file order, they take the bytes even of a failed write to stay in step
+void snapshot_ordered(void *ctx, const struct iovec *iov, int iov_n, size_t offset) {
+	for (int i = 0; snapshot_cache_max && i < iov_n; i++) {
+		if (aesd_snapshot_cache_append(&snapshot_cache, iov[i].iov_base, iov[i].iov_len) == -1) 
+			AESD_LOG(LOG_WARNING, "Snapshot cache disabled at %zu bytes, out of memory", offset);
+	}
+}
+
+// Handoff thread, the next server recreates the data files under their names, this one keeps its own
+void handoff_release(void *ctx) {
+	aesd_storage_remove(&storage);
+}
+
+// Handoff thread, wake main up until it has left accept(), a signal right before it would be missed
+void handoff_done(void *ctx) {
+	__atomic_store_n(&handed_off, true, __ATOMIC_RELEASE);
+	while (!__atomic_load_n(&accept_stopped, __ATOMIC_ACQUIRE)) {
+		pthread_kill(main_thread, SIGRTMIN);
+		poll(NULL, 0, 10);
+	}
+}
+
+// Append a group commit batch, runs on the committer thread
+int commit_write(void *ctx, struct iovec *iov, int iov_n, size_t *offset) {
+	return aesd_storage_append(ctx, iov, iov_n, offset);
+}
+
+// Sync what the committer appended, runs on the committer thread
+int commit_sync_file(void *ctx) {
+	return aesd_storage_sync(((struct aesd_storage_handle *)ctx)->storage);
+}
+
+// Start the log thread with SIGINT/SIGTERM blocked
+int start_log() {
+	sigset_t old_set;
+	int result;
+
+	block_signals(&old_set);
+	result = aesd_log_init();
+	pthread_sigmask(SIG_SETMASK, &old_set, NULL);
+	return result;
+}
+
+// Start the committer with SIGINT/SIGTERM blocked
+int start_group_commit() {
+	sigset_t old_set;
+	int result;
+
+	aesd_storage_attach(&storage, &commit_data);
+	block_signals(&old_set);
+	result = aesd_commit_init(&commit_queue, commit_sync, commit_interval_ms, commit_write, commit_sync_file, &commit_data);
+	pthread_sigmask(SIG_SETMASK, &old_set, NULL);
+	if (result == -1) {
+		AESD_LOG(LOG_ERR, "Cannot start group committer: %s", strerror(errno));
+		aesd_storage_detach(&commit_data);
+	}
+	commit_started = (result == 0);
+	return result;
+}
+
+// Commit what is left and report batching
+void stop_group_commit() {
+	struct aesd_commit_stats stats;
+
+	aesd_commit_destroy(&commit_queue, &stats);
+	AESD_LOG(LOG_INFO, "Group commit: %lu lines in %lu batches, %.1f lines/batch avg, %lu max, "
+			"commit latency %.1f us avg, %.1f us max, %lu syncs",
+			stats.lines, stats.batches, stats.batches ? (double)stats.lines / stats.batches : 0.0, stats.max_batch,
+			stats.batches ? stats.commit_ns / 1000.0 / stats.batches : 0.0, stats.max_commit_ns / 1000.0, stats.syncs);
+	aesd_storage_detach(&commit_data);
+	commit_started = false;
+}
+
+// Start dispatcher and workers with SIGINT/SIGTERM blocked
+int start_worker_pool(struct worker_pool *pool, int workers_n) {
+	sigset_t old_set;
+	int i;
+
+	memset(pool, 0, sizeof(*pool));
+	LIST_INIT(&pool->connections);
+	pthread_mutex_init(&pool->lock, NULL);
+	pthread_cond_init(&pool->cond, NULL);
+	if (!(pool->workers = calloc(workers_n, sizeof(struct pool_worker)))) {
+		AESD_LOG(LOG_ERR, "pool_worker malloc %s", strerror(errno));
+		goto error_malloc_workers;
+	}
+	if ((pool->epoll_fd = epoll_create1(0)) == -1) {
+		AESD_LOG(LOG_ERR, "epoll_create1 %s", strerror(errno));
+		goto error_epoll_create;
+	}
+	if (pipe(pool->wakeup) == -1) {
+		AESD_LOG(LOG_ERR, "pipe %s", strerror(errno));
+		goto error_pipe;
+	}
+
+	block_signals(&old_set);
+	for (i = 0; i < workers_n; i++) {
+		struct pool_worker *worker = &pool->workers[i];
+		worker->id = i;
+		worker->pool = pool;
+		if (aesd_work_queue_init(&worker->queue) == -1) {
+			AESD_LOG(LOG_ERR, "work queue malloc %s", strerror(errno));
+			break;
+		}
+		if (pthread_create(&worker->thread, NULL, worker_thread, worker) != 0) {
+			AESD_LOG(LOG_ERR, "pthread_create %s", strerror(errno));
+			aesd_work_queue_destroy(&worker->queue);
+			break;
+		}
+	}
+	pool->workers_n = i;
+	if (!i) {
+		pthread_sigmask(SIG_SETMASK, &old_set, NULL);
+		goto error_no_workers;
+	}
+	if (pthread_create(&pool->dispatcher, NULL, dispatcher_thread, pool) != 0) {
+		AESD_LOG(LOG_ERR, "pthread_create %s", strerror(errno));
+		close(pool->wakeup[1]);
+		pool->wakeup[1] = -1;
+		stop_worker_pool(pool);
+		i = 0;
+	}
+	pthread_sigmask(SIG_SETMASK, &old_set, NULL);
+	return i;
+
+error_no_workers:
+	close(pool->wakeup[0]);
+	close(pool->wakeup[1]);
+error_pipe:
+	close(pool->epoll_fd);
+error_epoll_create:
+	free(pool->workers);
+error_malloc_workers:
+	return 0;
+}
+
+// Stop dispatcher and workers, close connections left in the pool
+void stop_worker_pool(struct worker_pool *pool) {
+	if (pool->wakeup[1] != -1) {
+		close(pool->wakeup[1]);
+		if (pthread_join(pool->dispatcher, NULL) != 0) 
+			AESD_LOG(LOG_ERR, "pthread_join failed, ignoring ...");
+	}
+	pthread_mutex_lock(&pool->lock);
+	pool->stopping = true;
+	pthread_cond_broadcast(&pool->cond);
+	pthread_mutex_unlock(&pool->lock);
+	for (int i = 0; i < pool->workers_n; i++) {
+		if (pthread_join(pool->workers[i].thread, NULL) != 0) 
+			AESD_LOG(LOG_ERR, "pthread_join failed, ignoring ...");
+		aesd_work_queue_destroy(&pool->workers[i].queue);
+	}
+	while (!LIST_EMPTY(&pool->connections)) {
+		struct connection *conn = LIST_FIRST(&pool->connections);
+		LIST_REMOVE(conn, entries);
+		connection_close(conn);
+		free(conn);
+	}
+	close(pool->wakeup[0]);
+	close(pool->epoll_fd);
+	free(pool->workers);
+	pthread_cond_destroy(&pool->cond);
+	pthread_mutex_destroy(&pool->lock);
+}
+
+// Add an accepted connection to the pool, the dispatcher queues it once it is readable
+int worker_pool_add(struct worker_pool *pool, struct connection *conn) {
+	struct epoll_event ev;
+
+	pthread_mutex_lock(&pool->lock);
+	conn->worker = pool->next_worker++ % pool->workers_n;
+	LIST_INSERT_HEAD(&pool->connections, conn, entries);
+	pthread_mutex_unlock(&pool->lock);
+
+	ev.events = EPOLLIN | EPOLLONESHOT;
+	ev.data.ptr = conn;
+	if (epoll_ctl(pool->epoll_fd, EPOLL_CTL_ADD, conn->client_socket, &ev) == -1) {
+		AESD_LOG(LOG_ERR, "epoll_ctl %s", strerror(errno));
+		pthread_mutex_lock(&pool->lock);
+		LIST_REMOVE(conn, entries);
+		pthread_mutex_unlock(&pool->lock);
+		return -1;
+	}
+	return 0;
+}
 
 int main(int argc, char *argv[]) {
 	int server_socket = -1; 			// listen on server_socket
 	int opt;
 	bool daemonize_flag = false;
 	bool error = true;
+	enum server_mode mode = MODE_THREAD;
+	long loops_n = sysconf(_SC_NPROCESSORS_ONLN);
+	struct event_loop *loops = NULL;
+	int loops_started = 0;
+	int next_loop = 0;
+	struct worker_pool pool;
+	int workers_started = 0;
 
 // Start syslog
 	openlog("aesdsocket", LOG_PID, LOG_USER);
-	syslog(LOG_INFO, "Starting");
+	AESD_LOG(LOG_INFO, "Starting");
 	SLIST_INIT(&threads);
+	main_thread = pthread_self();
 
 // Check if deamon flag specified
-	while ((opt = getopt(argc, argv, "d")) != -1) {
+	while ((opt = getopt(argc, argv, "a:b:cD:dF:f:g:H:i:l:m:p:R:r:S:s:t:U:uv:")) != -1) {
 		switch (opt) {
 		case 'd':
 			daemonize_flag = true;
 			break;
+		case 'u':
+			use_uring = true;
+			break;
+		case 'c':
+			use_zero_copy = false;
+			break;
+		case 's':
+			snapshot_cache_max = strtoul(optarg, NULL, 10);
+			break;
+		case 'S':
+			retention.segment_bytes = strtoul(optarg, NULL, 10);
+			if (!retention.segment_bytes)
+				goto usage;
+			break;
+		case 'r':
+			retention.max_bytes = strtoul(optarg, NULL, 10);
+			break;
+		case 'a':
+			retention.max_age_s = strtoul(optarg, NULL, 10);
+			break;
+		case 'f':
+			if (!(storage_ops = aesd_storage_find(optarg)))
+				goto usage;
+			break;
+		case 'b':
+			backlog = strtol(optarg, NULL, 10);
+			if (backlog < 1)
+				goto usage;
+			break;
+		case 'l':
+			max_connections = strtoul(optarg, NULL, 10);
+			break;
+		case 'i':
+			max_inflight_bytes = strtoul(optarg, NULL, 10);
+			break;
+		case 'g':
+			use_group_commit = true;
+			if (!strcmp(optarg, "none")) {
+				commit_sync = AESD_COMMIT_SYNC_NONE;
+			} else if (!strcmp(optarg, "batch")) {
+				commit_sync = AESD_COMMIT_SYNC_BATCH;
+			} else {
+				commit_sync = AESD_COMMIT_SYNC_INTERVAL;
+				commit_interval_ms = strtoul(optarg, NULL, 10);
+				if (!commit_interval_ms)
+					goto usage;
+			}
+			break;
+		case 'm':
+			if (!strcmp(optarg, "thread"))
+				mode = MODE_THREAD;
+			else if (!strcmp(optarg, "epoll"))
+				mode = MODE_EPOLL;
+			else if (!strcmp(optarg, "shard"))
+				mode = MODE_SHARD;
+			else if (!strcmp(optarg, "pool"))
+				mode = MODE_POOL;
+			else
+				goto usage;
+			break;
+		case 't':
+			loops_n = strtol(optarg, NULL, 10);
+			if (loops_n < 1)
+				goto usage;
+			break;
+		case 'v':
+			aesd_log_set_level(strtol(optarg, NULL, 10));
+			break;
+		case 'p':
+			port = optarg;
+			break;
+		case 'U':
+			unix_path = optarg;
+			break;
+		case 'D':
+			data_file = optarg;
+			break;
+		case 'H':
+			handoff_path = optarg;
+			break;
+		case 'R':
+			replication_port = optarg;
+			break;
+		case 'F':
+			follow_host = optarg;
+			if (!(follow_port = strrchr(optarg, ':')) || follow_port == optarg || !follow_port[1])
+				goto usage;
+			*follow_port++ = '\0';
+			break;
 		default:
-			fprintf(stderr, "Usage: %s [-d]\n", argv[0]);
-			syslog(LOG_INFO,"Invalid parameter supplied");
+usage:
+			fprintf(stderr, "Usage: %s [-a retain_seconds] [-b backlog] [-c] [-D data_file] [-d] [-F primary_host:replication_port] [-f stdio|fd|segment|aesdchar] [-g none|batch|sync_ms] [-H handoff_path] [-i inflight_bytes] [-l connections] [-m thread|epoll|pool|shard] [-p port] [-R replication_port] [-r retain_bytes] [-S segment_bytes] [-s cache_bytes] [-t threads] [-U unix_path] [-u] [-v level]\n", argv[0]);
+			AESD_LOG(LOG_INFO,"Invalid parameter supplied");
 			goto error_invalid_parameter;
 		}
 	}
+	if (loops_n < 1)
+		loops_n = 1;
 
-#ifdef USE_AESD_CHAR_DEVICE
-// Check presence of /dev/aesdchar and abort if not exists
-	if(!is_char_device(DATA_FILE)) {
-		fprintf(stderr, DATA_FILE " does not exist, exiting\n");
-		syslog(LOG_ERR, DATA_FILE " does not exist, exiting" );
-		goto error_path_not_found;
-	}
-#else
+	if (!storage_ops && !(storage_ops = aesd_storage_find(DEFAULT_STORAGE))) 
+		goto error_invalid_parameter;
+
+// The regular data file is only appended to, features working on its offsets need it
+	if (storage_ops->flags & AESD_STORAGE_LOG) {
 // Check presence of /vat/tmp and create it if not exists
-    	if (mkdir(DATA_PATH, 0777) && errno != EEXIST) {
-		syslog(LOG_ERR, "Cannot create /var/tmp path %s", strerror(errno));
-		goto error_path_not_found;
+    		if (mkdir(DATA_PATH, 0777) && errno != EEXIST) {
+			AESD_LOG(LOG_ERR, "Cannot create /var/tmp path %s", strerror(errno));
+			goto error_path_not_found;
+		}
+	} else {
+		if (use_group_commit) {
+			AESD_LOG(LOG_INFO, "Group commit needs the regular data file, ignoring -g");
+			use_group_commit = false;
+		}
+		if (replication_port || follow_host) {
+			AESD_LOG(LOG_INFO, "Replication needs the regular data file, ignoring -R and -F");
+			replication_port = NULL;
+			follow_host = NULL;
+		}
+	}
+// Segments have no single descriptor and drop the data the cache would start with
+	if (!(storage_ops->flags & AESD_STORAGE_FILE)) {
+		if (use_uring) {
+			AESD_LOG(LOG_INFO, "io_uring needs the regular data file, ignoring -u");
+			use_uring = false;
+		}
+		if (snapshot_cache_max) {
+			AESD_LOG(LOG_INFO, "Snapshot cache needs the regular data file, ignoring -s");
+			snapshot_cache_max = 0;
+		}
+	}
+	if (!(storage_ops->flags & AESD_STORAGE_RETAIN) && (retention.max_bytes || retention.max_age_s)) 
+		AESD_LOG(LOG_INFO, "Retention needs the segment backend, ignoring -r and -a");
+// A writer sleeps until the committer has written, and with batch synced, its line, which would
+// stall every connection of an event loop or pool worker
+	if (use_group_commit && mode != MODE_THREAD) {
+		AESD_LOG(LOG_INFO, "Group commit needs a thread per connection, ignoring -g");
+		use_group_commit = false;
 	}
 
-// Delete stale data file
-	remove(DATA_FILE);
-#endif
+// Hot restart, take the listening sockets over from the server on the handoff path, it lets go of
+// the data files first. Without one this is a cold start
+	if (handoff_path) {
+		if ((handoff_fds_n = aesd_handoff_receive(handoff_path, handoff_fds, AESD_HANDOFF_MAX_FDS)) == -1) {
+			AESD_LOG(LOG_ERR, "Failed to take over from %s, starting cold: %s", handoff_path, strerror(errno));
+			handoff_fds_n = 0;
+		} else if (handoff_fds_n) {
+			AESD_LOG(LOG_INFO, "Took %d listening sockets over from %s", handoff_fds_n, handoff_path);
+		}
+	}
+// A UNIX listener taken over comes last, it is kept if it is bound to the same path
+	if (handoff_fds_n) {
+		struct sockaddr_un addr;
+		socklen_t addr_len = sizeof(addr);
+		int fd = handoff_fds[handoff_fds_n - 1];
+		if (getsockname(fd, (struct sockaddr *)&addr, &addr_len) == 0 && addr.sun_family == AF_UNIX) {
+			handoff_fds_n--;
+			if (unix_path && !strncmp(addr.sun_path, unix_path, sizeof(addr.sun_path))) 
+				unix_socket = fd;
+			else
+				close(fd);
+		}
+	}
+
+// Open the data file, a stale regular one or stale segments are replaced, /dev/aesdchar must exist
+	const char *data_path = (storage_ops->flags & AESD_STORAGE_LOG) ? data_file : DEVICE_FILE;
+	if (aesd_storage_open(&storage, storage_ops, data_path, &retention, snapshot_ordered, NULL) == -1) {
+		fprintf(stderr, "Cannot open %s: %s, exiting\n", data_path, strerror(errno));
+		AESD_LOG(LOG_ERR, "Cannot open %s: %s, exiting", data_path, strerror(errno));
+		goto error_path_not_found;
+	}
+	AESD_LOG(LOG_INFO, "Storage backend %s on %s", storage_ops->name, data_path);
+	if (storage_ops->flags & AESD_STORAGE_RETAIN) 
+		AESD_LOG(LOG_INFO, "Segments of %zu bytes, retaining %zu bytes and %u s, 0 is unlimited",
+				retention.segment_bytes, retention.max_bytes, retention.max_age_s);
+
+// Rings are created per thread on first use
+	if (use_uring) 
+		pthread_key_create(&uring_key, thread_uring_free);
+
+// Responses are served from the snapshot cache, the io_uring path only writes then
+	if (snapshot_cache_max && aesd_snapshot_cache_init(&snapshot_cache, snapshot_cache_max) == -1) {
+		AESD_LOG(LOG_ERR, "Failed to create snapshot cache, serving from file");
+		snapshot_cache_max = 0;
+	}
 // Set up signal handlers
 	setup_signal_handlers();
 
-// Crrate server socket and fork
-	if ((server_socket = create_server_socket()) == -1) {
+// Keep a descriptor in reserve to shed connections when the process runs out of them
+	spare_fd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+
+// Crrate server socket and fork, one taken over is already bound
+	if (handoff_fds_n) {
+		server_socket = handoff_fds[0];
+	} else if ((server_socket = create_server_socket(port)) == -1) {
 		goto error_socket;
 	}
 
+// Same host clients may skip the TCP stack, their connections are served the same way
+	if (unix_path && unix_socket == -1 && (unix_socket = create_unix_socket(unix_path)) == -1) 
+		goto error_unix_socket;
+
 // Become a daemon if selected
 	if (daemonize_flag && daemonize() == -1) {
-		syslog(LOG_ERR, "Failed to daemonize");
+		AESD_LOG(LOG_ERR, "Failed to daemonize");
 		goto error_cannot_fork;
 	}
 
+// Log from a background thread, it must not be started before fork()
+	if (start_log() == -1) 
+		AESD_LOG(LOG_ERR, "Failed to start log thread, logging synchronously: %s", strerror(errno));
+
 // Listen to the socket
-	if (listen(server_socket, BACKLOG) == -1) {
-		syslog(LOG_ERR, "Failed to listen: %s", strerror(errno));
+	if (listen(server_socket, backlog) == -1) {
+		AESD_LOG(LOG_ERR, "Failed to listen: %s", strerror(errno));
 		goto error_cannot_listen;
 	}
+	if (unix_socket != -1) {
+		if (listen(unix_socket, backlog) == -1) {
+			AESD_LOG(LOG_ERR, "Failed to listen on %s: %s", unix_path, strerror(errno));
+			goto error_cannot_listen;
+		}
+		AESD_LOG(LOG_INFO, "Listening on %s as well", unix_path);
+	}
+
+// Start the group committer before any connection can write
+	if (use_group_commit && start_group_commit() == -1) 
+		goto error_cannot_start_commit;
+
+// Start event loops, shards accept themselves
+	if (mode == MODE_EPOLL || mode == MODE_SHARD) {
+		if (!(loops = calloc(loops_n, sizeof(struct event_loop)))) {
+			AESD_LOG(LOG_ERR, "event_loop malloc %s", strerror(errno));
+			goto error_cannot_start_loops;
+		}
+		if ((loops_started = start_event_loops(loops, loops_n, mode == MODE_SHARD, server_socket)) == 0) 
+			goto error_cannot_start_loops;
+		AESD_LOG(LOG_INFO, "Started %d event loops%s", loops_started, (mode == MODE_SHARD) ? " with own listeners" : "");
+	}
+
+// Start worker pool
+	if (mode == MODE_POOL) {
+		if ((workers_started = start_worker_pool(&pool, loops_n)) == 0) 
+			goto error_cannot_start_loops;
+		AESD_LOG(LOG_INFO, "Started %d pool workers", workers_started);
+	}
+
+// Serve followers on their own port, the replication threads inherit blocked signals
+	if (replication_port) {
+		sigset_t old_set;
+		int replication_socket = create_server_socket(replication_port);
+		if (replication_socket == -1 || listen(replication_socket, backlog) == -1) {
+			AESD_LOG(LOG_ERR, "Failed to listen for followers on port %s: %s", replication_port, strerror(errno));
+			if (replication_socket != -1)
+				close(replication_socket);
+			goto error_cannot_start_replication;
+		}
+		block_signals(&old_set);
+		primary_started = (aesd_primary_start(&primary, &storage, replication_socket) == 0);
+		pthread_sigmask(SIG_SETMASK, &old_set, NULL);
+		if (!primary_started) {
+			AESD_LOG(LOG_ERR, "Failed to start replication: %s", strerror(errno));
+			close(replication_socket);
+			goto error_cannot_start_replication;
+		}
+		AESD_LOG(LOG_INFO, "Serving followers on port %s", replication_port);
+	}
+	if (follow_host) {
+		sigset_t old_set;
+		block_signals(&old_set);
+		follower_started = (aesd_follower_start(&follower, &storage, follow_host, follow_port) == 0);
+		pthread_sigmask(SIG_SETMASK, &old_set, NULL);
+		if (!follower_started) {
+			AESD_LOG(LOG_ERR, "Failed to start replication: %s", strerror(errno));
+			goto error_cannot_start_replication;
+		}
+		AESD_LOG(LOG_INFO, "Following %s:%s, serving reads only", follow_host, follow_port);
+	}
+
+// Sockets taken over beyond the listeners of this server are closed, connections queued on them are reset
+	for (int i = (mode == MODE_SHARD) ? loops_started : 1; i < handoff_fds_n; i++) 
+		close(handoff_fds[i]);
+
+// Pass the listening sockets to the next server at a hot restart, the thread inherits blocked signals
+	if (handoff_path) {
+		int fds[AESD_HANDOFF_MAX_FDS], fds_n = 0;
+		sigset_t old_set;
+		fds[fds_n++] = server_socket;
+		for (int i = 1; mode == MODE_SHARD && i < loops_started && fds_n < AESD_HANDOFF_MAX_FDS - 1; i++) 
+			fds[fds_n++] = loops[i].listen_socket;
+		if (unix_socket != -1) 
+			fds[fds_n++] = unix_socket;
+		block_signals(&old_set);
+		handoff_started = (aesd_handoff_start(&handoff, handoff_path, fds, fds_n, handoff_release, handoff_done, NULL) == 0);
+		pthread_sigmask(SIG_SETMASK, &old_set, NULL);
+		if (!handoff_started) 
+			AESD_LOG(LOG_ERR, "Failed to listen on %s, no hot restart: %s", handoff_path, strerror(errno));
+	}
 
 	PDEBUG("server: waiting for connections...\n");
 	running = true;
-	while(running) {  // main accept() loop
+
+// Shards accept on their own, main only waits for the exit signal or accepts on the UNIX socket
+	if (mode == MODE_SHARD && unix_socket == -1) {
+		sigset_t old_set;
+		block_signals(&old_set);
+		while (running && !__atomic_load_n(&handed_off, __ATOMIC_ACQUIRE))
+			sigsuspend(&old_set);
+		pthread_sigmask(SIG_SETMASK, &old_set, NULL);
+	}
+
+	while(running && !__atomic_load_n(&handed_off, __ATOMIC_ACQUIRE) && (mode != MODE_SHARD || unix_socket != -1)) {  // main accept() loop
 		struct sockaddr_storage their_addr; // connector's address information
 		socklen_t sin_size = sizeof their_addr;
 		pthread_t thread_id;
 		struct thread_entry *curr;
+		int listen_socket = server_socket;
 // Accept
-		int client_socket = accept(server_socket, (struct sockaddr *)&their_addr, &sin_size);
+		if (unix_socket != -1 && (listen_socket = wait_listener(server_socket, mode != MODE_SHARD)) == -1) 
+			continue;
+		int client_socket = accept(listen_socket, (struct sockaddr *)&their_addr, &sin_size);
 		if (client_socket == -1) {
-			if (errno != EINTR) 
-				syslog(LOG_ERR, "Failed to accept connection: %s", strerror(errno));
-			goto error_cannot_accept;
+			if (accept_failed(listen_socket) == -1) 
+				goto error_cannot_accept;
+			continue;
+		}
+		unsigned long long accepted_ns = aesd_metrics_now();
+
+// Over a limit, existing connections keep being served and this one is reset
+		if (!connection_admit()) {
+			connection_reject(client_socket);
+			continue;
+		}
+
+// Pass the connection to the next event loop, shards take the ones of the UNIX socket this way
+		if (mode == MODE_EPOLL || mode == MODE_SHARD) {
+			struct connection *conn = malloc(sizeof(struct connection));
+			if (!conn) {
+				AESD_LOG(LOG_ERR, "connection malloc %s", strerror(errno));
+				close(client_socket);
+				goto error_malloc_connection;
+			}
+			memset(conn, 0, sizeof(struct connection));
+			conn->client_socket = client_socket;
+			client_address(&their_addr, conn->client_address, sizeof(conn->client_address));
+			fcntl(client_socket, F_SETFL, fcntl(client_socket, F_GETFL, 0) | O_NONBLOCK);
+			conn->nonblocking = true;
+			struct event_loop *loop = &loops[next_loop++ % loops_started];
+			if (write(loop->handoff[1], &conn, sizeof(conn)) != sizeof(conn)) {
+				AESD_LOG(LOG_ERR, "Failed to pass connection to event loop: %s", strerror(errno));
+				close(client_socket);
+				connection_release();
+				free(conn);
+			}
+			aesd_metrics_record(AESD_STAGE_ACCEPT, aesd_metrics_now() - accepted_ns);
+			continue;
+		}
+
+// Open the connection here and let the pool serve it, no thread is created per client
+		if (mode == MODE_POOL) {
+			struct connection *conn = malloc(sizeof(struct connection));
+			if (!conn) {
+				AESD_LOG(LOG_ERR, "connection malloc %s", strerror(errno));
+				close(client_socket);
+				goto error_malloc_connection;
+			}
+			memset(conn, 0, sizeof(struct connection));
+			conn->client_socket = client_socket;
+			client_address(&their_addr, conn->client_address, sizeof(conn->client_address));
+			fcntl(client_socket, F_SETFL, fcntl(client_socket, F_GETFL, 0) | O_NONBLOCK);
+			conn->nonblocking = true;
+			AESD_LOG(LOG_INFO, "Accepted connection from %s", conn->client_address);
+			if (connection_open(conn) == -1 || worker_pool_add(&pool, conn) == -1) {
+				connection_close(conn);
+				free(conn);
+			}
+			aesd_metrics_record(AESD_STAGE_ACCEPT, aesd_metrics_now() - accepted_ns);
+			continue;
 		}
 
 // Fill in thread params
 		struct thread_params *params = malloc(sizeof(struct thread_params));
 		if (!params) {
-			syslog(LOG_ERR, "thread_params malloc %s", strerror(errno));
+			AESD_LOG(LOG_ERR, "thread_params malloc %s", strerror(errno));
 			goto error_malloc_thread_params;
 		}
 		params->client_socket = client_socket;
 
 // Get IP address of the client
-		inet_ntop(their_addr.ss_family, get_in_addr((struct sockaddr *)&their_addr), params->client_address, sizeof(params->client_address));
+		client_address(&their_addr, params->client_address, sizeof(params->client_address));
 		params->finished = false;
 
 		struct thread_entry *new_thread = malloc(sizeof(struct thread_entry));
 		if (!new_thread) {
-			syslog(LOG_ERR, "thread_entry malloc %s", strerror(errno));
+			AESD_LOG(LOG_ERR, "thread_entry malloc %s", strerror(errno));
 			free(params);
 			goto error_malloc_thread_entry;
 		}
 		if (pthread_create(&thread_id, NULL, connection_thread, params) < 0) {
-			syslog(LOG_ERR, "pthread_create %s", strerror(errno));
+			AESD_LOG(LOG_ERR, "pthread_create %s", strerror(errno));
 			goto error_pthread_create;
 		}
 
@@ -342,37 +1258,78 @@ int main(int argc, char *argv[]) {
 		new_thread->joined = false;
 		new_thread->params = params;
 		SLIST_INSERT_HEAD(&threads, new_thread, entries);
+		aesd_metrics_record(AESD_STAGE_ACCEPT, aesd_metrics_now() - accepted_ns);
 
 // Join exited threads 
 		SLIST_FOREACH(curr, &threads, entries) {
 			if (!curr->joined && curr->params->finished) {
 				if (pthread_join(curr->thread, NULL) < 0) 
-					syslog(LOG_ERR, "pthread_join failed, ignoring ...");
+					AESD_LOG(LOG_ERR, "pthread_join failed, ignoring ...");
 				curr->joined = true;
 				free(curr->params);
 			}
 		}
 	} /* while() */
+	if (!handed_off) 
+		AESD_LOG(LOG_INFO, "Caught signal, exiting");
 	error = false;
 
 error_pthread_create:
 error_malloc_thread_entry:
 error_malloc_thread_params:
+error_malloc_connection:
 error_cannot_accept:
+error_cannot_start_replication:
+// A server connecting from now on starts cold
+	__atomic_store_n(&accept_stopped, true, __ATOMIC_RELEASE);
+	if (handoff_started) 
+		aesd_handoff_stop(&handoff);
+
+// Hot restart, the next server accepts now: serve the connections left until they close or a signal
+// stops this server. Followers reconnect to the next server
+	if (handed_off) {
+		AESD_LOG(LOG_INFO, "Handed off, draining %lu connections", __atomic_load_n(&connections_active, __ATOMIC_RELAXED));
+		for (int i = 0; mode == MODE_SHARD && i < loops_started; i++) 
+			epoll_ctl(loops[i].epoll_fd, EPOLL_CTL_DEL, loops[i].listen_socket, NULL);
+		if (primary_started) {
+			aesd_primary_stop(&primary);
+			close(primary.listen_socket);
+			primary_started = false;
+		}
+		if (follower_started) {
+			aesd_follower_stop(&follower);
+			follower_started = false;
+		}
+		while (running && __atomic_load_n(&connections_active, __ATOMIC_RELAXED)) 
+			poll(NULL, 0, DRAIN_POLL_MS);
+		AESD_LOG(LOG_INFO, "Drained, %lu connections left", __atomic_load_n(&connections_active, __ATOMIC_RELAXED));
+	}
 
-#ifndef USE_AESD_CHAR_DEVICE
-// Delete the file
-	remove(DATA_FILE);
-#else
-	error = error;
-#endif
+// Delete the data files, /dev/aesdchar stays
+	aesd_storage_remove(&storage);
+
+// Stop event loops
+	if (loops_started) 
+		stop_event_loops(loops, loops_started);
+
+// Stop worker pool
+	if (workers_started) 
+		stop_worker_pool(&pool);
+
+// Stop replication, followers get disconnected
+	if (follower_started) 
+		aesd_follower_stop(&follower);
+	if (primary_started) {
+		aesd_primary_stop(&primary);
+		close(primary.listen_socket);
+	}
 
 // Join all threads to finish
 	struct thread_entry *curr;
 	SLIST_FOREACH(curr, &threads, entries) {
 		if (!curr->joined) {
 			if (pthread_join(curr->thread, NULL) < 0) 
-				syslog(LOG_ERR, "pthread_join failed, ignoring ...");
+				AESD_LOG(LOG_ERR, "pthread_join failed, ignoring ...");
 			curr->joined = true;
 			free(curr->params);
 		}
@@ -385,433 +1342,1556 @@ error_cannot_accept:
 		free(curr);
 	}
 
+// All connection threads are gone, report and release pooled buffers
+	struct aesd_buffer_pool_stats pool_stats;
+	aesd_buffer_pool_stats(&pool_stats);
+	AESD_LOG(LOG_INFO, "Buffer pool: %lu hits, %lu misses, %lu oversize", pool_stats.hits, pool_stats.misses, pool_stats.oversize);
+	aesd_buffer_pool_destroy();
+	AESD_LOG(LOG_INFO, "Admission: %lu connections rejected", connections_rejected);
+	aesd_metrics_destroy();
+
+// No writer is left, the committer flushes and syncs what is queued
+	if (commit_started) 
+		stop_group_commit();
+
+// All connections are closed, no snapshot is referenced anymore
+	if (snapshot_cache_max) 
+		aesd_snapshot_cache_destroy(&snapshot_cache);
+
+error_cannot_start_loops:
+	free(loops);
+	if (commit_started) 
+		stop_group_commit();
+error_cannot_start_commit:
 
 error_cannot_listen:
 error_cannot_fork:
-// Close server soocket
+	if (unix_socket != -1) {
+		close(unix_socket);
+		if (!handed_off)
+			unlink(unix_path);
+	}
+error_unix_socket:
+// Close server soocket, one handed off is shared with the next server and must not be shut down
 	if (server_socket != -1) {
-		shutdown(server_socket, SHUT_RDWR);
+		if (!handed_off)
+			shutdown(server_socket, SHUT_RDWR);
 		close(server_socket);
 	}
 error_socket:
+	if (spare_fd != -1) 
+		close(spare_fd);
+	aesd_storage_close(&storage);
 error_path_not_found:
 error_invalid_parameter:
-// Close syslog
+// Log what is queued and close syslog
+	aesd_log_destroy();
 	closelog();
 
 // Exit with exit code
 	exit(error ? SOCKET_ERROR : 0);
 }
 
-// Send single packet
-size_t send_all(int s, char *buf, size_t len, int flag) {
-	size_t total = 0;        // how many bytes we've sent
-	size_t bytesleft = len; // how many we have left to send
-	size_t n;
-
- 	if (!buf || len < 0)
-		return -1;
-	if (len == 0) 
-		return 0;
+// Send as much of buf as the socket takes, less than len only if a nonblocking socket is full
+ssize_t send_some(struct connection *conn, const char *buf, size_t len, int flag) {
+	size_t total = 0;
 
-	while(total < len) {
-		n = send(s, buf+total, bytesleft, flag);
-		if (n == -1) 
+	while (total < len) {
+		ssize_t n = send(conn->client_socket, buf + total, len - total, flag);
+		if (n == -1) {
+			if (errno == EINTR)
+				continue;
+			if (errno == EAGAIN || errno == EWOULDBLOCK) 
+				break;
 			return -1;
+		}
 		total += n;
-		bytesleft -= n;
 	}
-	return total; 
+	aesd_metrics_add(AESD_COUNTER_BYTES_OUT, total);
+	return total;
+}
+
+bool output_pending(struct connection *conn) {
+	return !TAILQ_EMPTY(&conn->pending);
+}
+
+// Queue a copy of bytes the socket did not take
+int output_queue_buf(struct connection *conn, const char *buf, size_t len) {
+	struct pending_output *out = malloc(sizeof(struct pending_output));
+
+	if (!out || !(out->buf = aesd_buffer_alloc(len, &out->allocated))) {
+		AESD_LOG(LOG_ERR, "Failed to malloc memory: %s", strerror(errno));
+		free(out);
+		return -1;
+	}
+	memcpy(out->buf, buf, len);
+	out->offset = 0;
+	out->end = len;
+	out->counted = len;
+	inflight_add(len);
+	TAILQ_INSERT_TAIL(&conn->pending, out, entries);
+	return 0;
+}
+
+// Queue data file bytes [offset, end), they are read once the socket takes them
+int output_queue_range(struct connection *conn, size_t offset, size_t end) {
+	struct pending_output *out = TAILQ_LAST(&conn->pending, pending_list);
+	size_t len = (end != AESD_STORAGE_EOF) ? end - offset : 0;
+
+	if (offset >= end)
+		return 0;
+// Consecutive ranges, as of a batch in tail mode, are sent as one
+	if (out && !out->buf && out->end == offset) {
+		out->end = end;
+		out->counted += len;
+		inflight_add(len);
+		return 0;
+	}
+	if (!(out = malloc(sizeof(struct pending_output)))) {
+		AESD_LOG(LOG_ERR, "Failed to malloc memory: %s", strerror(errno));
+		return -1;
+	}
+	out->buf = NULL;
+	out->allocated = 0;
+	out->offset = offset;
+	out->end = end;
+	out->counted = len;
+	inflight_add(len);
+	TAILQ_INSERT_TAIL(&conn->pending, out, entries);
+	return 0;
+}
+
+void output_remove(struct connection *conn, struct pending_output *out) {
+	TAILQ_REMOVE(&conn->pending, out, entries);
+	inflight_add(-(ssize_t)out->counted);
+	aesd_buffer_free(out->buf, out->allocated);
+	free(out);
+}
+
+// Drop output not sent, the connection is closed
+void output_free(struct connection *conn) {
+	while (output_pending(conn)) 
+		output_remove(conn, TAILQ_FIRST(&conn->pending));
+}
+
+int send_file_some(struct connection *conn, size_t *offset, size_t end);
+
+/***
+ * Send queued output as far as the socket takes it, the connection waits for writability while
+ * output is left and does not read requests meanwhile
+ * @return 
+ * 	 1 all sent
+ * 	 0 the socket is full again
+ *     	-1 failure occured, close the connection
+ */
+int output_flush(struct connection *conn) {
+	struct pending_output *out;
+
+	while ((out = TAILQ_FIRST(&conn->pending))) {
+		if (out->buf) {
+			ssize_t n = send_some(conn, out->buf + out->offset, out->end - out->offset, 0);
+			if (n == -1) {
+				AESD_LOG(LOG_ERR, "Failed to send data: %s", strerror(errno));
+				return -1;
+			}
+			out->offset += n;
+			if (out->offset < out->end) 
+				return 0;
+		} else {
+			int result = send_file_some(conn, &out->offset, out->end);
+			if (result != 1) 
+				return result;
+		}
+		output_remove(conn, out);
+	}
+	return 1;
+}
+
+// Send single packet, what a nonblocking socket does not take is queued behind earlier output
+ssize_t send_all(struct connection *conn, char *buf, size_t len, int flag) {
+	ssize_t n = 0;
+
+	if (!output_pending(conn) && (n = send_some(conn, buf, len, flag)) == -1) 
+		return -1;
+	if (n < len && output_queue_buf(conn, buf + n, len - n) == -1) 
+		return -1;
+	return len;
 } 
 
-// Send entire file contents 
-#ifdef USE_BUFFERED_IO
-size_t send_file(int client_socket, FILE * data_file, bool read_from_zero) {
-#else
-size_t send_file(int client_socket, int data_file, bool read_from_zero) {
-#endif
+// Ring of the calling thread, created on first use and released on thread exit
+struct aesd_uring *thread_uring() {
+	struct aesd_uring *ring = pthread_getspecific(uring_key);
 
-#define SEND_BUF_SIZE 1024
-	char send_buf[SEND_BUF_SIZE];
-	bool no_more_data = false;
-	size_t total_bytes_read = 0;
-	size_t total_bytes_sent = 0;
-	bool error = false;
-	if (client_socket == -1) {
-		syslog(LOG_ERR, "No client socket in send file");
-		error = true;
-		goto error_bad_parameters;
+	if (ring) 
+		return (ring == (void *)&uring_unavailable) ? NULL : ring;
+	if ((ring = malloc(sizeof(struct aesd_uring))) && aesd_uring_init(ring, URING_ENTRIES, URING_BUF_SIZE) == 0) {
+		pthread_setspecific(uring_key, ring);
+		return ring;
 	}
+	AESD_LOG(LOG_ERR, "io_uring not available, falling back to read/write: %s", strerror(errno));
+	free(ring);
+	pthread_setspecific(uring_key, &uring_unavailable);
+	return NULL;
+}
 
-#ifdef USE_FILE_MUTEX
-	pthread_mutex_lock(&file_mutex);
-#endif
+void thread_uring_free(void *ring) {
+	if (ring != &uring_unavailable) {
+		aesd_uring_exit(ring);
+		free(ring);
+	}
+}
 
-// Save file pos ptr
-#ifdef USE_BUFFERED_IO
-	int cur_pos = ftell(data_file);
-	if (read_from_zero)
-		fseek(data_file, 0, SEEK_SET);
-#else
-	int cur_pos = lseek(data_file, 0, SEEK_CUR);
-	if (read_from_zero)
-		lseek(data_file, 0, SEEK_SET);
-#endif
+/***
+ * Append packet to the data file and send the published file back, as one batch of linked
+ * io_uring read/send requests per URING_BUF_SIZE of file data
+ * @return 
+ * 	 0 packet written and file sent
+ *	 1 io_uring not available in this thread, use read/write
+ *     	-1 failure occured, close the connection
+ */
+int uring_write_and_send(struct connection *conn, char *packet_buf, size_t line_length, size_t *cursor) {
+	struct aesd_uring *ring = thread_uring();
+	struct io_uring_sqe *sqe;
+	int results[URING_ENTRIES];
+	size_t offset = cursor ? *cursor : 0, file_size;
+	struct iovec iov = { packet_buf, line_length };
+
+// Output queued for a full socket goes first, the ring would send ahead of it
+	if (!ring || output_pending(conn))
+		return 1;
+	int fds[AESD_URING_FILES] = { conn->data.fd, conn->client_socket };
+
+	if (aesd_uring_set_files(ring, fds) == -1) {
+		AESD_LOG(LOG_ERR, "Failed to register files: %s", strerror(errno));
+		return -1;
+	}
 
-	memset(send_buf, 0, sizeof(send_buf));
-	while(1) {
+// The write goes to its reserved range, the ring reads back what is published after it
+	unsigned long long write_start = aesd_metrics_now(), send_start;
+	AESD_TRACE2(write_begin, conn->client_socket, line_length);
+	if (aesd_storage_append(&conn->data, &iov, 1, NULL) == -1) {
+		AESD_LOG(LOG_ERR, "Failed to write data: %s", strerror(errno));
+		AESD_TRACE3(write_end, conn->client_socket, line_length, -1);
+		return -1;
+	}
+	AESD_TRACE3(write_end, conn->client_socket, line_length, 0);
+	send_start = aesd_metrics_now();
+	aesd_metrics_record(AESD_STAGE_WRITE, send_start - write_start);
+	AESD_TRACE2(send_begin, conn->client_socket, offset);
+	file_size = aesd_storage_size(&conn->data);
+	size_t response = (offset < file_size) ? file_size - offset : 0;
+	inflight_add(response);
+
+	while (offset < file_size) {
+		size_t batch_offset = offset;
+		int chunks = 0;
+		for (char *chunk = ring->buf; chunk < ring->buf + URING_BUF_SIZE && offset < file_size; chunk += URING_CHUNK_SIZE) {
+			size_t len = (file_size - offset < URING_CHUNK_SIZE) ? file_size - offset : URING_CHUNK_SIZE;
+			sqe = aesd_uring_get_sqe(ring);
+			aesd_uring_prep(sqe, IORING_OP_READ_FIXED, 0, chunk, len, offset);
+			sqe->flags = IOSQE_FIXED_FILE | IOSQE_IO_LINK;
+			sqe->buf_index = 0;
+			sqe = aesd_uring_get_sqe(ring);
+			aesd_uring_prep(sqe, IORING_OP_SEND, 1, chunk, len, 0);
+			sqe->flags = IOSQE_FIXED_FILE | IOSQE_IO_LINK;
+// Without MSG_WAITALL a short send completes successfully and the chain goes on, with
+// MSG_DONTWAIT a full nonblocking socket fails the send instead of blocking the ring
+			sqe->msg_flags = MSG_WAITALL | (conn->nonblocking ? MSG_DONTWAIT : 0);
+			offset += len;
+			chunks++;
+		}
+		sqe->flags &= ~IOSQE_IO_LINK;
 
-// read from file
-#ifdef USE_BUFFERED_IO
-		size_t bytes_read = fread(send_buf, 1, sizeof(send_buf), data_file);
-#else
-		size_t bytes_read = read(data_file, send_buf, sizeof(send_buf));
-#endif
-		if (bytes_read < sizeof(send_buf)) {
-#ifdef USE_BUFFERED_IO
-      			if (ferror(data_file)) {   
-            			syslog(LOG_ERR, "Failed to read data: %s", strerror(errno));
-				error = true;
-				break;
-			} 
-			else
-				if (feof(data_file))   
-					no_more_data = true;
-#else
-			if (bytes_read == -1) {
-            			syslog(LOG_ERR, "Failed to read data: %s", strerror(errno));
-				error = true;
+		if (aesd_uring_submit_and_wait(ring, results) == -1) {
+			AESD_LOG(LOG_ERR, "io_uring_enter failed: %s", strerror(errno));
+			inflight_add(-(ssize_t)response);
+			AESD_TRACE2(send_end, conn->client_socket, -1);
+			return -1;
+		}
+
+// Short or failed send breaks the chain, finish the rest with pread/send
+		for (int i = 0; i < chunks; i++) {
+			size_t len = (file_size - batch_offset < URING_CHUNK_SIZE) ? file_size - batch_offset : URING_CHUNK_SIZE;
+			int sent = results[2 * i + 1];
+			if (sent > 0)
+				aesd_metrics_add(AESD_COUNTER_BYTES_OUT, sent);
+			if (results[2 * i] != len || sent != len) {
+				if (sent > 0)
+					batch_offset += sent;
+				PPDEBUG("io_uring send incomplete, sending from '%ld'\n", batch_offset);
+				if (send_file_range(conn, batch_offset, file_size) == -1) {
+					inflight_add(-(ssize_t)response);
+					AESD_TRACE2(send_end, conn->client_socket, -1);
+					return -1;
+				}
+				offset = file_size;
 				break;
-			} 
-#endif
+			}
+			batch_offset += len;
 		}
+	}
 
-		if (bytes_read == 0)
-			break;
-		total_bytes_read += bytes_read;
+	inflight_add(-(ssize_t)response);
+	aesd_metrics_record(AESD_STAGE_SEND, aesd_metrics_now() - send_start);
+	AESD_TRACE2(send_end, conn->client_socket, 0);
+	if (cursor && *cursor < file_size)
+		*cursor = file_size;
+	return 0;
+}
 
-// Send 
-		size_t bytes_sent = send_all(client_socket, send_buf, bytes_read, 0);
-                if (bytes_sent == -1) {
-            		syslog(LOG_ERR, "Failed to send data: %s", strerror(errno));
-			error = true;
-			break;
-		} 
+// Header of a binary protocol response, the body follows in the same segment if it can
+int send_frame_header(struct connection *conn, size_t len) {
+	struct aesd_wire_header header;
 
-		PPDEBUG("bytes read '%ld' bytes sent '%ld'\n", bytes_read, bytes_sent);
-		PPDEBUG("send_buf = '%s'\n", (bytes_read < 128) ? send_buf : "not printing");
-		total_bytes_sent += bytes_sent;	
-                if (bytes_sent < bytes_read) {
-            		syslog(LOG_ERR, "Need to fix the send routine");
-            		PDEBUG("Need to fix the send routine\n");
-			error = true;
+	aesd_wire_encode(&header, AESD_WIRE_RESPONSE, len);
+	if (send_all(conn, (char *)&header, sizeof(header), MSG_MORE) == -1) {
+		AESD_LOG(LOG_ERR, "Failed to send data: %s", strerror(errno));
+		return -1;
+	}
+	return 0;
+}
+
+// Send snapshot bytes from offset to its end, bytes evicted from the cache are sent from the file
+ssize_t send_snapshot(struct connection *conn, struct aesd_snapshot *snapshot, size_t offset) {
+	ssize_t total = 0;
+	size_t response = (offset < snapshot->size) ? snapshot->size - offset : 0;
+
+	inflight_add(response);
+	if (offset < snapshot->start) {
+		if (send_file_range(conn, offset, snapshot->start) == -1) {
+			inflight_add(-(ssize_t)response);
+			return -1;
+		}
+		total = snapshot->start - offset;
+		offset = snapshot->start;
+	}
+	while (offset < snapshot->size) {
+		struct aesd_chunk *chunk = snapshot->chunks[(offset - snapshot->start) / AESD_SNAPSHOT_CHUNK_SIZE];
+		size_t chunk_offset = (offset - snapshot->start) % AESD_SNAPSHOT_CHUNK_SIZE;
+		size_t len = AESD_SNAPSHOT_CHUNK_SIZE - chunk_offset;
+		if (len > snapshot->size - offset)
+			len = snapshot->size - offset;
+		ssize_t n = output_pending(conn) ? 0 : send_some(conn, chunk->data + chunk_offset, len, 0);
+		if (n == -1) {
+			total = -1;
 			break;
 		}
-		if (no_more_data)
+		offset += n;
+		total += n;
+// Snapshot bytes are data file bytes, the rest is read from the file once the socket takes it
+		if (n < len) {
+			if (output_queue_range(conn, offset, snapshot->size) == -1) 
+				total = -1;
+			else
+				total += snapshot->size - offset;
 			break;
+		}
 	}
-	PPDEBUG("total bytes read '%ld' total bytes sent '%ld'\n", total_bytes_read, total_bytes_sent);
+	inflight_add(-(ssize_t)response);
+	return total;
+}
 
-// Restore file pos ptr	
-#ifdef USE_BUFFERED_IO
-	fseek(data_file, cur_pos, SEEK_SET);
-#else
-	lseek(data_file, cur_pos, SEEK_SET);
-#endif
+/***
+ * Send data file bytes [*offset, end), up to the end of the data if end is AESD_STORAGE_EOF,
+ * with sendfile() unless zero copy is disabled or refused by the file (aesdchar has no
+ * splice_read), then with reads of the storage. Neither moves the file position. Bytes dropped
+ * by retention meanwhile are skipped, except in a binary protocol response
+ * @param offset advances by the bytes sent
+ * @return 
+ * 	 1 sent
+ * 	 0 a nonblocking socket is full, the rest is left
+ *     	-1 failure occured, close the connection
+ */
+int send_file_some(struct connection *conn, size_t *offset, size_t end) {
+	struct aesd_storage_handle *data = &conn->data;
+	char send_buf[SEND_BUF_SIZE];
 
-#ifdef USE_FILE_MUTEX
-	pthread_mutex_unlock(&file_mutex);
-#endif
-error_bad_parameters:
-	return (error) ? -1 : total_bytes_sent;
+	while (use_zero_copy && data->fd != -1 && *offset < end) {
+		off_t pos = *offset;
+		size_t len = (end - *offset < ZERO_COPY_CHUNK_SIZE) ? end - *offset : ZERO_COPY_CHUNK_SIZE;
+		ssize_t n = sendfile(conn->client_socket, data->fd, &pos, len);
+		if (n == -1) {
+			if (errno == EINTR)
+				continue;
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+				return 0;
+			if (errno == EINVAL || errno == ENOSYS)
+				break;
+			AESD_LOG(LOG_ERR, "Failed to send data: %s", strerror(errno));
+			return -1;
+		}
+		if (n == 0) {
+			if (end == AESD_STORAGE_EOF)
+				return 1;
+			AESD_LOG(LOG_ERR, "Failed to read data: unexpected end of file");
+			return -1;
+		}
+		aesd_metrics_add(AESD_COUNTER_BYTES_OUT, n);
+		*offset += n;
+	}
+
+	while (*offset < end) {
+		size_t len = (end - *offset < sizeof(send_buf)) ? end - *offset : sizeof(send_buf);
+		ssize_t bytes_read = aesd_storage_read(data, send_buf, len, *offset);
+		if (bytes_read == 0 && end == AESD_STORAGE_EOF)
+			break;
+// Retention dropped the rest of the segment meanwhile, go on with what is retained. A frame
+// header announced the skipped bytes, the client would lose track of the frames
+		if (bytes_read == -1 && errno == ENODATA) {
+			if (conn->protocol == PROTOCOL_BINARY) {
+				AESD_LOG(LOG_WARNING, "Retention dropped data of a response being sent, closing the binary connection");
+				return -1;
+			}
+			*offset = aesd_storage_start(data);
+			continue;
+		}
+		if (bytes_read <= 0) {
+			AESD_LOG(LOG_ERR, "Failed to read data: %s", strerror(errno));
+			return -1;
+		}
+// Bytes read but not taken by the socket are read again when it is writable
+		ssize_t n = send_some(conn, send_buf, bytes_read, 0);
+		if (n == -1) {
+			AESD_LOG(LOG_ERR, "Failed to send data: %s", strerror(errno));
+			return -1;
+		}
+		*offset += n;
+		if (n < bytes_read) 
+			return 0;
+	}
+	return 1;
 }
 
-#ifdef USE_AESD_CHAR_DEVICE
 /***
+ * Send data file bytes [offset, end) with send_file_some(), what a nonblocking socket does not
+ * take is queued behind earlier output
  * @return 
- * 	 1 found ioctl msg, do not write the packet_buf to file
- *	 0 not found ioctl msg, so write the packet_buf to file
- *     	-1 found ioctl msg, failure occured, terminate the program
+ * 	 0 sent or queued
+ *     	-1 failure occured, close the connection
  */
-int handle_ioctl_write_xommand(int fd, char *packet_buf) {
-	const char ioctl_msg[] = "AESDCHAR_IOCSEEKTO:";
-	int ioctl_n = strlen(ioctl_msg);
-	char *xy_pos;
+int send_file_range(struct connection *conn, size_t offset, size_t end) {
+	int result = output_pending(conn) ? 0 : send_file_some(conn, &offset, end);
+
+	if (result == 0) 
+		return output_queue_range(conn, offset, end);
+	return (result == -1) ? -1 : 0;
+}
+
+/***
+ * Send the data file from *cursor, or from @param offset without a cursor, up to @param limit
+ * if it is not AESD_STORAGE_EOF. A log backend is sent up to what is published, /dev/aesdchar
+ * up to the end of what the driver keeps, and from what retention kept at the earliest
+ * @param framed sends a binary protocol response header first, the driver is read up to the
+ * size it had then
+ */
+int send_published(struct connection *conn, size_t offset, size_t limit, size_t *cursor, bool framed) {
+	struct aesd_storage_handle *data = &conn->data;
+	size_t end = (data->storage->ops->flags & AESD_STORAGE_LOG) ? aesd_storage_size(data) : AESD_STORAGE_EOF;
+	size_t start = aesd_storage_start(data);
+	size_t response = 0;
+	int result = 0;
+
+	if (limit < end)
+		end = limit;
+
+	if (cursor)
+		offset = *cursor;
+	if (offset < start)
+		offset = start;
+	if (framed) {
+		if (end == AESD_STORAGE_EOF)
+			end = aesd_storage_size(data);
+		if (send_frame_header(conn, (offset < end) ? end - offset : 0) == -1)
+			return -1;
+	}
+	if (offset < end) {
+		response = (end != AESD_STORAGE_EOF) ? end - offset : 0;
+		inflight_add(response);
+		result = send_file_range(conn, offset, end);
+		inflight_add(-(ssize_t)response);
+	}
+	if (result == -1)
+		return -1;
+	if (cursor && *cursor < end)
+		*cursor = end;
+	return 0;
+}
+
+/***
+ * AESDSOCKET_RANGE:<offset>,<length> is answered with data bytes [offset, offset + length),
+ * clipped to the data. Works on every backend, offsets of a log backend never change, those of
+ * the driver shift as it drops writes
+ */
+int command_range(struct connection *conn, const size_t *args, int args_n, size_t *offset, size_t *end) {
+	size_t size = aesd_storage_size(&conn->data);
+
+	*offset = args[0];
+	*end = (args[0] < size && args[1] < size - args[0]) ? args[0] + args[1] : size;
+	PDEBUG("command_range: bytes [%zu, %zu)\n", *offset, *end);
+	return 1;
+}
+
+/***
+ * AESDSOCKET_LAST:<lines> is answered with the last lines, write commands of /dev/aesdchar,
+ * only they are read
+ */
+int command_last(struct connection *conn, const size_t *args, int args_n, size_t *offset, size_t *end) {
+	size_t size = aesd_storage_size(&conn->data);
+
+	if (aesd_storage_find_lines(&conn->data, args[0], size, offset) == -1) {
+		AESD_LOG(LOG_ERR, "Failed to read data: %s", strerror(errno));
+		return -1;
+	}
+	*end = size;
+	PDEBUG("command_last: last %zu lines [%zu, %zu)\n", args[0], *offset, *end);
+	return 1;
+}
+
+/***
+ * AESDCHAR_IOCSEEKTO:<write_cmd>,<write_cmd_offset>[,<length>] of /dev/aesdchar, the response is
+ * sent from there up to the end, or length bytes of it. Data on backends without write commands
+ */
+int command_seekto(struct connection *conn, const size_t *args, int args_n, size_t *offset, size_t *end) {
+	unsigned long long ioctl_start;
+	size_t size;
 	int result;
-	struct aesd_seekto seek_to;
-// empty string
-	if (!packet_buf) {
-       		PDEBUG("handle_ioctl_write_command 1\n");		
-		return 0;	
-	}
-// no substring present
-	if (!(xy_pos = strstr(packet_buf, ioctl_msg))) {
-       		PDEBUG("handle_ioctl_write_command 2\n");
-		return 0;	
-	}
-// no data for ioctl present - string too short
-	PDEBUG("handle_ioctl_write_command sizes (%d, %lu)\n", ioctl_n +4, strlen(packet_buf));
-	if (ioctl_n + 4 < strlen(packet_buf)) {
-       		PDEBUG("handle_ioctl_write_xommand 3\n");
-		return 0;	
-	}
-	xy_pos += ioctl_n;
-// no data for ioctl present - string too short
-	if(strlen(xy_pos) < 2) {
-       		PDEBUG("handle_ioctl_write_command 4\n");
-		return 0;			
-	}
-// read ioctl command arguments
-	result = sscanf(xy_pos, "%d,%d", &seek_to.write_cmd, &seek_to.write_cmd_offset);
+
+	if (!storage_ops->seekto || args[0] > UINT32_MAX || args[1] > UINT32_MAX)
+		return 0;
+	PDEBUG("command_seekto: (%zu, %zu)\n", args[0], args[1]);
+	ioctl_start = aesd_metrics_now();
+	result = aesd_storage_seekto(&conn->data, args[0], args[1], offset);
+	aesd_metrics_record(AESD_STAGE_IOCTL, aesd_metrics_now() - ioctl_start);
+	AESD_TRACE3(ioctl_seek, conn->client_socket, result, *offset);
 	if (result == -1) {
-       		PDEBUG("handle_ioctl_write_command 5\n");
-		return -1;		
-	}
-// number of arguments too little or too much
-	if (result < 2 || result > 2) {
-       		PDEBUG("handle_ioctl_write_command 6\n");
-		return 0;		
-	}
-// perform call
-	PDEBUG("handle_ioctl_write_command: (%u, %u )\n", seek_to.write_cmd, seek_to.write_cmd_offset);
-	if (ioctl(fd, AESDCHAR_IOCSEEKTO, &seek_to) < 0) {
-       		PDEBUG("handle_ioctl_write_command 7\n");
-		syslog(LOG_ERR,"Failed to perform ioctl: %s", strerror(errno));
+		AESD_LOG(LOG_ERR,"Failed to perform ioctl: %s", strerror(errno));
 		return -1;
+	}
+// a length bounds the read, the driver is not read to its end
+	if (args_n == 3) {
+		size = aesd_storage_size(&conn->data);
+		*end = (*offset < size && args[2] < size - *offset) ? *offset + args[2] : size;
+	}
+	return 1;
+}
+
+/***
+ * Send the metrics as "name{labels} value" lines ending with "# EOF", stage histograms come
+ * from aesd_metrics_print(), the rest are server wide counters and gauges
+ * @return 
+ * 	 0 sent
+ *     	-1 failure occured, close the connection
+ */
+int send_stats(struct connection *conn, bool framed) {
+	struct aesd_storage_handle *data = &conn->data;
+	struct aesd_buffer_pool_stats pool_stats;
+	char *text = NULL;
+	size_t text_len = 0;
+	FILE *out;
+	int result = 0;
+
+	if (!(out = open_memstream(&text, &text_len))) {
+		AESD_LOG(LOG_ERR, "Failed to malloc memory: %s", strerror(errno));
+		return -1;
+	}
+	fprintf(out, "aesdsocket_storage_info{backend=\"%s\"} 1\n", storage_ops->name);
+	if (storage_ops->flags & AESD_STORAGE_LOG) {
+		fprintf(out, "aesdsocket_storage_start_bytes %zu\n", aesd_storage_start(data));
+		fprintf(out, "aesdsocket_storage_size_bytes %zu\n", aesd_storage_size(data));
+	}
+	fprintf(out, "aesdsocket_connections_active %lu\n", __atomic_load_n(&connections_active, __ATOMIC_RELAXED));
+	fprintf(out, "aesdsocket_connections_rejected_total %lu\n", __atomic_load_n(&connections_rejected, __ATOMIC_RELAXED));
+	fprintf(out, "aesdsocket_inflight_bytes %lu\n", __atomic_load_n(&inflight_bytes, __ATOMIC_RELAXED));
+	aesd_buffer_pool_stats(&pool_stats);
+	fprintf(out, "aesdsocket_buffer_pool_hits_total %lu\n", pool_stats.hits);
+	fprintf(out, "aesdsocket_buffer_pool_misses_total %lu\n", pool_stats.misses);
+	fprintf(out, "aesdsocket_buffer_pool_oversize_total %lu\n", pool_stats.oversize);
+	if (commit_started) {
+		struct aesd_commit_stats commit_stats;
+		aesd_commit_stats(&commit_queue, &commit_stats);
+		fprintf(out, "aesdsocket_commit_batches_total %lu\n", commit_stats.batches);
+		fprintf(out, "aesdsocket_commit_lines_total %lu\n", commit_stats.lines);
+		fprintf(out, "aesdsocket_commit_syncs_total %lu\n", commit_stats.syncs);
+		fprintf(out, "aesdsocket_commit_batch_max %lu\n", commit_stats.max_batch);
+	}
+	aesd_metrics_print(out, "aesdsocket");
+	fprintf(out, "# EOF\n");
+	if (fclose(out) == EOF) {
+		AESD_LOG(LOG_ERR, "Failed to malloc memory: %s", strerror(errno));
+		result = -1;
+	} else if (framed && send_frame_header(conn, text_len) == -1) {
+		result = -1;
+	} else if (send_all(conn, text, text_len, 0) == -1) {
+		AESD_LOG(LOG_ERR, "Failed to send data: %s", strerror(errno));
+		result = -1;
+	}
+	free(text);
+	return result;
+}
+
+/***
+ * AESDSOCKET_TAIL:1 / AESDSOCKET_TAIL:0 switch tail mode on / off for the connection. In tail
+ * mode a reply holds only the bytes appended since the previous reply, the reply to the command
+ * itself sends the whole file once. The driver drops old writes and shifts offsets, so with
+ * /dev/aesdchar the command is accepted but replies stay complete
+ */
+int command_tail(struct connection *conn, const size_t *args, int args_n, size_t *offset, size_t *end) {
+	if (args[0] > 1)
+		return 0;
+	if (storage_ops->flags & AESD_STORAGE_LOG) 
+		conn->tail = (args[0] == 1);
+	conn->tail_offset = 0;
+	PDEBUG("command_tail: tail mode %zu\n", args[0]);
+	return 1;
+}
+
+// AESDSOCKET_STATS is answered with the metrics instead of the file
+int command_stats(struct connection *conn, const size_t *args, int args_n, size_t *offset, size_t *end) {
+	return (send_stats(conn, conn->protocol == PROTOCOL_BINARY) == -1) ? -1 : 2;
+}
+
+/**
+ * In band command, a line of AESD_COMMAND_PREFIX, the name and either the newline or ':' and
+ * comma separated decimal arguments up to the newline
+ */
+struct command {
+	const char *name;
+	size_t name_len;
+	int args_min;
+	int args_max;
+	/**
+	 * @param offset, @param end set the range of the response, the data file by default
+	 * @return as handle_command()
+	 */
+	int (*handler)(struct connection *conn, const size_t *args, int args_n, size_t *offset, size_t *end);
+};
+
+#define COMMAND(name, args_min, args_max, handler) { name, sizeof(name) - 1, args_min, args_max, handler }
+
+const struct command commands[] = {
+	COMMAND("SOCKET_TAIL", 1, 1, command_tail),
+	COMMAND("SOCKET_STATS", 0, 0, command_stats),
+	COMMAND("SOCKET_RANGE", 2, 2, command_range),
+	COMMAND("SOCKET_LAST", 1, 1, command_last),
+	COMMAND("CHAR_IOCSEEKTO", 2, 3, command_seekto),
+};
+
+/***
+ * Look a line with the command prefix up in the command table and run the command, a line
+ * which is not a well formed command is data
+ * @param offset, @param end receive the range of the response
+ * @return 
+ * 	 2 found command and replied to it, do not write the packet_buf to file
+ * 	 1 found command, do not write the packet_buf to file, send the response range
+ *	 0 not found command, so write the packet_buf to file
+ *     	-1 found command, failure occured, close the connection
+ */
+int handle_command(struct connection *conn, char *packet_buf, size_t line_length, size_t *offset, size_t *end) {
+	const char *name = packet_buf + AESD_COMMAND_PREFIX_LEN;
+	size_t name_space = line_length - AESD_COMMAND_PREFIX_LEN;
+	size_t args[COMMAND_ARGS_MAX];
+	int args_n = 0;
+
+	for (size_t i = 0; i < sizeof(commands) / sizeof(commands[0]); i++) {
+		const struct command *command = &commands[i];
+		if (name_space <= command->name_len || memcmp(name, command->name, command->name_len)) 
+			continue;
+		const char *rest = name + command->name_len;
+		size_t rest_len = name_space - command->name_len;
+		if (command->args_max == 0) {
+			if (rest_len != 1 || *rest != '\n')
+				return 0;
+		} else {
+			if (*rest != ':')
+				return 0;
+			args_n = aesd_command_arguments(rest + 1, rest_len - 1, args, command->args_max);
+			if (args_n < command->args_min)
+				return 0;
+		}
+		return command->handler(conn, args, args_n, offset, end);
+	}
+	return 0;
+}
+
+// Attach the data file and allocate packet buffer for a new connection
+int connection_open(struct connection *conn) {
+	conn->framer.buf = NULL;
+	TAILQ_INIT(&conn->pending);
+// Open file for writing
+	if (aesd_storage_attach(&storage, &conn->data) == -1) { 
+		AESD_LOG(LOG_ERR,"No open file in connection: %s", strerror(errno));
+		goto error_bad_file;
 	} 
-	PDEBUG("handle_ioctl_write_command success\n");
-	return 1;	
+
+// Allocate packet buffer
+	if (aesd_framer_init(&conn->framer, PACKET_BUF_SIZE) == -1) {
+		AESD_LOG(LOG_ERR, "Failed to malloc memory: %s", strerror(errno));
+		goto error_packet_malloc;
+	} 
+	AESD_TRACE1(accept, conn->client_socket);
+	return 0;
+
+error_packet_malloc:
+error_bad_file:
+	aesd_storage_detach(&conn->data);
+	return -1;
 }
-#endif
 
-// Recv / send thread loop
+// Free packet buffer, close data file and client socket
+void connection_close(struct connection *conn) {
+	AESD_TRACE1(close, conn->client_socket);
+// Free packet bnuffer
+	aesd_framer_free(&conn->framer);
+	aesd_storage_detach(&conn->data);
+
+// Close socket
+	shutdown(conn->client_socket, SHUT_RDWR);
+	close(conn->client_socket);
+	conn->client_socket = -1;
+
+// Give back the admission slot and the bytes still counted for it
+	output_free(conn);
+	inflight_add(-(ssize_t)conn->inflight);
+	conn->inflight = 0;
+	connection_release();
+}
+
+/***
+ * Write a complete packet to the file, or handle it as a command, and send the file back
+ * @return 
+ * 	 0 packet handled
+ *     	-1 failure occured, close the connection
+ */
+int connection_packet(struct connection *conn, char *packet_buf, size_t line_length) {
+	bool error = false;
+	size_t offset = 0, end = AESD_STORAGE_EOF;
+	unsigned long long stage_start;
+
+	PPDEBUG("packet_buf = '%.*s'\n", (line_length < 128) ? (int)line_length : 12, (line_length < 128) ? packet_buf : "not printing");
+	PPDEBUG("line length: '%ld'\n", line_length);
+	aesd_metrics_add(AESD_COUNTER_LINES, 1);
+// handle commands, the response is the range they set
+	if (aesd_command_line(packet_buf, line_length)) {
+		switch (handle_command(conn, packet_buf, line_length, &offset, &end)) {
+		case -1:
+			error = true;
+			goto error_packet_send;
+		case 1:
+			goto writing_skipped;
+		case 2:
+			goto packet_sent;
+		}
+	}
+
+// A replica is only written by replication, lines of clients just read it
+	if (follow_host) 
+		goto writing_skipped;
+
+// Queue for the group committer, returns once the line is in the file
+	stage_start = aesd_metrics_now();
+	if (use_group_commit) {
+		AESD_TRACE2(write_begin, conn->client_socket, line_length);
+		if (aesd_commit_append(&commit_queue, packet_buf, line_length, NULL) == -1) {
+			AESD_LOG(LOG_ERR, "Failed to write data: %s", strerror(errno));
+			error = true;
+			goto error_file_write;
+		}
+		goto packet_written;
+	}
+
+// write and send with io_uring, falls back below if not available, binary responses need a header
+	if (use_uring && !snapshot_cache_max && conn->protocol != PROTOCOL_BINARY) {
+		int uring_result = uring_write_and_send(conn, packet_buf, line_length, conn->tail ? &conn->tail_offset : NULL);
+		if (uring_result == -1) {
+			error = true;
+			goto error_packet_send;
+		}
+		if (uring_result == 0) 
+			goto packet_sent;
+	}
+
+// write to file, log backends reserve, write and publish the line without a lock
+	struct iovec iov = { packet_buf, line_length };
+	AESD_TRACE2(write_begin, conn->client_socket, line_length);
+	if (aesd_storage_append(&conn->data, &iov, 1, NULL) == -1) {
+	            	AESD_LOG(LOG_ERR, "Failed to write data: %s", strerror(errno));
+		error = true;
+		goto error_file_write;
+	}
+
+packet_written:
+	aesd_metrics_record(AESD_STAGE_WRITE, aesd_metrics_now() - stage_start);
+	AESD_TRACE3(write_end, conn->client_socket, line_length, 0);
+writing_skipped:
+	stage_start = aesd_metrics_now();
+	AESD_TRACE2(send_begin, conn->client_socket, conn->tail ? conn->tail_offset : offset);
+// Serve from the shared snapshot, no file read, ranges are read from the file
+	if (snapshot_cache_max && end == AESD_STORAGE_EOF) {
+		struct aesd_snapshot *snapshot = aesd_snapshot_get(&snapshot_cache);
+		if (snapshot) {
+			size_t from = conn->tail ? conn->tail_offset : 0;
+			ssize_t sent = -1;
+// Evicted bytes come from the file, from what retention kept at the earliest
+			if (from < snapshot->start && from < aesd_storage_start(&conn->data)) 
+				from = (aesd_storage_start(&conn->data) < snapshot->start) ? aesd_storage_start(&conn->data) : snapshot->start;
+			if (conn->protocol != PROTOCOL_BINARY 
+					|| send_frame_header(conn, (from < snapshot->size) ? snapshot->size - from : 0) == 0) 
+				sent = send_snapshot(conn, snapshot, from);
+			if (sent != -1 && conn->tail && conn->tail_offset < snapshot->size) 
+				conn->tail_offset = snapshot->size;
+			aesd_snapshot_put(snapshot);
+			if (sent == -1) {
+				AESD_LOG(LOG_ERR, "Failed to send data: %s", strerror(errno));
+				error = true;
+				goto error_send;
+			}
+			goto file_sent;
+		}
+	}
+
+// Send what is published, without file_mutex as well
+	if (send_published(conn, offset, end, 
+			(conn->tail && end == AESD_STORAGE_EOF) ? &conn->tail_offset : NULL, conn->protocol == PROTOCOL_BINARY) == -1) {
+		error = true;
+		goto error_send;
+	}
+file_sent:
+	aesd_metrics_record(AESD_STAGE_SEND, aesd_metrics_now() - stage_start);
+error_send:
+	AESD_TRACE2(send_end, conn->client_socket, error ? -1 : 0);
+packet_sent:
+error_packet_send:
+	return (error) ? -1 : 0;
+error_file_write:
+	AESD_TRACE3(write_end, conn->client_socket, line_length, -1);
+	return -1;
+}
+
+// Growable iovec array describing a batched response
+struct response_iov {
+	struct iovec *iov;
+	size_t *offsets;			// data file offset of each iovec, to queue what the socket does not take
+	int iov_n;
+	size_t allocated;			// bytes, from the buffer pool
+	size_t offsets_allocated;
+};
+
+// Where the bytes of a batched response come from
+struct response_source {
+	struct aesd_snapshot *snapshot;		// whole file up to the batch end, or NULL
+	char *prefix;				// file bytes [prefix_start, batch_start) read by the batch, or NULL
+	size_t prefix_allocated;		// if they are sent from the file
+	size_t prefix_start;
+	size_t batch_start;			// file offset of the batch
+	char *batch;				// batch bytes, still in the framer
+};
+
+int response_iov_add(struct response_iov *r, char *base, size_t len, size_t offset) {
+	if (!len)
+		return 0;
+	if ((r->iov_n + 1) * sizeof(struct iovec) > r->allocated) {
+		struct iovec *iov = aesd_buffer_grow(r->iov, r->iov_n * sizeof(struct iovec), (r->iov_n + 1) * sizeof(struct iovec), &r->allocated);
+		if (!iov)
+			return -1;
+		r->iov = iov;
+	}
+	if ((r->iov_n + 1) * sizeof(size_t) > r->offsets_allocated) {
+		size_t *offsets = aesd_buffer_grow(r->offsets, r->iov_n * sizeof(size_t), (r->iov_n + 1) * sizeof(size_t), &r->offsets_allocated);
+		if (!offsets)
+			return -1;
+		r->offsets = offsets;
+	}
+	r->iov[r->iov_n].iov_base = base;
+	r->iov[r->iov_n].iov_len = len;
+	r->offsets[r->iov_n] = offset;
+	r->iov_n++;
+	return 0;
+}
+
+/***
+ * Send iovecs with as few writev() calls as IOV_MAX allows, iovec i holds data file bytes from
+ * offsets[i], what a nonblocking socket does not take is queued as data file ranges
+ */
+int send_iov_all(struct connection *conn, struct iovec *iov, size_t *offsets, int iov_n) {
+	while (iov_n > 0 && !output_pending(conn)) {
+		ssize_t n = writev(conn->client_socket, iov, (iov_n < IOV_MAX) ? iov_n : IOV_MAX);
+		if (n == -1) {
+			if (errno == EINTR)
+				continue;
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+				break;
+			return -1;
+		}
+		aesd_metrics_add(AESD_COUNTER_BYTES_OUT, n);
+		while (iov_n > 0 && n >= iov->iov_len) {
+			n -= iov->iov_len;
+			iov++;
+			offsets++;
+			iov_n--;
+		}
+		if (iov_n > 0) {
+			iov->iov_base = (char *)iov->iov_base + n;
+			iov->iov_len -= n;
+			*offsets += n;
+		}
+	}
+	for (int i = 0; i < iov_n; i++) {
+		if (output_queue_range(conn, offsets[i], offsets[i] + iov[i].iov_len) == -1)
+			return -1;
+	}
+	return 0;
+}
+
+// Send what is gathered in the response so far
+int response_flush(struct connection *conn, struct response_iov *r) {
+	size_t response = 0;
+	int result;
+
+	for (int i = 0; i < r->iov_n; i++)
+		response += r->iov[i].iov_len;
+	inflight_add(response);
+	result = send_iov_all(conn, r->iov, r->offsets, r->iov_n);
+	inflight_add(-(ssize_t)response);
+	if (result == -1) 
+		AESD_LOG(LOG_ERR, "Failed to send data: %s", strerror(errno));
+	r->iov_n = 0;
+	return result;
+}
+
+// Send what is gathered, then file bytes [start, end) from the file
+int response_add_file(struct connection *conn, struct response_iov *r, size_t start, size_t end) {
+	int result;
+
+	inflight_add(end - start);
+	result = (response_flush(conn, r) == -1) ? -1 : send_file_range(conn, start, end);
+	inflight_add(-(ssize_t)(end - start));
+	return result;
+}
+
+// Add file bytes [start, end) to the response, bytes not in memory are sent from the file after what is gathered
+int response_add_range(struct connection *conn, struct response_iov *r, struct response_source *src, size_t start, size_t end) {
+	if (src->snapshot) {
+		if (start < src->snapshot->start) {
+			size_t file_end = (end < src->snapshot->start) ? end : src->snapshot->start;
+			if (response_add_file(conn, r, start, file_end) == -1)
+				return -1;
+			start = file_end;
+		}
+		while (start < end) {
+			struct aesd_chunk *chunk = src->snapshot->chunks[(start - src->snapshot->start) / AESD_SNAPSHOT_CHUNK_SIZE];
+			size_t chunk_offset = (start - src->snapshot->start) % AESD_SNAPSHOT_CHUNK_SIZE;
+			size_t len = AESD_SNAPSHOT_CHUNK_SIZE - chunk_offset;
+			if (len > end - start)
+				len = end - start;
+			if (response_iov_add(r, chunk->data + chunk_offset, len, start) == -1)
+				goto error_malloc;
+			start += len;
+		}
+		return 0;
+	}
+	if (start < src->batch_start) {
+		size_t prefix_end = (end < src->batch_start) ? end : src->batch_start;
+		if (src->prefix) {
+			if (response_iov_add(r, src->prefix + start - src->prefix_start, prefix_end - start, start) == -1)
+				goto error_malloc;
+		} else if (response_add_file(conn, r, start, prefix_end) == -1) {
+			return -1;
+		}
+		start = prefix_end;
+	}
+	if (start < end && response_iov_add(r, src->batch + start - src->batch_start, end - start, start) == -1)
+		goto error_malloc;
+	return 0;
+
+error_malloc:
+	AESD_LOG(LOG_ERR, "Failed to malloc memory: %s", strerror(errno));
+	return -1;
+}
+
+/***
+ * Handle consecutive data packets received together: one append to the file and one vectored
+ * response, which holds what sending the file after each packet in turn would have sent. A file
+ * prefix over BATCH_PREFIX_MAX is sent from the file for each packet instead of being read
+ * @param ends end of each packet relative to batch
+ * @return 
+ * 	 0 batch handled
+ *     	-1 failure occured, close the connection
+ */
+int connection_batch(struct connection *conn, char *batch, size_t *ends, int batch_n) {
+	struct response_source src;
+	struct response_iov r;
+	size_t batch_len = ends[batch_n - 1];
+	int result = -1;
+
+	if (batch_n == 1) 
+		return connection_packet(conn, batch, batch_len);
+	PDEBUG("batch of %d packets, %ld bytes\n", batch_n, batch_len);
+	aesd_metrics_add(AESD_COUNTER_LINES, batch_n);
+
+	memset(&src, 0, sizeof(src));
+	memset(&r, 0, sizeof(r));
+	src.batch = batch;
+
+// The batch is appended as one line, directly or through the group committer
+	struct iovec batch_iov = { batch, batch_len };
+	unsigned long long stage_start = aesd_metrics_now();
+	AESD_TRACE2(write_begin, conn->client_socket, batch_len);
+	if ((use_group_commit ? aesd_commit_append(&commit_queue, batch, batch_len, &src.batch_start) 
+			: aesd_storage_append(&conn->data, &batch_iov, 1, &src.batch_start)) == -1) {
+		AESD_LOG(LOG_ERR, "Failed to write data: %s", strerror(errno));
+		AESD_TRACE3(write_end, conn->client_socket, batch_len, -1);
+		goto error_write;
+	}
+	aesd_metrics_record(AESD_STAGE_WRITE, aesd_metrics_now() - stage_start);
+	AESD_TRACE3(write_end, conn->client_socket, batch_len, 0);
+	stage_start = aesd_metrics_now();
+// Retention may have dropped data with the append, the response starts at what is kept
+	src.prefix_start = aesd_storage_start(&conn->data);
+	if (conn->tail && src.prefix_start < conn->tail_offset)
+		src.prefix_start = conn->tail_offset;
+	AESD_TRACE2(send_begin, conn->client_socket, src.prefix_start);
+
+// Everything before the batch is published with it and does not change anymore, no lock needed
+	if (snapshot_cache_max)
+		src.snapshot = aesd_snapshot_get(&snapshot_cache);
+	if (!src.snapshot && src.prefix_start < src.batch_start && src.batch_start - src.prefix_start <= BATCH_PREFIX_MAX) {
+		size_t prefix_len = src.batch_start - src.prefix_start;
+		ssize_t bytes_read = -1;
+		if ((src.prefix = aesd_buffer_alloc(prefix_len, &src.prefix_allocated))) 
+			bytes_read = aesd_storage_read(&conn->data, src.prefix, prefix_len, src.prefix_start);
+// Appends of other connections dropped more meanwhile, start at what is kept now
+		while (bytes_read == -1 && errno == ENODATA) {
+			src.prefix_start = aesd_storage_start(&conn->data);
+			if (src.prefix_start > src.batch_start)
+				src.prefix_start = src.batch_start;
+			prefix_len = src.batch_start - src.prefix_start;
+			bytes_read = aesd_storage_read(&conn->data, src.prefix, prefix_len, src.prefix_start);
+		}
+		if (bytes_read != prefix_len) {
+			AESD_LOG(LOG_ERR, "Failed to read data: %s", strerror(errno));
+			goto error_read;
+		}
+	}
+
+// Packet i gets file bytes [start_i, batch_start + ends[i]), start_i is the first retained offset or the previous end in tail mode
+	size_t start = src.prefix_start;
+	for (int i = 0; i < batch_n; i++) {
+		size_t end = src.batch_start + ends[i];
+		if (response_add_range(conn, &r, &src, conn->tail ? start : src.prefix_start, end) == -1) 
+			goto error_send;
+		start = end;
+	}
+	if (response_flush(conn, &r) == -1) 
+		goto error_send;
+	if (conn->tail)
+		conn->tail_offset = start;
+	aesd_metrics_record(AESD_STAGE_SEND, aesd_metrics_now() - stage_start);
+	result = 0;
+
+error_send:
+	aesd_buffer_free(r.iov, r.allocated);
+	aesd_buffer_free(r.offsets, r.offsets_allocated);
+error_read:
+	AESD_TRACE2(send_end, conn->client_socket, result);
+	aesd_buffer_free(src.prefix, src.prefix_allocated);
+	aesd_snapshot_put(src.snapshot);
+error_write:
+	return result;
+}
+
+/***
+ * Handle every complete frame of a binary protocol connection, a request is handled like a
+ * line and answered with one response frame
+ * @return 
+ * 	 1 invalid frame, the stream cannot be resynchronized, close the connection
+ * 	 0 frames handled
+ *     	-1 failure occured, close the connection
+ */
+int connection_frames(struct connection *conn) {
+	char *frame;
+	uint8_t type;
+	uint64_t length;
+// Framing time, requests being handled are not counted
+	unsigned long long frame_start = aesd_metrics_now(), frame_ns = 0;
+
+	while ((frame = aesd_framer_peek(&conn->framer, sizeof(struct aesd_wire_header)))) {
+		aesd_wire_decode(frame, &type, &length);
+		if (type != AESD_WIRE_REQUEST || length > AESD_WIRE_MAX_REQUEST) {
+			AESD_LOG(LOG_WARNING, "Invalid frame of type %u with %llu bytes", type, (unsigned long long)length);
+			return 1;
+		}
+		if (!(frame = aesd_framer_take(&conn->framer, sizeof(struct aesd_wire_header) + length)))
+			break;
+		frame += sizeof(struct aesd_wire_header);
+// A request is one whole line, without its newline it would run into the next one in the file
+		if (!length || frame[length - 1] != '\n') {
+			AESD_LOG(LOG_WARNING, "Invalid request of %llu bytes without a newline", (unsigned long long)length);
+			return 1;
+		}
+		frame_ns += aesd_metrics_now() - frame_start;
+		AESD_TRACE3(line, conn->client_socket, length, frame);
+		if (connection_packet(conn, frame, length) == -1) 
+			return -1;
+		frame_start = aesd_metrics_now();
+	}
+	aesd_metrics_record(AESD_STAGE_RECV, frame_ns + aesd_metrics_now() - frame_start);
+	return 0;
+}
+
+/***
+ * Add received data to the packet buffer and handle every packet completed by it
+ * @return 
+ * 	 1 client broke the protocol, close the connection
+ * 	 0 data handled
+ *     	-1 failure occured, close the connection
+ */
+int connection_receive(struct connection *conn, char *recv_buf, int n) {
+	char *packet_buf;
+	size_t line_length;
+	char *batch = NULL;
+	size_t batch_ends[BATCH_MAX];
+	int batch_n = 0;
+// Framing time, packets being handled are not counted
+	unsigned long long frame_start = aesd_metrics_now(), frame_ns = 0, now;
+
+	aesd_metrics_add(AESD_COUNTER_BYTES_IN, n);
+	if (aesd_framer_append(&conn->framer, recv_buf, n) == -1) {
+		AESD_LOG(LOG_ERR, "Failed to realloc memory: %s", strerror(errno));
+		return -1;
+	}
+// Received bytes count as in flight until their packets are handled
+	inflight_add(n);
+	conn->inflight += n;
+	PPDEBUG("n = '%d' packet_buf_used = '%ld' packet_buf_allocated = '%ld'\n", n, conn->framer.used, conn->framer.allocated);
+
+// The preamble switches to the binary protocol, anything else is text, a prefix of it waits
+	if (conn->protocol == PROTOCOL_NEW) {
+		size_t len = conn->framer.used - conn->framer.start;
+		if (len > AESD_WIRE_PREAMBLE_SIZE)
+			len = AESD_WIRE_PREAMBLE_SIZE;
+		if (memcmp(conn->framer.buf + conn->framer.start, AESD_WIRE_PREAMBLE, len)) {
+			conn->protocol = PROTOCOL_TEXT;
+		} else if (len == AESD_WIRE_PREAMBLE_SIZE) {
+			aesd_framer_take(&conn->framer, AESD_WIRE_PREAMBLE_SIZE);
+			conn->protocol = PROTOCOL_BINARY;
+			PDEBUG("binary protocol\n");
+		} else {
+			goto received;
+		}
+	}
+	if (conn->protocol == PROTOCOL_BINARY) {
+		int result = connection_frames(conn);
+		if (result) 
+			return result;
+		goto received;
+	}
+
+// One recv may complete several packets
+	while ((packet_buf = aesd_framer_next(&conn->framer, &line_length))) {
+		now = aesd_metrics_now();
+		frame_ns += now - frame_start;
+		frame_start = now;
+		PDEBUG("Newline found\n");
+		AESD_TRACE3(line, conn->client_socket, line_length, packet_buf);
+// Collect data packets, they are contiguous in the framer, responses need the offsets of a log
+		if ((storage_ops->flags & AESD_STORAGE_LOG) && !follow_host && !aesd_command_line(packet_buf, line_length)) {
+			if (!batch_n)
+				batch = packet_buf;
+			batch_ends[batch_n] = packet_buf + line_length - batch;
+			if (++batch_n == BATCH_MAX) {
+				if (connection_batch(conn, batch, batch_ends, batch_n) == -1) 
+					return -1;
+				batch_n = 0;
+				frame_start = aesd_metrics_now();
+			}
+			continue;
+		}
+// Commands see the effect of the packets before them
+		if (batch_n && connection_batch(conn, batch, batch_ends, batch_n) == -1) 
+			return -1;
+		batch_n = 0;
+		if (connection_packet(conn, packet_buf, line_length) == -1) 
+			return -1;
+		frame_start = aesd_metrics_now();
+	}
+	aesd_metrics_record(AESD_STAGE_RECV, frame_ns + aesd_metrics_now() - frame_start);
+	if (batch_n && connection_batch(conn, batch, batch_ends, batch_n) == -1) 
+		return -1;
+
+received:
+// Only the incomplete line stays counted
+	inflight_add((ssize_t)(conn->framer.used - conn->framer.start) - (ssize_t)conn->inflight);
+	conn->inflight = conn->framer.used - conn->framer.start;
+
+// Decrease memory usage
+	if (aesd_framer_shrink(&conn->framer) == -1) {
+		AESD_LOG(LOG_ERR, "Failed to shrink memory: %s", strerror(errno));
+		return -1;
+	}
+	return 0;
+}
+
+// Recv / send thread loop, a failed connection only ends itself, broken parameters stop the server
 void *connection_thread(void *args) {
 	bool error = false;
 	struct thread_params *params = (struct thread_params*)args;
+	struct connection conn;
 	pid_t tid  = gettid();
 	if (!params) {
-		syslog(LOG_ERR,"Null parameters in connection thread %d", tid);
+		AESD_LOG(LOG_ERR,"Null parameters in connection thread %d", tid);
 		error = true;
 		goto error_null_params;
 	}
 	int client_socket = params->client_socket;
 	if (client_socket == -1) {
-		syslog(LOG_ERR, "No client socket in connection thread %d", tid);
+		AESD_LOG(LOG_ERR, "No client socket in connection thread %d", tid);
 		error = true;
 		goto error_bad_socket;
 	}
-// Print IP addrerss
-	PDEBUG("server: got connection from %s, thread %d\n", params->client_address, tid);
-	syslog(LOG_INFO, "Accepted connection from %s, thread %d", params->client_address, tid);
-
-// Open file for writing
-#ifdef USE_AESD_CHAR_DEVICE
-#ifdef USE_BUFFERED_IO
-	FILE *data_file = fopen(DATA_FILE, "w+");
-#else
-	int data_file = open(DATA_FILE, O_RDWR);
-#endif
-#else
-#ifdef USE_BUFFERED_IO
-	FILE *data_file = fopen(DATA_FILE, "a+");
-#else
-	int data_file = open(DATA_FILE, O_CREAT|O_RDWR|O_APPEND, S_IRUSR|S_IWUSR);  
-#endif
-#endif
-
-#ifdef USE_BUFFERED_IO
-	if (!data_file) { 
-#else
-	if (data_file == -1) { 
-#endif
-		syslog(LOG_ERR,"No open file in connection thread");
-		error = true;
-		goto error_bad_file;
-	} 
-
-#ifndef USE_AESD_CHAR_DEVICE
-// Set file pos at the end (by default it is set at the beginning)
-#ifdef USE_BUFFERED_IO
-	fseek(data_file, 0, SEEK_END);
-#else
-	lseek(data_file, 0, SEEK_END);
-#endif
-#endif
+// Log IP address
+	AESD_LOG(LOG_INFO, "Accepted connection from %s, thread %d", params->client_address, tid);
 
-// Allocate packet buffer if empty 
-#define PACKET_BUF_SIZE    (1024+10)
-#define PACKET_BUF_EXPAND  (1024)
-	char  *packet_buf;
-	size_t packet_buf_allocated = PACKET_BUF_SIZE;	
-	if (!(packet_buf = malloc(packet_buf_allocated))) {
-		syslog(LOG_ERR, "Failed to malloc memory: %s", strerror(errno));
-		error = true;
-		goto error_packet_malloc;
-	} 
+// Open data file and allocate packet buffer
+	memset(&conn, 0, sizeof(conn));
+	conn.client_socket = client_socket;
+	if (connection_open(&conn) == -1) 
+		goto error_connection_open;
 
-	size_t  packet_buf_used = 0;
-	memset(packet_buf, 0, packet_buf_allocated);
-
-#define RECV_BUF_SIZE (1024)
 	char recv_buf[RECV_BUF_SIZE];
 
 // Read and send packets main loop
 	while (1) {
 
 // read packet
-		memset(recv_buf, 0, sizeof(recv_buf));	
 		int n = recv(client_socket, recv_buf, sizeof(recv_buf), 0);
 		if (n == -1) {
-			syslog(LOG_ERR,"Failed to recv data: %s", strerror(errno));
-			error = true;
-			goto error_packet_recv;
+			AESD_LOG(LOG_ERR,"Failed to recv data: %s", strerror(errno));
+			break;
 		}
 
 		if (n == 0) 
 			break;
 
-		if (n > 0) { 
+		if (connection_receive(&conn, recv_buf, n))
+			break;
+	}
 
-// Resize and copy data to packet buffer
-			if (packet_buf_used + n + 1 >= packet_buf_allocated) {
-				PPDEBUG("packet_buf too small, allocating\n");
-				packet_buf_allocated += PACKET_BUF_EXPAND;
-				char *new_buffer = (char *)realloc(packet_buf, packet_buf_allocated);
-				if (new_buffer == NULL) {
-					syslog(LOG_ERR, "Failed to realloc memory: %s", strerror(errno));
-					error = true;
-					goto error_packet_realloc;
-				}
-				packet_buf = new_buffer;
-			}
+error_connection_open:
+// Free packet buffer, close file and socket
+	connection_close(&conn);
+	params->client_socket = -1;
 
-// Buffer still too small
-			if (packet_buf_used + n + 1 >= packet_buf_allocated) {
-				PPDEBUG("packet_buf really too small, exiting\n");
-				syslog(LOG_ERR, "Packet_buf really too small, exiting");
-				error = true;
-				goto error_packet_too_small;
-			}
+// Log IP address
+	AESD_LOG(LOG_INFO, "Closed connection from %s, thread %d", params->client_address, tid);
+	memset(params->client_address, 0, sizeof(params->client_address));
 
-// Copy data to packet buffer
-			strncat(packet_buf, recv_buf, n);
-			packet_buf_used += n;
-			PPDEBUG("n = '%d' packet_buf_used = '%ld' strlen(packet_buf) = '%ld' packet_buf_allocated = '%ld'\n", n, packet_buf_used, strlen(packet_buf), packet_buf_allocated);				
-			PPDEBUG("recv_buf = '%s'\n", (n < 128) ? recv_buf : "not printing");
-			PPDEBUG("packet_buf = '%s'\n", (packet_buf_used < 128) ? packet_buf : "not printing");
-// Find if packet complete
-			char *newline = strchr(packet_buf, '\n');
-			if (newline) {
-				bool read_from_zero = true;
-				PDEBUG("Newline found\n");
-// Compute packet size
-				size_t line_length = newline - packet_buf + 1;
-				
-				PPDEBUG("line length: '%ld'\n", line_length);
-// handle ioctl 				
-#ifdef USE_AESD_CHAR_DEVICE
-#ifdef USE_BUFFERED_IO
-				int ioctl_result = handle_ioctl_write_xommand(fileno(data_file), packet_buf);
-#else
-				int ioctl_result = handle_ioctl_write_xommand(data_file, packet_buf);
-#endif
-				if(ioctl_result == -1) {
-					error = true;
-					goto error_file_ioctl;
-				}  				
-// set not to seek file from zero
-				if(ioctl_result == 1) {			
-					read_from_zero = false;
-					goto writing_skipped;
-				}
-#endif                       
+error_bad_socket:
+error_null_params:
+	if (error)
+		stop_running();
 
-// write to file				
-#ifdef USE_FILE_MUTEX
-// Write packet to file
-				pthread_mutex_lock(&file_mutex);
-#endif
+// Mark thread comp;eted
+	if (params)
+		params->finished = true;
+	return params;
+}
 
-#ifdef USE_BUFFERED_IO
-				size_t written_to_file = fwrite(packet_buf, 1, line_length, data_file);
-				fflush(data_file);
-#else
-				size_t written_to_file = write(data_file, packet_buf, line_length);
-#endif
-#ifdef USE_FILE_MUTEX
-				pthread_mutex_unlock(&file_mutex);
-#endif
-				PPDEBUG("written_to_file = '%ld' '%ld'\n", written_to_file, line_length);
-#ifdef USE_BUFFERED_IO
-				if (written_to_file < line_length && ferror(data_file)) {
-#else
-				if (written_to_file == -1) {
-#endif
-	            			syslog(LOG_ERR, "Failed to write data: %s", strerror(errno));
-					error = true;
-					goto error_file_write;
-				}
+// Close a connection owned by an event loop
+void event_loop_close(struct event_loop *loop, struct connection *conn) {
+	epoll_ctl(loop->epoll_fd, EPOLL_CTL_DEL, conn->client_socket, NULL);
+	LIST_REMOVE(conn, entries);
+	connection_close(conn);
+	AESD_LOG(LOG_INFO, "Closed connection from %s", conn->client_address);
+	free(conn);
+}
 
-writing_skipped:
-// send file
-				if (send_file(client_socket, data_file, read_from_zero) == -1) {
-					error = true;
-					goto error_packet_send;
+// Open a connection handed to or accepted by the loop and watch it, it is closed if that fails
+void event_loop_add(struct event_loop *loop, struct connection *conn) {
+	struct epoll_event ev;
+
+	AESD_LOG(LOG_INFO, "Accepted connection from %s", conn->client_address);
+	if (connection_open(conn) == -1) {
+		connection_close(conn);
+		free(conn);
+		return;
+	}
+	ev.events = EPOLLIN;
+	ev.data.ptr = conn;
+	if (epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, conn->client_socket, &ev) == -1) {
+		AESD_LOG(LOG_ERR, "epoll_ctl %s", strerror(errno));
+		connection_close(conn);
+		free(conn);
+		return;
+	}
+	LIST_INSERT_HEAD(&loop->connections, conn, entries);
+}
+
+// Accept all pending connections of a shard listener, they are served by this loop only
+void event_loop_accept(struct event_loop *loop) {
+	while (1) {
+		struct sockaddr_storage their_addr;
+		socklen_t sin_size = sizeof their_addr;
+		int client_socket = accept4(loop->listen_socket, (struct sockaddr *)&their_addr, &sin_size, SOCK_NONBLOCK);
+		if (client_socket == -1) {
+			if (errno == EAGAIN || errno == EWOULDBLOCK || accept_failed(loop->listen_socket) == -1) 
+				return;
+			continue;
+		}
+		unsigned long long accepted_ns = aesd_metrics_now();
+		if (!connection_admit()) {
+			connection_reject(client_socket);
+			continue;
+		}
+		struct connection *conn = calloc(1, sizeof(struct connection));
+		if (!conn) {
+			AESD_LOG(LOG_ERR, "connection malloc %s", strerror(errno));
+			connection_reject(client_socket);
+			connection_release();
+			return;
+		}
+		conn->client_socket = client_socket;
+		conn->nonblocking = true;
+		client_address(&their_addr, conn->client_address, sizeof(conn->client_address));
+		__atomic_fetch_add(&loop->accepted, 1, __ATOMIC_RELAXED);
+		event_loop_add(loop, conn);
+		aesd_metrics_record(AESD_STAGE_ACCEPT, aesd_metrics_now() - accepted_ns);
+	}
+}
+
+// Watch a connection for requests, or only for writability while it has output queued
+int event_loop_watch(struct event_loop *loop, struct connection *conn) {
+	struct epoll_event ev;
+
+	ev.events = output_pending(conn) ? EPOLLOUT : EPOLLIN;
+	ev.data.ptr = conn;
+	if (epoll_ctl(loop->epoll_fd, EPOLL_CTL_MOD, conn->client_socket, &ev) == -1) {
+		AESD_LOG(LOG_ERR, "epoll_ctl %s", strerror(errno));
+		return -1;
+	}
+	return 0;
+}
+
+// Event loop thread, serves connections passed by main() until the handoff pipe is closed
+void *event_loop_thread(void *args) {
+	struct event_loop *loop = (struct event_loop *)args;
+	struct epoll_event ev, events[MAX_EVENTS];
+	char recv_buf[RECV_BUF_SIZE];
+	bool done = false;
+	bool error = false;
+
+// Handoff pipe is marked by NULL connection
+	ev.events = EPOLLIN;
+	ev.data.ptr = NULL;
+	if (epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, loop->handoff[0], &ev) == -1) {
+		AESD_LOG(LOG_ERR, "epoll_ctl %s", strerror(errno));
+		error = true;
+		goto error_epoll_ctl;
+	}
+
+// Shard listener is marked by the loop itself
+	ev.data.ptr = loop;
+	if (loop->listen_socket != -1 && epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, loop->listen_socket, &ev) == -1) {
+		AESD_LOG(LOG_ERR, "epoll_ctl %s", strerror(errno));
+		error = true;
+		goto error_epoll_ctl;
+	}
+
+	while (!done) {
+		int events_n = epoll_wait(loop->epoll_fd, events, MAX_EVENTS, -1);
+		if (events_n == -1) {
+			if (errno == EINTR)
+				continue;
+			AESD_LOG(LOG_ERR, "epoll_wait %s", strerror(errno));
+			error = true;
+			break;
+		}
+
+		for (int i = 0; i < events_n; i++) {
+			struct connection *conn = events[i].data.ptr;
+
+			if ((void *)conn == loop) {
+				event_loop_accept(loop);
+				continue;
+			}
+
+// New connection or shutdown request
+			if (!conn) {
+				ssize_t r = read(loop->handoff[0], &conn, sizeof(conn));
+				if (r == 0) {
+					done = true;
+					continue;
 				}
+				if (r != sizeof(conn))
+					continue;
+				event_loop_add(loop, conn);
+				continue;
+			}
 
-// Decrease memory usage
-				if (packet_buf_allocated > PACKET_BUF_SIZE) {
-					packet_buf_allocated = PACKET_BUF_SIZE;	
-					char *new_buffer = (char *)realloc(packet_buf, packet_buf_allocated);
-					if (new_buffer == NULL) {
-						syslog(LOG_ERR, "Failed to shrink memory: %s", strerror(errno));
-						error = true;
-						goto error_packet_shrink;
-					}
-					packet_buf = new_buffer;
+// Writable again, requests are read once its output is sent
+			if (output_pending(conn)) {
+				int result = output_flush(conn);
+				if (result == -1) {
+					event_loop_close(loop, conn);
+				} else if (result == 1 && event_loop_watch(loop, conn) == -1) {
+					event_loop_close(loop, conn);
 				}
-				memset(packet_buf, 0, packet_buf_allocated);
-				packet_buf_used = 0;
-			} else 
-				PDEBUG("no newline found\n");
+				continue;
+			}
+
+// Data, EOF or error on a connection
+			int n = recv(conn->client_socket, recv_buf, sizeof(recv_buf), 0);
+			if (n == -1) {
+				if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+					continue;
+				AESD_LOG(LOG_ERR,"Failed to recv data: %s", strerror(errno));
+				event_loop_close(loop, conn);
+				continue;
+			}
+			if (n == 0) {
+				event_loop_close(loop, conn);
+				continue;
+			}
+// A failed connection only ends itself, the loop stops on failures of its own descriptors
+			int result = connection_receive(conn, recv_buf, n);
+			if (result) {
+				event_loop_close(loop, conn);
+			} else if (output_pending(conn) && event_loop_watch(loop, conn) == -1) {
+				event_loop_close(loop, conn);
+			}
 		}
 	}
 
-error_packet_shrink:
-error_packet_send:
-error_file_write:
-error_file_ioctl:
-error_packet_too_small:
-error_packet_realloc:
-error_packet_recv:
-// Free packet bnuffer
-	free(packet_buf);
+error_epoll_ctl:
+// Close remaining connections
+	while (!LIST_EMPTY(&loop->connections)) 
+		event_loop_close(loop, LIST_FIRST(&loop->connections));
+	if (error)
+		stop_running();
+	return NULL;
+}
 
-error_packet_malloc:
-#ifdef USE_BUFFERED_IO
-	fclose(data_file);
-#else
-	close(data_file);
-#endif
+// Close a connection owned by the worker pool
+void worker_pool_close(struct worker_pool *pool, struct connection *conn) {
+	epoll_ctl(pool->epoll_fd, EPOLL_CTL_DEL, conn->client_socket, NULL);
+	pthread_mutex_lock(&pool->lock);
+	LIST_REMOVE(conn, entries);
+	pthread_mutex_unlock(&pool->lock);
+	connection_close(conn);
+	AESD_LOG(LOG_INFO, "Closed connection from %s", conn->client_address);
+	free(conn);
+}
 
-error_bad_file:
-// Close socket
-	shutdown(client_socket, SHUT_RDWR);
-	close(client_socket);
-	params->client_socket = -1;
+// Dispatcher thread, queues ready connections to their home workers
+void *dispatcher_thread(void *args) {
+	struct worker_pool *pool = (struct worker_pool *)args;
+	struct epoll_event ev, events[MAX_EVENTS];
+	bool done = false;
+
+// Wakeup pipe is marked by NULL connection
+	ev.events = EPOLLIN;
+	ev.data.ptr = NULL;
+	if (epoll_ctl(pool->epoll_fd, EPOLL_CTL_ADD, pool->wakeup[0], &ev) == -1) {
+		AESD_LOG(LOG_ERR, "epoll_ctl %s", strerror(errno));
+		stop_running();
+		return NULL;
+	}
 
-// Print IP address
-	PDEBUG("Closed connection from %s. thread %d\n", params->client_address, tid);
-	syslog(LOG_INFO, "Closed connection from %s, thread %d", params->client_address, tid);
-	memset(params->client_address, 0, sizeof(params->client_address));
+	while (!done) {
+		int events_n = epoll_wait(pool->epoll_fd, events, MAX_EVENTS, -1);
+		if (events_n == -1) {
+			if (errno == EINTR)
+				continue;
+			AESD_LOG(LOG_ERR, "epoll_wait %s", strerror(errno));
+			stop_running();
+			break;
+		}
+		for (int i = 0; i < events_n; i++) {
+			struct connection *conn = events[i].data.ptr;
+			if (!conn) {
+				done = true;
+				continue;
+			}
+// EPOLLONESHOT keeps the connection disarmed until a worker has served it, one that cannot be
+// queued would never be served again and is closed
+			if (aesd_work_queue_push(&pool->workers[conn->worker].queue, conn) == -1) {
+				AESD_LOG(LOG_ERR, "Failed to queue connection: %s", strerror(errno));
+				worker_pool_close(pool, conn);
+				continue;
+			}
+			pthread_mutex_lock(&pool->lock);
+			pool->pending++;
+			pthread_cond_signal(&pool->cond);
+			pthread_mutex_unlock(&pool->lock);
+		}
+	}
+	return NULL;
+}
 
-error_bad_socket:
-error_null_params:
-	if (error)
-		running = false;
+// Take a task from own queue or steal one, block while there is none
+struct connection *worker_next_task(struct pool_worker *worker) {
+	struct worker_pool *pool = worker->pool;
+	struct connection *conn = NULL;
+
+	pthread_mutex_lock(&pool->lock);
+	while (!pool->pending && !pool->stopping) 
+		pthread_cond_wait(&pool->cond, &pool->lock);
+	if (pool->stopping) {
+		pthread_mutex_unlock(&pool->lock);
+		return NULL;
+	}
+// Reserve one of the queued tasks, it is in some queue until we take it
+	pool->pending--;
+	pthread_mutex_unlock(&pool->lock);
 
-// Mark thread comp;eted
-	params->finished = true;
-	return params;
+	while (!conn) {
+		if ((conn = aesd_work_queue_pop(&worker->queue))) 
+			break;
+		for (int i = 1; i < pool->workers_n && !conn; i++) 
+			conn = aesd_work_queue_steal(&pool->workers[(worker->id + i) % pool->workers_n].queue);
+	}
+	return conn;
 }
 
+// Worker thread, serves one recv or one flush of queued output of a ready connection per task and rearms it
+void *worker_thread(void *args) {
+	struct pool_worker *worker = (struct pool_worker *)args;
+	struct worker_pool *pool = worker->pool;
+	struct connection *conn;
+	char recv_buf[RECV_BUF_SIZE];
+
+	while ((conn = worker_next_task(worker))) {
+		int result;
+
+// Armed for writability only, requests are read once its output is sent
+		if (output_pending(conn)) {
+			result = (output_flush(conn) == -1) ? -1 : 0;
+		} else {
+			int n = recv(conn->client_socket, recv_buf, sizeof(recv_buf), 0);
+			if (n == -1 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+				AESD_LOG(LOG_ERR,"Failed to recv data: %s", strerror(errno));
+				worker_pool_close(pool, conn);
+				continue;
+			}
+			if (n == 0) {
+				worker_pool_close(pool, conn);
+				continue;
+			}
+			result = n > 0 ? connection_receive(conn, recv_buf, n) : 0;
+		}
+// A failed connection only ends itself, the pool stops on failures of its own descriptors
+		if (result) {
+			worker_pool_close(pool, conn);
+			continue;
+		}
+
+// Rearm, a busy client goes back to the end of the queue
+		struct epoll_event ev;
+		ev.events = (output_pending(conn) ? EPOLLOUT : EPOLLIN) | EPOLLONESHOT;
+		ev.data.ptr = conn;
+		if (epoll_ctl(pool->epoll_fd, EPOLL_CTL_MOD, conn->client_socket, &ev) == -1) {
+			AESD_LOG(LOG_ERR, "epoll_ctl %s", strerror(errno));
+			worker_pool_close(pool, conn);
+		}
+	}
+	return NULL;
+}